@@ -0,0 +1,578 @@
+/*
+ * allocationCollector: receives the allocation files of the tracker through a shared memory ring
+ * and writes them to the session directory while the application is running.
+ *
+ * usage: allocationCollector <shm name> <output directory> [<control fifo> [<perf control fifo> <perf ack fifo>]]
+ * Stops on SIGTERM/SIGINT once everything that was published has been written.
+ *
+ * Objects, stacks and tags of the binary files are decoded as they arrive and
+ * written to ALLOCATION_SESSION_DB, prepareDatabase appends them to the
+ * profile with a few queries instead of decoding every object after the run.
+ *
+ * With a control fifo, tracking starts paused. "enable" and "disable" lines
+ * written to the fifo toggle the tracker and are forwarded to perf record
+ * --control, so both collect the same windows.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "allocationformat.h"
+
+#define COMMIT_MS 1000      /* Interval of the commits of the session database */
+#define CLAIM_CHECK_MS 100   /* Time the chunk at the tail waits for its claimer before the collector checks that it still runs */
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int) {
+   stop = 1;
+}
+
+static uint64_t get_nsecs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* tracking: initial state, 0 if tracking waits for the control fifo */
+static struct allocation_shm *create_ring(const char *name, uint32_t tracking) {
+   int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   if(fd < 0 && errno == EEXIST) {
+      // Left over by a collector that was killed
+      shm_unlink(name);
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   }
+   if(fd < 0) {
+      fprintf(stderr, "shm_open %s failed: %s\n", name, strerror(errno));
+      return NULL;
+   }
+   if(ftruncate(fd, sizeof(struct allocation_shm)) != 0) {
+      fprintf(stderr, "ftruncate %s failed: %s\n", name, strerror(errno));
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+   }
+   void *addr = mmap(NULL, sizeof(struct allocation_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(addr == MAP_FAILED) {
+      fprintf(stderr, "mmap %s failed: %s\n", name, strerror(errno));
+      shm_unlink(name);
+      return NULL;
+   }
+   struct allocation_shm *ring = (struct allocation_shm *)addr;
+   ring->version = ALLOCATION_FORMAT_VERSION;
+   ring->nb_chunks = ALLOCATION_SHM_CHUNKS;
+   ring->tracking = tracking;
+   ring->collector_pid = getpid();
+   ring->head = 0;
+   ring->tail = 0;
+   for(uint64_t i = 0; i < ALLOCATION_SHM_CHUNKS; i++)
+      ring->chunks[i].seq = i;
+   // Trackers only attach once the magic is visible
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   memcpy(ring->magic, ALLOCATION_SHM_MAGIC, sizeof(ring->magic));
+   return ring;
+}
+
+/* Only plain file names are accepted, chunks must not write outside of the output directory */
+static int valid_name(const char *name) {
+   if(name[0] == '\0' || name[0] == '.')
+      return 0;
+   for(const char *c = name; *c; c++)
+      if(*c == '/')
+         return 0;
+   return 1;
+}
+
+/* A binary object or stack file that is decoded into the session database */
+struct stream {
+   int64_t image;                   /* id in allocation_images */
+   std::vector<uint8_t> pending;    /* start of a record that continues in the next chunk */
+   uint64_t last_time = 0;          /* delta bases of the object records */
+   uint64_t last_addr = 0;
+   bool broken = false;             /* an unknown record was found, the rest of the stream is ignored */
+};
+
+struct session_db {
+   sqlite3 *db = NULL;
+   sqlite3_stmt *insert_image = NULL;
+   sqlite3_stmt *insert_object = NULL;
+   sqlite3_stmt *insert_stack = NULL;
+   sqlite3_stmt *insert_tag = NULL;
+   std::unordered_map<std::string, int64_t> images;
+   uint64_t objects = 0;
+   uint64_t last_commit = 0;
+};
+
+struct collector {
+   struct allocation_shm *ring;
+   std::string dir;
+   std::unordered_map<std::string, FILE *> files;
+   std::unordered_map<std::string, struct stream> streams;
+   struct session_db session;
+   uint64_t bytes = 0;
+   uint64_t nb_files = 0;
+   uint64_t lost_chunks = 0;  /* claimed by processes that were killed before they published them */
+   uint64_t stalled_pos = UINT64_MAX;   /* tail position that waits for its claimer, since stalled_since */
+   uint64_t stalled_since = 0;
+
+   int control = -1;          /* commands of the user */
+   int perf_control = -1;     /* perf record --control fifo:<perf_control>,<perf_ack> */
+   int perf_ack = -1;
+   std::string command;       /* partial line read from the control fifo */
+   uint64_t window_start = 0;
+   FILE *windows = NULL;
+};
+
+/* Opened read write, so that the fifo neither blocks the open nor reports end of file when a writer goes away */
+static int open_fifo(const char *path) {
+   int fd = open(path, O_RDWR | O_NONBLOCK);
+   if(fd < 0)
+      fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+   return fd;
+}
+
+static void perf_command(struct collector *c, const char *command) {
+   char ack[16];
+   if(c->perf_control < 0)
+      return;
+   if(write(c->perf_control, command, strlen(command)) < 0) {
+      fprintf(stderr, "Can not send %s to perf: %s\n", command, strerror(errno));
+      return;
+   }
+   struct pollfd p = { c->perf_ack, POLLIN, 0 };
+   if(poll(&p, 1, 1000) <= 0 || read(c->perf_ack, ack, sizeof(ack)) <= 0)
+      fprintf(stderr, "perf did not acknowledge %s", command);
+}
+
+static void write_window(struct collector *c, uint64_t end) {
+   if(!c->windows) {
+      std::string path = c->dir + "/session.allocationWindows";
+      c->windows = fopen(path.c_str(), "a");
+      if(!c->windows) {
+         fprintf(stderr, "open %s failed: %s\n", path.c_str(), strerror(errno));
+         return;
+      }
+   }
+   fprintf(c->windows, "%lu %lu\n", (unsigned long)c->window_start, (unsigned long)end);
+   fflush(c->windows);
+}
+
+/* perf is enabled before and disabled after the tracker, the samples cover every tracked allocation */
+static void set_tracking(struct collector *c, uint32_t tracking) {
+   if(__atomic_load_n(&c->ring->tracking, __ATOMIC_RELAXED) == tracking)
+      return;
+   if(tracking) {
+      perf_command(c, "enable\n");
+      c->window_start = get_nsecs();
+      __atomic_store_n(&c->ring->tracking, 1, __ATOMIC_RELEASE);
+   } else {
+      __atomic_store_n(&c->ring->tracking, 0, __ATOMIC_RELEASE);
+      write_window(c, get_nsecs());
+      perf_command(c, "disable\n");
+   }
+   fprintf(stderr, "Allocation tracking %s\n", tracking ? "enabled" : "disabled");
+}
+
+/* Handles all complete lines of the control fifo */
+static void read_control(struct collector *c) {
+   char buff[256];
+   ssize_t n;
+   if(c->control < 0)
+      return;
+   while((n = read(c->control, buff, sizeof(buff))) > 0) {
+      c->command.append(buff, n);
+      size_t end;
+      while((end = c->command.find('\n')) != std::string::npos) {
+         std::string line = c->command.substr(0, end);
+         c->command.erase(0, end + 1);
+         if(line == "enable")
+            set_tracking(c, 1);
+         else if(line == "disable")
+            set_tracking(c, 0);
+         else if(!line.empty())
+            fprintf(stderr, "Unknown control command %s, use enable or disable\n", line.c_str());
+      }
+   }
+}
+
+static int execute(sqlite3 *db, const char *sql) {
+   char *error = NULL;
+   if(sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+      fprintf(stderr, "%s failed: %s\n", sql, error);
+      sqlite3_free(error);
+      return 0;
+   }
+   return 1;
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+   sqlite3_stmt *stmt = NULL;
+   if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+      fprintf(stderr, "Can not prepare %s: %s\n", sql, sqlite3_errmsg(db));
+   return stmt;
+}
+
+/* Creates ALLOCATION_SESSION_DB (see allocationformat.h), the records are written in one transaction per COMMIT_MS */
+static int open_session(struct collector *c) {
+   struct session_db *s = &c->session;
+   std::string path = c->dir + "/" + ALLOCATION_SESSION_DB;
+   unlink(path.c_str());
+   if(sqlite3_open(path.c_str(), &s->db) != SQLITE_OK) {
+      fprintf(stderr, "open %s failed: %s\n", path.c_str(), sqlite3_errmsg(s->db));
+      return 0;
+   }
+   if(!execute(s->db, "PRAGMA synchronous = OFF") ||
+      !execute(s->db, "CREATE TABLE allocation_images (id integer PRIMARY KEY, name varchar(64) UNIQUE)") ||
+      !execute(s->db, "CREATE TABLE allocation_objects (image_id integer, pid integer, tid integer, cpu integer, \
+address_start bigint, address_end bigint, time_start bigint, time_end bigint, type integer, stack_id integer, tag_id integer)") ||
+      !execute(s->db, "CREATE TABLE allocation_stacks (image_id integer, stack_id integer, frames blob)") ||
+      !execute(s->db, "CREATE TABLE allocation_tags (image_id integer, tag_id integer, name varchar(1024))"))
+      return 0;
+   s->insert_image = prepare(s->db, "INSERT INTO allocation_images (name) VALUES (?)");
+   s->insert_object = prepare(s->db, "INSERT INTO allocation_objects VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+   s->insert_stack = prepare(s->db, "INSERT INTO allocation_stacks VALUES (?, ?, ?)");
+   s->insert_tag = prepare(s->db, "INSERT INTO allocation_tags VALUES (?, ?, ?)");
+   if(!s->insert_image || !s->insert_object || !s->insert_stack || !s->insert_tag)
+      return 0;
+   s->last_commit = get_nsecs();
+   return execute(s->db, "BEGIN TRANSACTION");
+}
+
+static void commit_session(struct collector *c, int last) {
+   struct session_db *s = &c->session;
+   execute(s->db, "COMMIT");
+   s->last_commit = get_nsecs();
+   if(!last)
+      execute(s->db, "BEGIN TRANSACTION");
+}
+
+static void close_session(struct collector *c) {
+   struct session_db *s = &c->session;
+   commit_session(c, 1);
+   sqlite3_finalize(s->insert_image);
+   sqlite3_finalize(s->insert_object);
+   sqlite3_finalize(s->insert_stack);
+   sqlite3_finalize(s->insert_tag);
+   sqlite3_close(s->db);
+}
+
+static void step(sqlite3_stmt *stmt) {
+   if(sqlite3_step(stmt) != SQLITE_DONE)
+      fprintf(stderr, "Can not write to the session database: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+   sqlite3_reset(stmt);
+}
+
+/* Id of the image of a file name: <image>.<suffix> or <image>.<tid>.allocationData */
+static int64_t image_id(struct collector *c, const char *name) {
+   struct session_db *s = &c->session;
+   std::string image(name, strcspn(name, "."));
+   auto it = s->images.find(image);
+   if(it != s->images.end())
+      return it->second;
+   sqlite3_bind_text(s->insert_image, 1, image.c_str(), -1, SQLITE_TRANSIENT);
+   step(s->insert_image);
+   int64_t id = sqlite3_last_insert_rowid(s->db);
+   s->images[image] = id;
+   return id;
+}
+
+/*
+ * Decodes one record at p, returns its size or 0 if it continues after end.
+ * The delta bases are only updated for complete records.
+ */
+static size_t decode_record(struct collector *c, struct stream *st, const uint8_t *p, const uint8_t *end) {
+   struct session_db *s = &c->session;
+   const uint8_t *start = p;
+   uint64_t v[10];
+   if(p >= end)
+      return 0;
+   uint8_t tag = *p++;
+   if(tag == ALLOCATION_RECORD_OBJECT) {
+      // time delta, address delta, size, type, cpu, pid, tid, stack id, lifetime, tag id
+      for(int i = 0; i < 10; i++) {
+         if(!allocation_get_varint(&p, end, &v[i]))
+            return 0;
+      }
+      st->last_time += allocation_zigzag_decode(v[0]);
+      st->last_addr += allocation_zigzag_decode(v[1]);
+      sqlite3_stmt *stmt = s->insert_object;
+      sqlite3_bind_int64(stmt, 1, st->image);
+      sqlite3_bind_int64(stmt, 2, (int64_t)v[5]);
+      sqlite3_bind_int64(stmt, 3, (int64_t)v[6]);
+      sqlite3_bind_int64(stmt, 4, (int64_t)v[4]);
+      sqlite3_bind_int64(stmt, 5, (int64_t)st->last_addr);
+      sqlite3_bind_int64(stmt, 6, (int64_t)(st->last_addr + v[2]));
+      sqlite3_bind_int64(stmt, 7, (int64_t)st->last_time);
+      sqlite3_bind_int64(stmt, 8, v[8] ? (int64_t)(st->last_time + v[8] - 1) : INT64_MAX);
+      sqlite3_bind_int64(stmt, 9, (int64_t)v[3]);
+      sqlite3_bind_int64(stmt, 10, (int64_t)v[7]);
+      sqlite3_bind_int64(stmt, 11, (int64_t)v[9]);
+      step(stmt);
+      s->objects++;
+   } else if(tag == ALLOCATION_RECORD_STACK) {
+      // stack id, number of frames, frames
+      uint64_t frames[2];
+      if(!allocation_get_varint(&p, end, &frames[0]) || !allocation_get_varint(&p, end, &frames[1]))
+         return 0;
+      std::vector<uint64_t> ips;
+      uint64_t ip = 0, delta;
+      for(uint64_t i = 0; i < frames[1]; i++) {
+         if(!allocation_get_varint(&p, end, &delta))
+            return 0;
+         ip += allocation_zigzag_decode(delta);
+         ips.push_back(ip);
+      }
+      sqlite3_stmt *stmt = s->insert_stack;
+      sqlite3_bind_int64(stmt, 1, st->image);
+      sqlite3_bind_int64(stmt, 2, (int64_t)frames[0]);
+      sqlite3_bind_blob(stmt, 3, ips.data(), ips.size() * sizeof(uint64_t), SQLITE_TRANSIENT);
+      step(stmt);
+   } else if(tag == ALLOCATION_RECORD_TAG) {
+      // tag id, name length, name
+      if(!allocation_get_varint(&p, end, &v[0]) || !allocation_get_varint(&p, end, &v[1]) || v[1] > (uint64_t)(end - p))
+         return 0;
+      sqlite3_stmt *stmt = s->insert_tag;
+      sqlite3_bind_int64(stmt, 1, st->image);
+      sqlite3_bind_int64(stmt, 2, (int64_t)v[0]);
+      sqlite3_bind_text(stmt, 3, (const char *)p, (int)v[1], SQLITE_TRANSIENT);
+      step(stmt);
+      p += v[1];
+   } else {
+      st->broken = true;
+      return end - start;
+   }
+   return p - start;
+}
+
+/* Decodes the records of a chunk, a record cut by the end of the chunk is kept for the next one */
+static void decode_chunk(struct collector *c, const char *name, struct stream *st, const uint8_t *data, uint32_t size) {
+   const uint8_t *p = data, *end = data + size;
+   if(st->broken)
+      return;
+   if(!st->pending.empty()) {
+      st->pending.insert(st->pending.end(), data, end);
+      p = st->pending.data();
+      end = p + st->pending.size();
+   }
+   size_t n;
+   while((n = decode_record(c, st, p, end)) > 0)
+      p += n;
+   if(st->broken)
+      fprintf(stderr, "Unknown allocation record in %s, the rest of the file is ignored\n", name);
+   std::vector<uint8_t> rest(p, end);
+   st->pending.swap(rest);
+}
+
+/*
+ * Objects and stacks of the binary format go to the session database, other files are written unchanged.
+ * skip: set to the size of the header in the first chunk of a stream
+ */
+static struct stream *get_stream(struct collector *c, const char *name, const uint8_t *data, uint32_t size, size_t *skip) {
+   *skip = 0;
+   auto it = c->streams.find(name);
+   if(it != c->streams.end())
+      return &it->second;
+   const char *suffix = strrchr(name, '.');
+   if(!suffix || (strcmp(suffix, ".allocationData") != 0 && strcmp(suffix, ".allocationLive") != 0 && strcmp(suffix, ".allocationStacks") != 0))
+      return NULL;
+   // Every stream through the ring starts with the header, text files are written unchanged
+   struct allocation_file_header header;
+   if(size < sizeof(header) || c->files.count(name))
+      return NULL;
+   memcpy(&header, data, sizeof(header));
+   if(memcmp(header.magic, ALLOCATION_FORMAT_MAGIC, sizeof(header.magic)) != 0 || header.version != ALLOCATION_FORMAT_VERSION)
+      return NULL;
+   struct stream &st = c->streams[name];
+   st.image = image_id(c, name);
+   *skip = sizeof(header);
+   return &st;
+}
+
+/* A stream that ends in the middle of a record lost its end, like a file the reader finds truncated */
+static void end_stream(struct collector *c, const std::string &name) {
+   auto it = c->streams.find(name);
+   if(it == c->streams.end())
+      return;
+   if(!it->second.pending.empty() && !it->second.broken)
+      fprintf(stderr, "Warning: %s ends in the middle of a record, the record is ignored\n", name.c_str());
+   c->streams.erase(it);
+}
+
+/* skip: set to the size of the binary header if the stream is reopened and appends to an existing file */
+static FILE *get_file(struct collector *c, const char *name, const uint8_t *data, uint32_t size, size_t *skip) {
+   *skip = 0;
+   auto it = c->files.find(name);
+   if(it != c->files.end())
+      return it->second;
+   std::string path = c->dir + "/" + name;
+   FILE *f = fopen(path.c_str(), "a");
+   if(!f) {
+      fprintf(stderr, "open %s failed: %s\n", path.c_str(), strerror(errno));
+      return NULL;
+   }
+   fseek(f, 0, SEEK_END);
+   if(ftell(f) > 0) {
+      if(size >= sizeof(allocation_file_header) && memcmp(data, ALLOCATION_FORMAT_MAGIC, sizeof(ALLOCATION_FORMAT_MAGIC) - 1) == 0)
+         *skip = sizeof(allocation_file_header);
+   } else {
+      c->nb_files++;
+   }
+   c->files[name] = f;
+   return f;
+}
+
+/* Zombies count as gone, a killed child stays one until its parent waits for it */
+static int process_alive(pid_t pid) {
+   if(kill(pid, 0) != 0 && errno == ESRCH)
+      return 0;
+   char path[64], stat[512];
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+   FILE *f = fopen(path, "r");
+   if(!f)
+      return errno != ENOENT;
+   size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+   fclose(f);
+   stat[n] = '\0';
+   // pid (comm) state ..., comm can contain ')'
+   const char *end = strrchr(stat, ')');
+   return !end || (end[1] != '\0' && end[2] != 'Z' && end[2] != 'X');
+}
+
+/*
+ * A process that is killed between claiming and publishing a chunk never
+ * publishes it, every later chunk of the ring would wait for it. Once the
+ * chunk at the tail waited CLAIM_CHECK_MS, or when the collector stops, it is
+ * skipped if its claimer is gone.
+ */
+static int claimer_gone(struct collector *c, const struct allocation_shm_chunk *chunk, uint64_t pos) {
+   uint64_t claim = __atomic_load_n(&chunk->claim, __ATOMIC_ACQUIRE);
+   if(!allocation_shm_claimed(claim, pos))
+      return 0;
+   uint64_t now = get_nsecs();
+   if(c->stalled_pos != pos) {
+      c->stalled_pos = pos;
+      c->stalled_since = now;
+   }
+   if(!stop && now - c->stalled_since < CLAIM_CHECK_MS * 1000000ULL)
+      return 0;
+   c->stalled_since = now;
+   return !process_alive(allocation_shm_claimer(claim));
+}
+
+/* Writes all chunks that are ready, returns the number of chunks consumed */
+static size_t drain(struct collector *c) {
+   struct allocation_shm *ring = c->ring;
+   size_t nb = 0;
+   for(;;) {
+      uint64_t pos = ring->tail;
+      struct allocation_shm_chunk *chunk = &ring->chunks[pos & (ALLOCATION_SHM_CHUNKS - 1)];
+      int published = __atomic_load_n(&chunk->seq, __ATOMIC_ACQUIRE) == pos + 1;
+      if(!published) {
+         if(!claimer_gone(c, chunk, pos))
+            return nb;
+         // The claimer may have published the chunk right before it exited
+         published = __atomic_load_n(&chunk->seq, __ATOMIC_ACQUIRE) == pos + 1;
+      }
+
+      char name[ALLOCATION_SHM_NAME_MAX];
+      memcpy(name, chunk->name, sizeof(name));
+      name[sizeof(name) - 1] = '\0';
+      size_t skip;
+      if(!published) {
+         c->lost_chunks++;
+      } else if(!valid_name(name) || chunk->size > ALLOCATION_SHM_CHUNK_DATA) {
+         fprintf(stderr, "Ignoring invalid chunk for %s\n", name);
+      } else if(chunk->flags & ALLOCATION_SHM_CLOSE) {
+         auto it = c->files.find(name);
+         if(it != c->files.end()) {
+            fclose(it->second);
+            c->files.erase(it);
+         }
+         end_stream(c, name);
+      } else if(struct stream *st = get_stream(c, name, chunk->data, chunk->size, &skip)) {
+         decode_chunk(c, name, st, chunk->data + skip, chunk->size - skip);
+         c->bytes += chunk->size;
+      } else {
+         FILE *f = get_file(c, name, chunk->data, chunk->size, &skip);
+         if(f) {
+            fwrite(chunk->data + skip, 1, chunk->size - skip, f);
+            c->bytes += chunk->size - skip;
+         }
+      }
+
+      __atomic_store_n(&chunk->seq, pos + ALLOCATION_SHM_CHUNKS, __ATOMIC_RELEASE);
+      ring->tail = pos + 1;
+      nb++;
+   }
+}
+
+int main(int argc, char **argv) {
+   if(argc != 3 && argc != 4 && argc != 6) {
+      fprintf(stderr, "usage: allocationCollector <shm name> <output directory> [<control fifo> [<perf control fifo> <perf ack fifo>]]\n");
+      return 1;
+   }
+   struct collector c;
+   c.dir = argv[2];
+   if(argc >= 4 && (c.control = open_fifo(argv[3])) < 0)
+      return 1;
+   if(argc == 6) {
+      c.perf_control = open_fifo(argv[4]);
+      c.perf_ack = open_fifo(argv[5]);
+      if(c.perf_control < 0 || c.perf_ack < 0)
+         return 1;
+   }
+   if(!open_session(&c))
+      return 1;
+   c.ring = create_ring(argv[1], c.control < 0);
+   if(!c.ring)
+      return 1;
+
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = on_signal;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+
+   struct timespec pause = { 0, 1000000 };
+   while(!stop) {
+      read_control(&c);
+      if(drain(&c) == 0)
+         nanosleep(&pause, NULL);
+      if(get_nsecs() - c.session.last_commit >= COMMIT_MS * 1000000ULL)
+         commit_session(&c, 0);
+   }
+   // The traced processes are gone, write what they published before they exited
+   drain(&c);
+   while(!c.streams.empty())
+      end_stream(&c, c.streams.begin()->first);
+   close_session(&c);
+   if(c.control >= 0 && c.ring->tracking)
+      write_window(&c, get_nsecs());
+   if(c.windows)
+      fclose(c.windows);
+
+   for(auto &f : c.files)
+      fclose(f.second);
+   munmap(c.ring, sizeof(struct allocation_shm));
+   shm_unlink(argv[1]);
+   fprintf(stderr, "Collected %.1f MB of allocation data, %lu objects in %s and %lu files\n", c.bytes / (1024. * 1024.),
+           (unsigned long)c.session.objects, ALLOCATION_SESSION_DB, (unsigned long)c.nb_files);
+   if(c.lost_chunks)
+      fprintf(stderr, "Skipped %lu chunks of processes that were killed before they published them\n", (unsigned long)c.lost_chunks);
+   return 0;
+}
@@ -0,0 +1,183 @@
+#ifndef ALLOCATIONFORMAT_H
+#define ALLOCATIONFORMAT_H
+
+/*
+ * Binary format of the allocation tracker files.
+ * Shared by the tracker (writer), allocationCollector and prepareDatabase (readers).
+ *
+ * A file starts with struct allocation_file_header followed by records.
+ * Every record starts with a one byte tag. Numbers are stored as LEB128 varints.
+ * Timestamps and addresses are stored as zigzag encoded deltas to the previous
+ * record of the same file, so the reader has to decode the records in order.
+ *
+ * File names start with the image of the process: its pid, followed by -<n>
+ * for the n-th program the process started with exec() while it was tracked.
+ *
+ * <image>.<tid>.allocationData files hold the objects released by one thread,
+ * <image>.allocationLive files the objects of one process that were live at exit:
+ * ALLOCATION_RECORD_OBJECT:
+ *    start time delta, address delta, size, type, cpu, pid, tid,
+ *    stack id (0 = no stack), lifetime (end - start + 1, 0 = live at exit),
+ *    tag id (0 = no tag, since version 5)
+ *    type is the ALLOCATION_EVENT_* of the allocation, cpu and tid are the
+ *    cpu and thread that allocated the object
+ *
+ * <image>.allocationStacks files hold the stack table of one process:
+ * ALLOCATION_RECORD_STACK:
+ *    stack id, number of frames,
+ *    frames (instruction pointers, zigzag encoded delta to the previous frame)
+ * ALLOCATION_RECORD_TAG:
+ *    tag id, name length, name (bytes, not terminated)
+ *    names of the pools of ALLOCATION_EVENT_REGION objects (pmp_annotate.h)
+ *
+ * <image>.allocationMaps is a text snapshot of the executable mappings used to
+ * symbolize the instruction pointers offline, one mapping per line:
+ *    start end offset build-id path
+ *
+ * <image>.allocationPages is a text file with the memory policy and madvise()
+ * calls and the page samples of large objects:
+ *    policy time tid call addr length mode nodemask   (madvise: mode is the advice)
+ *    residency time addr node pages   (node -1: pages not touched yet)
+ *    thp time addr rss_kb anon_huge_kb   (prorated from /proc/self/smaps)
+ * Objects mapped with MAP_HUGETLB have type ALLOCATION_EVENT_MMAP + flags
+ * with the MAP_HUGETLB bit (0x40000) set.
+ *
+ * Instead of writing the files itself, the tracker can send them through a
+ * shared memory ring to allocationCollector, which writes them to the session
+ * directory. The ring is an array of chunks, each holds a piece of one file.
+ * Any thread of any process claims chunks in order of head, the collector
+ * consumes them in the same order, so the pieces of a file stay in order.
+ * A chunk is free for position pos if seq == pos and holds data if
+ * seq == pos + 1. A tracker claims a chunk by writing its pid to claim
+ * before it moves head, so a chunk that was claimed is never without a
+ * claimer. Chunks are never dropped while the collector runs, a tracker
+ * waits until a chunk is free. The collector skips a chunk only if its
+ * claimer was killed before it published it, which cuts the file of the
+ * killed process. If the collector exits first, the files end with the
+ * last chunk it wrote, which can cut the last record.
+ * The collector decodes the binary object, stack and tag records as they
+ * arrive and writes them to ALLOCATION_SESSION_DB in the session directory
+ * instead of the files, all other files are written unchanged:
+ *    allocation_images (id, name): image names
+ *    allocation_objects (image_id, pid, tid, cpu, address_start, address_end,
+ *       time_start, time_end, type, stack_id, tag_id): one row per object,
+ *       time_end is INT64_MAX for objects live at exit
+ *    allocation_stacks (image_id, stack_id, frames): frames is an array of
+ *       little endian 64 bit instruction pointers
+ *    allocation_tags (image_id, tag_id, name)
+ * The collector also controls when allocations are tracked: new allocations
+ * are only logged while tracking is set. Every period with tracking set is
+ * written to the session directory as "start end" line (CLOCK_MONOTONIC ns)
+ * of session.allocationWindows.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ALLOCATION_FORMAT_MAGIC    "PMPALLOC"
+#define ALLOCATION_FORMAT_VERSION  5
+
+#define ALLOCATION_RECORD_STACK    2
+#define ALLOCATION_RECORD_OBJECT   3
+#define ALLOCATION_RECORD_TAG      4
+
+/* Event types, also used by the text format. Trackers before version 4 logged releases as events. */
+#define ALLOCATION_EVENT_FREE      0    /* free, delete, old block of a realloc */
+#define ALLOCATION_EVENT_ALLOC     1    /* malloc, calloc, new, realloc, aligned allocations */
+#define ALLOCATION_EVENT_MUNMAP    2    /* munmap, old region of a mremap; size is the unmapped length */
+#define ALLOCATION_EVENT_MREMAP    3    /* new region of a mremap */
+#define ALLOCATION_EVENT_NUMA      4    /* libnuma allocators, the requested placement is in the .allocationPages file */
+#define ALLOCATION_EVENT_REGION    5    /* region of a custom pool, reported with pmp_region_alloc() */
+#define ALLOCATION_EVENT_STATIC    6    /* global or static variable, only created by prepareDatabase */
+#define ALLOCATION_EVENT_STACK     7    /* stack of a thread, from its start to its end */
+#define ALLOCATION_EVENT_MMAP      100  /* mmap, the mmap flags are added to the type */
+
+struct allocation_file_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t tid;     /* pid for stack files */
+};
+
+#define ALLOCATION_SHM_MAGIC       "PMPSHMRG"
+#define ALLOCATION_SHM_CHUNKS      1024     /* must be a power of two */
+#define ALLOCATION_SHM_CHUNK_DATA  16384
+#define ALLOCATION_SHM_NAME_MAX    64
+
+#define ALLOCATION_SHM_CLOSE       1        /* last chunk of a file */
+
+#define ALLOCATION_SESSION_DB      "session.allocations.db"
+
+struct allocation_shm_chunk {
+   uint64_t seq;
+   uint64_t claim;                          /* allocation_shm_claim() of the position and pid of the claimer */
+   uint32_t size;                           /* number of bytes in data */
+   uint32_t flags;
+   char name[ALLOCATION_SHM_NAME_MAX];      /* file name in the session directory */
+   uint8_t data[ALLOCATION_SHM_CHUNK_DATA];
+};
+
+struct allocation_shm {
+   char magic[8];
+   uint32_t version;
+   uint32_t nb_chunks;
+   uint32_t tracking;                       /* 0 while tracking is paused */
+   int32_t collector_pid;                   /* trackers wait for a full ring while this process runs */
+   uint64_t head __attribute__((aligned(64)));   /* next chunk claimed by a tracker */
+   uint64_t tail __attribute__((aligned(64)));   /* next chunk read by the collector */
+   struct allocation_shm_chunk chunks[ALLOCATION_SHM_CHUNKS];
+};
+
+/* The low 32 bits of pos + 1 tag the claim, a zeroed chunk is not claimed for position 0 */
+static inline uint64_t allocation_shm_claim(uint64_t pos, int32_t pid) {
+   return (pos + 1) << 32 | (uint32_t)pid;
+}
+
+static inline int allocation_shm_claimed(uint64_t claim, uint64_t pos) {
+   return (claim >> 32) == (uint32_t)(pos + 1);
+}
+
+static inline int32_t allocation_shm_claimer(uint64_t claim) {
+   return (int32_t)(uint32_t)claim;
+}
+
+/* Max number of bytes of an encoded varint */
+#define ALLOCATION_VARINT_MAX 10
+
+static inline uint64_t allocation_zigzag_encode(int64_t v) {
+   return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t allocation_zigzag_decode(uint64_t v) {
+   return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* Writes v to out, returns the number of written bytes */
+static inline size_t allocation_put_varint(uint8_t *out, uint64_t v) {
+   size_t n = 0;
+   while(v >= 0x80) {
+      out[n++] = (uint8_t)(v | 0x80);
+      v >>= 7;
+   }
+   out[n++] = (uint8_t)v;
+   return n;
+}
+
+/* Reads a varint from *in and advances *in, returns 0 if the input ends before the varint */
+static inline int allocation_get_varint(const uint8_t **in, const uint8_t *end, uint64_t *v) {
+   const uint8_t *p = *in;
+   uint64_t result = 0;
+   unsigned int shift = 0;
+   while(p < end && shift < 64) {
+      uint8_t b = *p++;
+      result |= (uint64_t)(b & 0x7f) << shift;
+      if(!(b & 0x80)) {
+         *in = p;
+         *v = result;
+         return 1;
+      }
+      shift += 7;
+   }
+   return 0;
+}
+
+#endif
@@ -12,18 +12,45 @@
 #include <dlfcn.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
 #include <execinfo.h>
+#include <link.h>
+#include <elf.h>
 #include <new>
 #include <sys/types.h>
 #include <time.h>
+#include <math.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#include "allocationformat.h"
 
-#define ARR_SIZE 550000            /* Max number of malloc per core */
-#define MAX_TID 512                /* Max number of tids to profile */
+#define RING_SIZE 16384            /* Events per thread ring buffer, must be a power of two */
+#define FLUSH_INTERVAL_MS 10       /* Max time between two drains of the ring buffers by the writer thread */
+#define FULL_WAIT_MS 1000          /* Interval in which the writer checks that the collector still runs while the shared ring is full */
 
-#define USE_FRAME_POINTER   0      /* Use Frame Pointers to compute the stack trace (faster) */
-#define CALLCHAIN_SIZE      9      /* stack trace length */
-#define RESOLVE_SYMBS       1      /* Resolve symbols at the end of the execution; quite costly */
-                                   /* If this takes too much time, you can deactivate it or stop memprof before doing it */
+#define MAX_CALLCHAIN_SIZE  32     /* Max stack trace length, ALLOCATION_STACK_DEPTH selects the length at runtime */
+#define UNWIND_COST_SAMPLING 64    /* Measure the duration of every Xth stack trace */
+#define STACK_TABLE_SIZE    65536  /* Max number of distinct stack traces, must be a power of two */
+#define LIVE_TABLE_SIZE   (1 << 21) /* Max number of live tracked objects, must be a power of two */
+#define LIVE_MAX_PROBE      256    /* Max number of slots searched for an address in the live table */
+#define MAX_MAPPINGS        65536  /* Max number of live tracked mmap() regions, the default vm.max_map_count */
+#define PAGE_SAMPLE_MAX_OBJECTS    1024   /* Max number of large objects whose page residency is sampled */
+#define PAGE_SAMPLE_MAX_PAGES      1024   /* Max number of pages of one object queried per sample */
+#define MAX_PAGE_POLICIES   1024   /* Max number of memory policy and madvise() calls buffered for the writer */
+#define MAX_REGION_TAGS     1024   /* Max number of distinct tags of pmp_region_alloc() */
+#define REGION_TAG_LENGTH   64     /* Longer tags are truncated */
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE       25     /* Linux 6.1, missing from older headers */
+#endif
 
 #define NB_ALLOC_TO_IGNORE   0     /* Ignore the first X allocations.                                      */
 
@@ -33,44 +60,318 @@ static int __thread nb_allocs = 0;
 
 extern char *program_invocation_short_name;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static int __thread pid;
 static int __thread tid;
-static int __thread tid_index;
-static int tids[MAX_TID];
 static size_t AllocationMinSize = 0;
+static int BinaryFormat = 1;     /* ALLOCATION_FORMAT=text writes the human readable format instead */
+static int TrackingEnabled = 0;  /* Decided once per process in m_init() */
+static size_t SampleInterval = 0;  /* ALLOCATION_SAMPLE_INTERVAL: mean number of bytes between two logged allocations, 0 logs all */
+static __thread int64_t bytes_until_sample;
+static __thread uint64_t sample_rng;
 
+/*
+ * Exclude tracking of some system tools that often run with apps
+ * Most likely there is no interest in profiling
+ * Reduces overhead because allocations of these apps are not logged
+ * ALLOCATION_EXCLUDE replaces this list, ALLOCATION_INCLUDE tracks only the listed programs
+ */
+static const char *DefaultExcludes = "perf,basename,dirname,cat,mkdir,rm,date,time,tee,cp,mv,bash,sh";
+
+/* Stack trace collection, selected with ALLOCATION_UNWINDER */
+enum unwinder {
+   UNWINDER_BACKTRACE,              /* glibc backtrace(), works without frame pointers but is slow */
+   UNWINDER_FRAME_POINTER,          /* follow frame pointers, requires -fno-omit-frame-pointer */
+   UNWINDER_LIBUNWIND,              /* unw_backtrace() of libunwind with a per thread cache */
+   UNWINDER_CALLER                  /* only the return address of the allocation function */
+};
+static enum unwinder Unwinder = UNWINDER_BACKTRACE;
+static int StackDepth = 9;
+static int (*libunwind_backtrace)(void **, int);
+
+/* Lifetime of one object, logged when the object is released */
 struct log {
-   uint64_t rdt;
+   uint64_t start;
+   uint64_t end;    // 0 if the object was still live at exit
    void *addr;
    size_t size;
-   long entry_type; // 0 free 1 malloc >=100 mmap
-   int cpu;
+   long entry_type; // ALLOCATION_EVENT_* of allocationformat.h
+   int cpu;         // cpu and thread of the allocation
+   int tid;
    unsigned int pid;
 
-   size_t callchain_size;
-   void* callchain_strings[CALLCHAIN_SIZE];
+   uint32_t stack_id; // 0 if no stack trace is available
+   uint32_t tag;      // tag id of pool regions, 0 for other objects
+};
+
+/*
+ * Stack traces are interned in a process wide open addressing hash table.
+ * A slot is claimed by setting its hash, it is published by setting its id.
+ * Events only reference the id, the writer thread emits every stack once.
+ */
+struct stack_entry {
+   uint64_t hash;
+   uint32_t id;
+   uint32_t size;
+   void *frames[MAX_CALLCHAIN_SIZE];
+};
+static struct stack_entry stack_table[STACK_TABLE_SIZE];
+static uint32_t stack_slots[STACK_TABLE_SIZE];   /* slot + 1 of every id - 1 */
+#define STACK_SLOT_SKIPPED UINT32_MAX            /* id of a thread that did not survive fork(), never published */
+static uint32_t nb_stacks;
+static uint32_t nb_written_stacks;
+static size_t stack_table_full;
+static FILE *stack_dump;
+
+/*
+ * Tracked objects that were not released yet, an open addressing table shared
+ * by all threads of the process. A slot is claimed by setting its address to
+ * LIVE_BUSY and published by setting the address of the object; removing an
+ * object takes the slot back to LIVE_BUSY while it is read. Only releases of
+ * objects in the table are logged, together with their allocation.
+ */
+#define LIVE_EMPTY   0
+#define LIVE_DELETED 1
+#define LIVE_BUSY    2
+struct live_object {
+   uintptr_t addr;
+   uint64_t start;
+   uint64_t size;
+   int32_t type;
+   uint32_t stack_id;
+   int32_t tid;
+   int32_t cpu;
+   uint32_t tag;
+};
+static struct live_object live_table[LIVE_TABLE_SIZE];
+static size_t live_table_full;
+static uint64_t live_epoch;   /* objects that started before were inherited by fork(), they belong to the parent */
+/*
+ * Regions of custom pools (pmp_annotate.h) usually start at the same address as
+ * the block they are carved from, their key in the live table has this bit set.
+ */
+#define LIVE_REGION_BIT (1ULL << 63)
+
+/*
+ * Tracked mmap() and mremap() regions are not kept in the live table but
+ * sorted by address, munmap(), mremap() and mmap(MAP_FIXED) can end any part of
+ * them. mappings_lock is held across these system calls, so a region is
+ * removed before the kernel can hand out its addresses again.
+ */
+static struct live_object mappings[MAX_MAPPINGS];
+static size_t nb_mappings;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Tags of pool regions, interned by name. Tag ids are written to the stack file
+ * of the process before the first object that uses them.
+ */
+static char region_tags[MAX_REGION_TAGS][REGION_TAG_LENGTH];
+static uint32_t nb_region_tags;
+static uint32_t nb_written_region_tags;
+static size_t region_tags_full;
+static pthread_mutex_t region_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Page placement and backing. Tracked objects of at least PageSampleMinSize bytes are
+ * added to a small table, every PageSampleInterval ms the writer samples on which nodes
+ * their pages are resident with move_pages() and how much of them is backed by
+ * transparent huge pages from /proc/self/smaps. Calls that set a memory policy or
+ * request huge pages with madvise() are buffered and written by the writer too.
+ * Everything goes to <image>.allocationPages.
+ */
+static size_t PageSampleMinSize = 64 << 20;   /* ALLOCATION_PAGE_SAMPLE_MIN_SIZE, 0 disables residency sampling */
+static int PageSampleInterval = 1000;         /* ALLOCATION_PAGE_SAMPLE_INTERVAL_MS */
+struct large_object {
+   uintptr_t addr;
+   size_t size;
+};
+struct page_policy {
+   uint64_t time;
+   int tid;
+   const char *call;
+   uintptr_t addr;
+   size_t length;
+   int mode;
+   unsigned long nodemask;   /* first 64 nodes */
+};
+static pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct large_object large_objects[PAGE_SAMPLE_MAX_OBJECTS];
+static size_t nb_large_objects;
+static size_t large_objects_full;
+static struct page_policy page_policies[MAX_PAGE_POLICIES];
+static size_t nb_page_policies;
+static size_t page_policies_dropped;
+static FILE *pages_dump;
+
+/*
+ * Every thread owns a single producer / single consumer ring buffer.
+ * The thread itself only advances head, the writer thread only advances tail.
+ *
+ * Rings are kept in a lock free list that only grows. When a thread exits its
+ * ring is retired: the writer drains it, closes its file, frees the entries and
+ * hands the ring to the next new thread. The list is therefore bounded by the
+ * max number of concurrently running threads, not by the number of threads.
+ */
+enum ring_state {
+   RING_FREE,                       /* unused, can be claimed by a new thread */
+   RING_ACTIVE,                     /* owned by a running thread */
+   RING_RETIRED                     /* thread exited, the writer still has to flush it */
 };
-struct log *log_arr[MAX_TID];
-static size_t log_index[MAX_TID];
+
+struct ring {
+   struct ring *next;
+   int state;
+   int tid;
+   struct log *entries;
+   size_t head;
+   size_t tail;
+   size_t dropped;
+   FILE *dump;
+   uint64_t last_rdt;   /* delta encoding state of the binary format */
+   uint64_t last_addr;
+   size_t unwind_calls;
+   size_t unwind_samples;
+   uint64_t unwind_ns;
+};
+static struct ring *rings;
+static __thread struct ring *thread_ring;
+static __thread int thread_exited;
+static size_t exited_dropped;       /* events of threads that already retired their ring */
+static pthread_key_t ring_key;
+
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static int writer_running = 0;
+static int writer_stop = 0;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;   /* held while the output files are written */
 
 void __attribute__((constructor)) m_init(void);
 
+static unsigned long long get_nsecs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Event timestamps. With an invariant TSC events store the raw TSC read by
+ * rdtscp, which also returns the cpu (Linux keeps it in the low 12 bits of
+ * TSC_AUX). The writer converts them to CLOCK_MONOTONIC nanoseconds, so they
+ * still line up with the samples of perf record -k CLOCK_MONOTONIC.
+ */
+static int UseTsc = 0;   /* Decided in m_init(), ALLOCATION_CLOCK=monotonic disables it */
+
+struct tsc_calibration {
+   uint64_t tsc;
+   uint64_t ns;
+};
+static struct tsc_calibration tsc_start;   /* taken in m_init() */
+static struct tsc_calibration tsc_last;    /* taken by the writer before every drain and at exit */
+static double ns_per_tick;
+
 #ifdef __x86_64__
-#define rdtscll(val) { \
-      unsigned int __a,__d;                                        \
-      asm volatile("rdtsc" : "=a" (__a), "=d" (__d));              \
-      (val) = ((unsigned long)__a) | (((unsigned long)__d)<<32);   \
+static inline uint64_t event_time(int *cpu) {
+   if(UseTsc) {
+      unsigned int aux;
+      uint64_t tsc = __rdtscp(&aux);
+      *cpu = aux & 0xfff;
+      return tsc;
    }
+   *cpu = sched_getcpu();
+   return get_nsecs();
+}
+
+/* rdtscp and an invariant TSC that ticks at a constant rate in all power states */
+static int has_invariant_tsc(void) {
+   unsigned int eax, ebx, ecx, edx;
+   if(!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 27)))
+      return 0;
+   if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+      return 0;
+   return 1;
+}
 
+/* Reads the TSC and CLOCK_MONOTONIC as close together as possible */
+static struct tsc_calibration read_calibration(void) {
+   struct tsc_calibration best = { 0, 0 };
+   uint64_t best_window = UINT64_MAX;
+   int i;
+   for(i = 0; i < 5; i++) {
+      unsigned int aux;
+      uint64_t before = __rdtscp(&aux);
+      uint64_t ns = get_nsecs();
+      uint64_t after = __rdtscp(&aux);
+      if(after - before < best_window) {
+         best_window = after - before;
+         best.tsc = before + (after - before) / 2;
+         best.ns = ns;
+      }
+   }
+   return best;
+}
 #else
-#define rdtscll(val) __asm__ __volatile__("rdtsc" : "=A" (val))
+static inline uint64_t event_time(int *cpu) {
+   *cpu = sched_getcpu();
+   return get_nsecs();
+}
+
+static int has_invariant_tsc(void) {
+   return 0;
+}
+
+static struct tsc_calibration read_calibration(void) {
+   struct tsc_calibration none = { 0, 0 };
+   return none;
+}
 #endif
 
-static unsigned long long get_nsecs(void) {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+/*
+ * New calibration point. Events are converted relative to the latest point,
+ * the rate is measured from the start of the process so that the jitter of
+ * single points does not matter.
+ */
+static void calibrate_tsc(void) {
+   struct tsc_calibration now = read_calibration();
+   if(now.tsc > tsc_start.tsc)
+      ns_per_tick = (double)(now.ns - tsc_start.ns) / (now.tsc - tsc_start.tsc);
+   tsc_last = now;
+}
+
+static uint64_t tsc_to_nsecs(uint64_t tsc) {
+   return tsc_last.ns + (int64_t)llround((double)(int64_t)(tsc - tsc_last.tsc) * ns_per_tick);
+}
+
+/* Exponentially distributed number of bytes until the next sampled allocation */
+static int64_t next_sample_interval(void) {
+   if(!sample_rng)
+      sample_rng = (get_nsecs() ^ (uint64_t)&sample_rng) | 1;
+   // xorshift64*
+   sample_rng ^= sample_rng >> 12;
+   sample_rng ^= sample_rng << 25;
+   sample_rng ^= sample_rng >> 27;
+   double u = (((sample_rng * 2685821657736338717ULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+   return (int64_t)(-log(u) * SampleInterval) + 1;
+}
+
+/*
+ * Decides whether an allocation of sz bytes is logged.
+ * With sampling an allocation is logged with probability 1 - exp(-sz / SampleInterval),
+ * prepareDatabase weights it with the inverse of this probability.
+ */
+static inline int is_tracked_size(size_t sz) {
+   if(sz < AllocationMinSize)
+      return 0;
+   if(!SampleInterval)
+      return 1;
+   if(!bytes_until_sample)
+      bytes_until_sample = next_sample_interval();
+   bytes_until_sample -= sz;
+   if(bytes_until_sample > 0)
+      return 0;
+   bytes_until_sample = next_sample_interval();
+   return 1;
 }
 
 static void *(*libc_malloc)(size_t);
@@ -80,51 +381,269 @@ static void *(*libc_realloc)(void *, size_t);
 static void *(*libc_mmap)(void *, size_t, int, int, int, off_t);
 static void *(*libc_mmap64)(void *, size_t, int, int, int, off_t);
 static int (*libc_munmap)(void *, size_t);
+static void *(*libc_mremap)(void *, size_t, size_t, int, ...);
 static void *(*libc_memalign)(size_t, size_t);
 static int (*libc_posix_memalign)(void **, size_t, size_t);
-static void *(*libc_numa_alloc_onnode)(size_t, size_t);
+static void *(*libc_aligned_alloc)(size_t, size_t);
+static void *(*libc_valloc)(size_t);
+static void *(*libc_pvalloc)(size_t);
+static void *(*libc_numa_alloc_onnode)(size_t, int);
 static void *(*libc_numa_alloc_interleaved)(size_t);
+static void *(*libc_numa_alloc_local)(size_t);
+static void *(*libc_numa_alloc)(size_t);
+static void *(*libc_numa_realloc)(void *, size_t, size_t);
+static void (*libc_numa_free)(void *, size_t);
+static int (*libc_execve)(const char *, char *const [], char *const []);
+static int (*libc_execvpe)(const char *, char *const [], char *const []);
+static int (*libc_pthread_create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+static void (*libc_pthread_exit)(void *);
 
 static __attribute__((unused)) int in_first_dlsym = 0;
 static char empty_data[32];
 
-FILE* open_file(int tid) {
-   char buff[125];
-   sprintf(buff, "/tmp/%d.allocationData", tid);
+static const char *OutputDir = "/tmp";     /* ALLOCATION_DIR */
+int _getpid() {
+   if(pid)
+      return pid;
+   return pid = getpid();
+}
+
+static struct allocation_shm *shm_ring;    /* ALLOCATION_SHM, files are sent to allocationCollector if set */
+static size_t shm_dropped;                 /* bytes lost because the collector exited */
+static int shm_collector_gone;             /* set once the collector exited, chunks are dropped from then on */
+
+struct shm_file {
+   char name[ALLOCATION_SHM_NAME_MAX];
+};
+
+/* A collector that was killed can not drain the ring any more, the files end where it stopped */
+static int shm_collector_alive(void) {
+   pid_t collector = __atomic_load_n(&shm_ring->collector_pid, __ATOMIC_RELAXED);
+   return collector == 0 || kill(collector, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Claims the next chunk of the shared ring. While the ring is full the caller
+ * waits for the collector: dropping a chunk would cut a record of the file in
+ * two and lose the delta base of all records after it. Chunks are sent by the
+ * writer thread and by threads that exit, fork or exec, while the writer waits
+ * the other threads drop whole events once their rings are full. Returns NULL
+ * once the collector exited.
+ * The chunk is claimed with the pid of the process before head moves, any
+ * thread that finds a claimed chunk at head moves head on. The collector
+ * skips the chunk if the process is killed before it publishes it.
+ */
+static struct allocation_shm_chunk *shm_claim(uint64_t *claimed) {
+   struct timespec pause = { 0, 100000 };
+   int waited_us = 0;
+   uint64_t pos = __atomic_load_n(&shm_ring->head, __ATOMIC_RELAXED);
+   for(;;) {
+      if(__atomic_load_n(&shm_collector_gone, __ATOMIC_RELAXED))
+         return NULL;
+      struct allocation_shm_chunk *c = &shm_ring->chunks[pos & (ALLOCATION_SHM_CHUNKS - 1)];
+      uint64_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+      if(seq == pos) {
+         uint64_t claim = __atomic_load_n(&c->claim, __ATOMIC_ACQUIRE);
+         uint64_t next = pos;
+         // seq is read again: the claim was read while the chunk was free for pos, not a later one
+         if(!allocation_shm_claimed(claim, pos) && __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == pos &&
+            __atomic_compare_exchange_n(&c->claim, &claim, allocation_shm_claim(pos, _getpid()), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_compare_exchange_n(&shm_ring->head, &next, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            *claimed = pos;
+            return c;
+         }
+         // Claimed by another thread, which may not have moved head yet
+         __atomic_compare_exchange_n(&shm_ring->head, &next, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+         pos = __atomic_load_n(&shm_ring->head, __ATOMIC_RELAXED);
+      } else if((int64_t)(seq - pos) < 0) {
+         // Ring is full, check every FULL_WAIT_MS that the collector is still there
+         if(waited_us >= FULL_WAIT_MS * 1000) {
+            if(!shm_collector_alive()) {
+               __atomic_store_n(&shm_collector_gone, 1, __ATOMIC_RELAXED);
+               return NULL;
+            }
+            waited_us = 0;
+         }
+         nanosleep(&pause, NULL);
+         waited_us += pause.tv_nsec / 1000;
+         pos = __atomic_load_n(&shm_ring->head, __ATOMIC_RELAXED);
+      } else {
+         pos = __atomic_load_n(&shm_ring->head, __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static int shm_send(struct shm_file *f, const char *buf, size_t size, uint32_t flags) {
+   uint64_t pos;
+   struct allocation_shm_chunk *c = shm_claim(&pos);
+   if(!c) {
+      __atomic_add_fetch(&shm_dropped, size, __ATOMIC_RELAXED);
+      return 0;
+   }
+   memcpy(c->name, f->name, sizeof(c->name));
+   memcpy(c->data, buf, size);
+   c->size = size;
+   c->flags = flags;
+   __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+/* fopencookie() write function of files that are sent through the shared ring */
+static ssize_t shm_file_write(void *cookie, const char *buf, size_t size) {
+   struct shm_file *f = (struct shm_file *)cookie;
+   size_t done = 0;
+   while(done < size) {
+      size_t n = size - done < ALLOCATION_SHM_CHUNK_DATA ? size - done : ALLOCATION_SHM_CHUNK_DATA;
+      shm_send(f, buf + done, n, 0);
+      done += n;
+   }
+   return size;
+}
+
+static int shm_file_close(void *cookie) {
+   struct shm_file *f = (struct shm_file *)cookie;
+   shm_send(f, NULL, 0, ALLOCATION_SHM_CLOSE);
+   libc_free(f);
+   return 0;
+}
+
+/* Maps the ring created by allocationCollector, files are written to OutputDir if there is none */
+static void attach_shm(const char *name) {
+   int fd = shm_open(name, O_RDWR, 0);
+   if(fd < 0) {
+      fprintf(stderr, "Allocation collector %s not found, writing allocation files to %s\n", name, OutputDir);
+      return;
+   }
+   void *addr = libc_mmap(NULL, sizeof(struct allocation_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(addr == MAP_FAILED)
+      return;
+   struct allocation_shm *ring = (struct allocation_shm *)addr;
+   if(memcmp(ring->magic, ALLOCATION_SHM_MAGIC, sizeof(ring->magic)) != 0 || ring->version != ALLOCATION_FORMAT_VERSION || ring->nb_chunks != ALLOCATION_SHM_CHUNKS) {
+      fprintf(stderr, "Allocation collector %s is not compatible, writing allocation files to %s\n", name, OutputDir);
+      libc_munmap(addr, sizeof(struct allocation_shm));
+      return;
+   }
+   shm_ring = ring;
+}
+
+/*
+ * Files of a process start with the name of its image: the pid, followed by
+ * -<n> for the n-th program that the process exec'd while it was tracked.
+ * ALLOCATION_EXEC=<pid>:<n> passes n to the next image.
+ */
+static char ImageName[32];
+static int ExecGeneration = 0;
+
+static void set_image_name(void) {
+   if(ExecGeneration)
+      snprintf(ImageName, sizeof(ImageName), "%d-%d", _getpid(), ExecGeneration);
+   else
+      snprintf(ImageName, sizeof(ImageName), "%d", _getpid());
+}
+
+/* <image>.<suffix> for files of the process, <image>.<tid>.<suffix> if tid is set */
+static void file_name(char *buff, size_t size, int tid, const char *suffix) {
+   if(tid)
+      snprintf(buff, size, "%s.%d.%s", ImageName, tid, suffix);
+   else
+      snprintf(buff, size, "%s.%s", ImageName, suffix);
+}
 
-   FILE *dump = fopen(buff, "a+");
-   if(!dump) {
-      fprintf(stderr, "open %s failed\n", buff);
-      exit(-1);
+/*
+ * tid: thread of the file, 0 for files of the whole process
+ * binary: write the header of the binary format to new files
+ */
+FILE* open_file(int tid, const char *suffix, int binary) {
+   char buff[4096];
+   FILE *dump;
+   int is_new = 1;
+   if(shm_ring) {
+      struct shm_file *f = (struct shm_file *)libc_malloc(sizeof(*f));
+      cookie_io_functions_t io = { NULL, shm_file_write, NULL, shm_file_close };
+      file_name(f->name, sizeof(f->name), tid, suffix);
+      dump = fopencookie(f, "w", io);
+      if(!dump) {
+         fprintf(stderr, "open %s failed\n", f->name);
+         exit(-1);
+      }
+   } else {
+      int n = snprintf(buff, sizeof(buff), "%s/", OutputDir);
+      file_name(buff + n, sizeof(buff) - n, tid, suffix);
+      dump = fopen(buff, "a+");
+      if(!dump) {
+         fprintf(stderr, "open %s failed\n", buff);
+         exit(-1);
+      }
+      fseek(dump, 0, SEEK_END);
+      is_new = ftell(dump) == 0;
+   }
+   if(binary && is_new) {
+      struct allocation_file_header header;
+      memcpy(header.magic, ALLOCATION_FORMAT_MAGIC, sizeof(header.magic));
+      header.version = ALLOCATION_FORMAT_VERSION;
+      header.tid = tid ? tid : _getpid();
+      fwrite(&header, sizeof(header), 1, dump);
    }
    return dump;
 }
 
-int _getpid() {
-   if(pid)
-      return pid;
-   return pid = getpid();
+static int __thread _in_trace = 0;
+static void start_writer(void);
+
+/* pthread key destructor, called when a thread exits: hands its ring back to the writer */
+static void retire_thread(void *arg) {
+   struct ring *r = (struct ring*) arg;
+   thread_ring = NULL;
+   thread_exited = 1;
+   __atomic_store_n(&r->state, RING_RETIRED, __ATOMIC_RELEASE);
+   pthread_cond_signal(&writer_cond);
 }
 
-struct log *get_log() {
-	 if(strcmp(program_invocation_short_name,"perf") == 0 ||
-	 strcmp(program_invocation_short_name,"basename") == 0 ||
-	 strcmp(program_invocation_short_name,"dirname") == 0 ||
-	 strcmp(program_invocation_short_name,"cat") == 0 ||
-	 strcmp(program_invocation_short_name,"mkdir") == 0 ||
-	 strcmp(program_invocation_short_name,"rm") == 0 ||
-	 strcmp(program_invocation_short_name,"date") == 0 ||
-	 strcmp(program_invocation_short_name,"time") == 0 ||
-	 strcmp(program_invocation_short_name,"tee") == 0 ||
-	 strcmp(program_invocation_short_name,"cp") == 0 ||
-	 strcmp(program_invocation_short_name,"mv") == 0 ||
-	 strcmp(program_invocation_short_name,"bash") == 0)
-	 {
-		 // Exclude tracking of some system tools that often run with apps
-		 // Most likely there is no interest in profiling
-		 // Reduces overhead because allocations of these apps are not logged
-		 return NULL;
-	 }
+/* Gives the calling thread a ring, reuses the ring of an exited thread when there is one */
+static struct ring *register_thread(void) {
+   struct ring *r;
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   tid = (int) syscall(186); //64b only
+   struct log *entries = (struct log*) libc_malloc(sizeof(struct log) * RING_SIZE);
+   if(!entries) {
+      _in_trace = in_trace;
+      return NULL;
+   }
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+      int expected = RING_FREE;
+      if(__atomic_compare_exchange_n(&r->state, &expected, RING_ACTIVE, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+   }
+   if(!r) {
+      r = (struct ring*) libc_calloc(1, sizeof(*r));
+      if(!r) {
+         libc_free(entries);
+         _in_trace = in_trace;
+         return NULL;
+      }
+      r->state = RING_ACTIVE;
+      r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+      while(!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+         ;
+   }
+   // The writer ignores the ring until entries is published
+   r->tid = tid;
+   r->last_rdt = 0;
+   r->last_addr = 0;
+   __atomic_store_n(&r->entries, entries, __ATOMIC_RELEASE);
+   thread_ring = r;
+   pthread_setspecific(ring_key, r);
+   _in_trace = in_trace;
+   pthread_once(&writer_once, start_writer);
+   return r;
+}
+
+/* Returns the ring of the calling thread, registers the thread if it has none */
+static struct ring *get_ring() {
+   if(!TrackingEnabled)
+      return NULL;
 
 #if NB_ALLOC_TO_IGNORE > 0
    nb_allocs++;
@@ -132,326 +651,1825 @@ struct log *get_log() {
       return NULL;
 #endif
 
-   int i;
-   if(!tid) {
-      tid = (int) syscall(186); //64b only
-      pthread_mutex_lock(&lock);
-      for(i = 1; i < MAX_TID; i++) {
-         if(tids[i] == 0) {
-            tids[i] = tid;
-            tid_index = i;
-            break;
-         }
-      }
-      if(tid_index == 0) {
-         fprintf(stderr, "Too many threads!\n");
-         exit(-1);
+   struct ring *r = thread_ring;
+   if(!r) {
+      if(thread_exited) {
+         // Allocations done by TLS destructors running after ours
+         __atomic_add_fetch(&exited_dropped, 1, __ATOMIC_RELAXED);
+         return NULL;
       }
-      pthread_mutex_unlock(&lock);
+      r = register_thread();
    }
-   if(!log_arr[tid_index])
-      log_arr[tid_index] = (struct log*) libc_malloc(sizeof(*log_arr[tid_index]) * ARR_SIZE);
-   if(log_index[tid_index] >= ARR_SIZE)
-      return NULL;
+   return r;
+}
 
-   struct log *l = &log_arr[tid_index][log_index[tid_index]];
-   //printf("%d %d \n", tid_index, (int)log_index[tid_index]);
-   log_index[tid_index]++;
-   return l;
+struct log *get_log() {
+   struct ring *r = get_ring();
+   if(!r)
+      return NULL;
+   size_t head = r->head;
+   if(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+      // Ring is full: wake up the writer and wait until it drained the ring.
+      // The event is only dropped if there is no writer (any more).
+      struct timespec pause = { 0, 100000 };
+      pthread_cond_signal(&writer_cond);
+      while(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+         if(!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+         }
+         nanosleep(&pause, NULL);
+      }
+   }
+   return &r->entries[head & (RING_SIZE - 1)];
 }
 
+/* Publishes the entry returned by the last get_log() call to the writer thread */
+void commit_log() {
+   struct ring *r = thread_ring;
+   __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
 
-static int __thread _in_trace = 0;
-#define get_bp(bp) asm("movq %%rbp, %0" : "=r" (bp) :)
 
 struct stack_frame {
    struct stack_frame *next_frame;
    unsigned long return_address;
 };
 
-int get_trace(size_t* size, void** strings) {
+static uint64_t hash_stack(void **frames, size_t size) {
+   uint64_t h = 14695981039346656037ULL;
+   size_t i;
+   for(i = 0; i < size; i++) {
+      h ^= (uint64_t)frames[i];
+      h *= 1099511628211ULL;
+      h ^= h >> 29;
+   }
+   return h ? h : 1;
+}
+
+static inline size_t live_slot(uintptr_t addr) {
+   return ((addr >> 4) * 11400714819323198485ULL) >> (64 - __builtin_ctz(LIVE_TABLE_SIZE));
+}
+
+/* Returns 0 if the object does not fit into the table */
+static int live_insert(const struct live_object *o) {
+   size_t i, slot = live_slot(o->addr);
+   for(i = 0; i < LIVE_MAX_PROBE; i++, slot = (slot + 1) & (LIVE_TABLE_SIZE - 1)) {
+      struct live_object *e = &live_table[slot];
+      uintptr_t current = __atomic_load_n(&e->addr, __ATOMIC_RELAXED);
+      while(current == LIVE_EMPTY || current == LIVE_DELETED) {
+         if(__atomic_compare_exchange_n(&e->addr, &current, (uintptr_t)LIVE_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            e->start = o->start;
+            e->size = o->size;
+            e->type = o->type;
+            e->stack_id = o->stack_id;
+            e->tid = o->tid;
+            e->cpu = o->cpu;
+            e->tag = o->tag;
+            __atomic_store_n(&e->addr, o->addr, __ATOMIC_RELEASE);
+            return 1;
+         }
+      }
+   }
+   __atomic_add_fetch(&live_table_full, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/* Removes the object at addr from the table and copies it to o, returns 0 if it is not tracked */
+static int live_remove(uintptr_t addr, struct live_object *o) {
+   size_t i, slot = live_slot(addr);
+   for(i = 0; i < LIVE_MAX_PROBE; i++, slot = (slot + 1) & (LIVE_TABLE_SIZE - 1)) {
+      struct live_object *e = &live_table[slot];
+      uintptr_t current = __atomic_load_n(&e->addr, __ATOMIC_ACQUIRE);
+      if(current == LIVE_EMPTY)
+         return 0;
+      if(current == addr && __atomic_compare_exchange_n(&e->addr, &current, (uintptr_t)LIVE_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         *o = *e;
+         o->addr = addr;
+         __atomic_store_n(&e->addr, (uintptr_t)LIVE_DELETED, __ATOMIC_RELEASE);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Returns the id of the stack trace, adds it to the stack table if it is new */
+uint32_t intern_stack(void **frames, size_t size) {
+   uint64_t h = hash_stack(frames, size);
+   size_t i, slot = h & (STACK_TABLE_SIZE - 1);
+   for(i = 0; i < STACK_TABLE_SIZE; i++, slot = (slot + 1) & (STACK_TABLE_SIZE - 1)) {
+      struct stack_entry *e = &stack_table[slot];
+      uint64_t expected = 0;
+      uint64_t current = __atomic_load_n(&e->hash, __ATOMIC_ACQUIRE);
+      if(current == 0 && __atomic_compare_exchange_n(&e->hash, &expected, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+         memcpy(e->frames, frames, size * sizeof(*frames));
+         e->size = size;
+         uint32_t id = __atomic_add_fetch(&nb_stacks, 1, __ATOMIC_ACQ_REL);
+         __atomic_store_n(&stack_slots[id - 1], slot + 1, __ATOMIC_RELEASE);
+         __atomic_store_n(&e->id, id, __ATOMIC_RELEASE);
+         return id;
+      }
+      if(current == 0)
+         current = expected;
+      if(current != h)
+         continue;
+      // Same hash, wait until the owner of the slot has published it
+      uint32_t id;
+      while((id = __atomic_load_n(&e->id, __ATOMIC_ACQUIRE)) == 0)
+         sched_yield();
+      if(e->size == size && memcmp(e->frames, frames, size * sizeof(*frames)) == 0)
+         return id;
+   }
+   __atomic_add_fetch(&stack_table_full, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/* Frame pointer walk, starts at the frame of the caller */
+static __attribute__((noinline)) size_t frame_pointer_trace(void **strings, size_t max) {
+   size_t i;
+   struct stack_frame *frame = (struct stack_frame *)__builtin_frame_address(0);
+   for(i = 0; i < max && frame; i++) {
+      strings[i] = (void*)frame->return_address;
+      struct stack_frame *next = frame->next_frame;
+      // Stop at frames that can not belong to the same stack
+      if(next <= frame || ((uintptr_t)next & (sizeof(void*) - 1)))
+         return i + 1;
+      frame = next;
+   }
+   return i;
+}
+
+/*
+ * Captures the stack trace of the caller of the allocation function and
+ * interns it. caller is the return address of the allocation function.
+ */
+__attribute__((noinline)) int get_trace(uint32_t* stack_id, void *caller) {
+   void *strings[MAX_CALLCHAIN_SIZE + 2];
+   size_t size = 0, skip = 0;
+   uint64_t start = 0;
+   *stack_id = 0;
    if(_in_trace)
       return 1;
    _in_trace = 1;
 
-#if USE_FRAME_POINTER
-   int i;
-   struct stack_frame *frame;
-   get_bp(frame);
-   for(i = 0; i < CALLCHAIN_SIZE; i++) {
-      strings[i] = (void*)frame->return_address;
-      *size = i + 1;
-      frame = frame->next_frame;
-      if(!frame)
-         break;
+   struct ring *r = thread_ring;
+   int measure = (r->unwind_calls++ % UNWIND_COST_SAMPLING) == 0;
+   if(measure)
+      start = get_nsecs();
+
+   switch(Unwinder) {
+   case UNWINDER_CALLER:
+      strings[0] = caller;
+      size = 1;
+      break;
+   case UNWINDER_FRAME_POINTER:
+      // skip get_trace and the function (malloc, ...) that called it
+      size = frame_pointer_trace(strings, StackDepth + 2);
+      skip = 2;
+      break;
+   case UNWINDER_LIBUNWIND:
+      // skip get_trace and the function (malloc, ...) that called it
+      size = libunwind_backtrace(strings, StackDepth + 2);
+      skip = 2;
+      break;
+   case UNWINDER_BACKTRACE:
+      size = backtrace(strings, StackDepth + 2);
+      skip = 2;
+      break;
    }
-#else
-   *size = backtrace(strings, CALLCHAIN_SIZE);
-#endif
 
+   if(size > skip)
+      *stack_id = intern_stack(strings + skip, size - skip);
+
+   if(measure) {
+      r->unwind_ns += get_nsecs() - start;
+      r->unwind_samples++;
+   }
    _in_trace = 0;
    return 0;
 }
 
+/* New allocations are not logged while the collector paused tracking, releases of tracked objects still are */
+static inline int tracking_paused(void) {
+   return shm_ring && !__atomic_load_n(&shm_ring->tracking, __ATOMIC_RELAXED);
+}
 
-extern "C" void *malloc(size_t sz) {
-   if(!libc_malloc)
-      m_init();
-   void *addr = libc_malloc(sz);
-	 if(sz < AllocationMinSize)
-		 return addr;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = sz;
-         log_arr->entry_type = 1;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
-      }
+static void track_large_object(uintptr_t addr, size_t size) {
+   pthread_mutex_lock(&pages_lock);
+   if(nb_large_objects < PAGE_SAMPLE_MAX_OBJECTS) {
+      large_objects[nb_large_objects].addr = addr;
+      large_objects[nb_large_objects].size = size;
+      nb_large_objects++;
+   } else {
+      large_objects_full++;
    }
-   return addr;
+   pthread_mutex_unlock(&pages_lock);
 }
 
-extern "C" void *memalign(size_t align, size_t sz) {
-   void *addr = libc_memalign(align, sz);
-	 if(sz < AllocationMinSize)
-		 return addr;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = sz;
-         log_arr->entry_type = 1;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
+static void untrack_large_object(uintptr_t addr) {
+   size_t i;
+   pthread_mutex_lock(&pages_lock);
+   for(i = 0; i < nb_large_objects; i++) {
+      if(large_objects[i].addr == addr) {
+         large_objects[i] = large_objects[--nb_large_objects];
+         break;
       }
    }
-   return addr;
+   pthread_mutex_unlock(&pages_lock);
 }
 
-extern "C" int posix_memalign(void **ptr, size_t align, size_t sz) {
-   int ret = libc_posix_memalign(ptr, align, sz);
-	 if(sz < AllocationMinSize)
-		 return ret;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = *ptr;
-         log_arr->size = sz;
-         log_arr->entry_type = 1;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
-      }
+/* Buffers a call that sets a memory policy, calls made by libnuma for one of the hooked allocators are not logged */
+static void log_page_policy(const char *call, void *addr, size_t length, int mode, const unsigned long *nodemask, unsigned long maxnode) {
+   int cpu;
+   if(_in_trace || !TrackingEnabled)
+      return;
+   pthread_mutex_lock(&pages_lock);
+   if(nb_page_policies < MAX_PAGE_POLICIES) {
+      struct page_policy *p = &page_policies[nb_page_policies++];
+      p->time = event_time(&cpu);
+      p->tid = tid ? tid : (int) syscall(186);
+      p->call = call;
+      p->addr = (uintptr_t)addr;
+      p->length = length;
+      p->mode = mode;
+      p->nodemask = nodemask && maxnode ? nodemask[0] : 0;
+      if(maxnode && maxnode < 64)
+         p->nodemask &= (1UL << maxnode) - 1;
+   } else {
+      page_policies_dropped++;
    }
-   return ret;
+   pthread_mutex_unlock(&pages_lock);
 }
 
-extern "C" void free(void *p) {
-	 if(p == 0) {
-     libc_free(p);
-		 return;
-	 }
+/*
+ * Fills o for a new object of sz bytes, returns 0 if it is not tracked. Always
+ * inlined into the hooks so that get_trace() skips the same frames for every
+ * allocation function. key is the address of the object in the live table,
+ * see LIVE_REGION_BIT.
+ */
+static inline __attribute__((always_inline)) int new_object(struct live_object *o, uintptr_t key, size_t sz, long type, uint32_t tag, void *caller) {
+   if(_in_trace || tracking_paused() || !is_tracked_size(sz))
+      return 0;
+   if(!get_ring())
+      return 0;
+   o->addr = key;
+   o->start = event_time(&o->cpu);
+   o->size = sz;
+   o->type = type;
+   o->tid = tid;
+   o->tag = tag;
+   get_trace(&o->stack_id, caller);
+   return 1;
+}
+
+/* Logs an object that does not fit into the live table at once as live until exit */
+static void log_live_at_exit(const struct live_object *o, void *addr) {
    struct log *log_arr = get_log();
    if(log_arr) {
-   log_arr->rdt = get_nsecs();
-   log_arr->addr = p;
-   log_arr->size = 0;
-   log_arr->entry_type = 0;
-   log_arr->cpu = sched_getcpu();
-   log_arr->pid = _getpid();
+      log_arr->start = o->start;
+      log_arr->end = 0;
+      log_arr->addr = addr;
+      log_arr->size = o->size;
+      log_arr->entry_type = o->type;
+      log_arr->cpu = o->cpu;
+      log_arr->tid = o->tid;
+      log_arr->pid = _getpid();
+      log_arr->stack_id = o->stack_id;
+      log_arr->tag = o->tag;
+      commit_log();
    }
-   //if(!pthread_mutex_trylock(&lock)) {
-   //fprintf(dump, "%lu pid %d cpu %d size %d addr %lx type %d\n", log_arr.rdt, log_arr.pid, log_arr.cpu, 0, p, log_arr.entry_type);
-   //pthread_mutex_unlock(&lock);
-
-   libc_free(p);
 }
 
-extern "C" void *calloc(size_t nmemb, size_t size) {
-   void *addr;
-   if(!libc_calloc) {
-      memset(empty_data, 0, sizeof(*empty_data));
-      addr = empty_data;
-   } else {
-      addr = libc_calloc(nmemb, size);
-   }
-	 if(size < AllocationMinSize)
-		 return addr;
-   if(!_in_trace && libc_calloc) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = nmemb * size;
-         log_arr->entry_type = 1;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
-      }
+/* Logs the lifetime of a tracked object that was removed from its table */
+static void log_lifetime(const struct live_object *o, void *addr, uint64_t rdt) {
+   if(_in_trace || o->start < live_epoch)
+      return;
+   struct log *log_arr = get_log();
+   if(log_arr) {
+      log_arr->start = o->start;
+      log_arr->end = rdt;
+      log_arr->addr = addr;
+      log_arr->size = o->size;
+      log_arr->entry_type = o->type;
+      log_arr->cpu = o->cpu;
+      log_arr->tid = o->tid;
+      log_arr->pid = _getpid();
+      log_arr->stack_id = o->stack_id;
+      log_arr->tag = o->tag;
+      commit_log();
    }
-
-   return addr;
 }
 
-extern "C" void *realloc(void *ptr, size_t size) {
-   void *addr = libc_realloc(ptr, size);
-
-	 if(size < AllocationMinSize)
-		 return addr;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = size;
-         log_arr->entry_type = 1;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
-      }
-   }
-
-   return addr;
+/* Tracks an allocation of sz bytes at addr, nothing is logged before the object is released */
+static inline __attribute__((always_inline)) void log_object(uintptr_t key, void *addr, size_t sz, long type, uint32_t tag, void *caller) {
+   struct live_object o;
+   if(!addr || !new_object(&o, key, sz, type, tag, caller))
+      return;
+   if(PageSampleMinSize && sz >= PageSampleMinSize)
+      track_large_object((uintptr_t)addr, sz);
+   if(!live_insert(&o))
+      log_live_at_exit(&o, addr);
 }
 
-void *operator new(size_t sz) throw(std::bad_alloc) {
-   return malloc(sz);
+static inline __attribute__((always_inline)) void log_allocation(void *addr, size_t sz, long type, void *caller) {
+   log_object((uintptr_t)addr, addr, sz, type, 0, caller);
 }
 
-void *operator new(size_t sz, const std::nothrow_t &) throw() {
-   return malloc(sz);
+/* Removes the tracked object with the live table key, returns 0 if it is not tracked */
+static inline int take_object(uintptr_t key, struct live_object *o) {
+   if(!TrackingEnabled)
+      return 0;
+   // Also forget objects released while tracing, their address can be reused
+   if(!live_remove(key, o))
+      return 0;
+   if(PageSampleMinSize && o->size >= PageSampleMinSize)
+      untrack_large_object(key & ~LIVE_REGION_BIT);
+   return 1;
 }
 
-void *operator new[](size_t sz) throw(std::bad_alloc) {
-   return malloc(sz);
+/* Puts an object back that take_object() removed for a call that failed */
+static void restore_object(const struct live_object *o) {
+   if(PageSampleMinSize && o->size >= PageSampleMinSize)
+      track_large_object(o->addr & ~LIVE_REGION_BIT, o->size);
+   if(!live_insert(o))
+      log_live_at_exit(o, (void *)(o->addr & ~LIVE_REGION_BIT));
 }
 
-void *operator new[](size_t sz, const std::nothrow_t &) throw() {
-   return malloc(sz);
+/*
+ * Logs the lifetime of the tracked object with the live table key when it is
+ * released. rdt is taken before the block is handed back to libc, the object
+ * is removed before as well: once libc has the block, another thread can get
+ * the same address and track it.
+ */
+static inline void log_release_key(uintptr_t key, uint64_t rdt) {
+   struct live_object o;
+   if(take_object(key, &o))
+      log_lifetime(&o, (void *)(key & ~LIVE_REGION_BIT), rdt);
 }
 
-void operator delete(void *ptr) {
-   free(ptr);
+/* Index of the first region that ends after addr, called with mappings_lock */
+static size_t mapping_index(uintptr_t addr) {
+   size_t low = 0, high = nb_mappings;
+   while(low < high) {
+      size_t mid = (low + high) / 2;
+      if(mappings[mid].addr + mappings[mid].size <= addr)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+   return low;
 }
 
-void operator delete[](void *ptr) {
-   free(ptr);
+/* Called with mappings_lock, regions that do not fit are logged as live until exit */
+static void insert_mapping(const struct live_object *o) {
+   if(nb_mappings == MAX_MAPPINGS) {
+      __atomic_add_fetch(&live_table_full, 1, __ATOMIC_RELAXED);
+      log_live_at_exit(o, (void *)o->addr);
+      return;
+   }
+   size_t i = mapping_index(o->addr);
+   memmove(&mappings[i + 1], &mappings[i], (nb_mappings - i) * sizeof(*mappings));
+   mappings[i] = *o;
+   nb_mappings++;
 }
 
-extern "C" void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset) {
-   void *addr = libc_mmap(start, length, prot, flags, fd, offset);
-
-	 if(length < AllocationMinSize)
-		 return addr;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = length;
-         log_arr->entry_type = flags + 100;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
+/*
+ * The pages [start, start + length) are unmapped, called with mappings_lock.
+ * The unmapped part of every region that overlaps them is logged as released.
+ * What is left of a region before and after them stays live with the time and
+ * stack of the allocation, a region unmapped in the middle becomes two objects.
+ */
+static void release_mappings(uintptr_t start, size_t length, uint64_t rdt) {
+   size_t page = sysconf(_SC_PAGESIZE);
+   uintptr_t end = start + ((length + page - 1) & ~(page - 1));
+   size_t i = mapping_index(start);
+   while(i < nb_mappings && mappings[i].addr < end) {
+      struct live_object o = mappings[i];
+      uintptr_t o_end = o.addr + o.size;
+      uintptr_t cut_start = o.addr > start ? o.addr : start;
+      uintptr_t cut_end = o_end < end ? o_end : end;
+      if(PageSampleMinSize && o.size >= PageSampleMinSize)
+         untrack_large_object(o.addr);
+
+      struct live_object cut = o;
+      cut.size = cut_end - cut_start;
+      log_lifetime(&cut, (void *)cut_start, rdt);
+
+      struct live_object head = o, tail = o;
+      head.size = cut_start - o.addr;
+      tail.addr = cut_end;
+      tail.size = o_end - cut_end;
+      if(head.size) {
+         mappings[i++] = head;
+      } else {
+         nb_mappings--;
+         memmove(&mappings[i], &mappings[i + 1], (nb_mappings - i) * sizeof(*mappings));
       }
+      if(tail.size) {
+         insert_mapping(&tail);
+         i = mapping_index(end);
+      }
+      if(PageSampleMinSize && head.size >= PageSampleMinSize)
+         track_large_object(head.addr, head.size);
+      if(PageSampleMinSize && tail.size >= PageSampleMinSize)
+         track_large_object(tail.addr, tail.size);
    }
+}
 
+/* Hook of mmap() and mmap64() */
+static inline __attribute__((always_inline)) void *map_region(void *(*map)(void *, size_t, int, int, int, off_t), void *start, size_t length, int prot, int flags, int fd, off_t offset, void *caller) {
+   if(!TrackingEnabled)
+      return map(start, length, prot, flags, fd, offset);
+   struct live_object o;
+   int cpu, tracked = new_object(&o, 0, length, ALLOCATION_EVENT_MMAP + flags, 0, caller);
+   uint64_t rdt = tracked ? o.start : event_time(&cpu);
+   pthread_mutex_lock(&mappings_lock);
+   void *addr = map(start, length, prot, flags, fd, offset);
+   if(addr != MAP_FAILED) {
+      // MAP_FIXED replaces the mappings in the way
+      release_mappings((uintptr_t)addr, length, rdt);
+      if(tracked) {
+         o.addr = (uintptr_t)addr;
+         insert_mapping(&o);
+      }
+   }
+   pthread_mutex_unlock(&mappings_lock);
+   if(tracked && addr != MAP_FAILED && PageSampleMinSize && length >= PageSampleMinSize)
+      track_large_object((uintptr_t)addr, length);
    return addr;
 }
 
-extern "C" void *mmap64(void *start, size_t length, int prot, int flags, int fd, off_t offset) {
-   void *addr = libc_mmap64(start, length, prot, flags, fd, offset);
-
-	 if(length < AllocationMinSize)
-		 return addr;
-   if(!_in_trace) {
-      struct log *log_arr = get_log();
-      if(log_arr) {
-	 log_arr->rdt = get_nsecs();
-         log_arr->addr = addr;
-         log_arr->size = length * 4 * 1024;
-         log_arr->entry_type = flags + 100;
-         log_arr->cpu = sched_getcpu();
-         log_arr->pid = _getpid();
-         get_trace(&log_arr->callchain_size, log_arr->callchain_strings);
-      }
+static inline void log_release(void *addr, uint64_t rdt) {
+   if(addr)
+      log_release_key((uintptr_t)addr, rdt);
+}
+
+/*
+ * A block passed to realloc() ends even if it is resized in place: the old
+ * object is released and the result is tracked as a new object. The old
+ * object is taken out of the live table before the call and put back if
+ * realloc() fails, the old block stays valid in that case.
+ */
+/* zero_frees: resize() releases the block for size 0 */
+static inline __attribute__((always_inline)) void *tracked_realloc(void *(*resize)(void *, size_t, size_t), void *ptr, size_t old_size, size_t sz, int zero_frees, long type, void *caller) {
+   struct live_object o;
+   int cpu, tracked = 0;
+   uint64_t rdt = 0;
+   if(ptr) {
+      rdt = event_time(&cpu);
+      tracked = take_object((uintptr_t)ptr, &o);
    }
+   void *addr = resize(ptr, old_size, sz);
+   if(tracked) {
+      if(addr || (sz == 0 && zero_frees))
+         log_lifetime(&o, ptr, rdt);
+      else
+         restore_object(&o);
+   }
+   log_allocation(addr, sz, type, caller);
+   return addr;
+}
 
+extern "C" void *malloc(size_t sz) {
+   if(!libc_malloc)
+      m_init();
+   void *addr = libc_malloc(sz);
+   log_allocation(addr, sz, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
    return addr;
 }
 
-extern "C" int munmap(void *start, size_t length) {
-   int addr = libc_munmap(start, length);
-   /*struct log log_arr;
-      rdtscll(log_arr.rdt);
-      log_arr.addr = start;
-      log_arr.size = length;
-      log_arr.entry_type = 2;
-      log_arr.cpu = sched_getcpu();
-      log_arr.pid = _getpid();
-   */
+extern "C" void *memalign(size_t align, size_t sz) {
+   if(!libc_memalign)
+      m_init();
+   void *addr = libc_memalign(align, sz);
+   log_allocation(addr, sz, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
    return addr;
 }
 
-int __thread bye_done = 0;
-void
-__attribute__((destructor))
-bye(void) {
-   if(bye_done)
-      return;
-   bye_done = 1;
+extern "C" int posix_memalign(void **ptr, size_t align, size_t sz) {
+   if(!libc_posix_memalign)
+      m_init();
+   int ret = libc_posix_memalign(ptr, align, sz);
+   if(ret == 0)
+      log_allocation(*ptr, sz, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+   return ret;
+}
 
-   unsigned int i, j, k;
-   for(i = 1; i < MAX_TID; i++) {
-      if(tids[i] == 0)
-         break;
-      FILE *dump = open_file(tids[i]);
-      for(j = 0; j < log_index[i]; j++) {
-         struct log *l = &log_arr[i][j];
-				 if(l->entry_type != 0) {
-            fprintf(dump, "callchain\n");
-				 }
-         // k=2, we skip get_trace and the function (malloc, ...) that called it
-#if RESOLVE_SYMBS
-         _in_trace = 1;
-         char **strings = backtrace_symbols (l->callchain_strings, l->callchain_size);
-         for (k = 2; k < l->callchain_size; k++) {
-            fprintf (dump, "%*.*s%s\n", (int)k-2,(int)k-2,"",strings[k]);
-         }
-         libc_free(strings);
-#else
-         for (k = 2; k < l->callchain_size; k++) {
-            fprintf (dump, "%*.*s<not resolved> [%p]\n", (int)k-2,(int)k-2,"",l->callchain_strings[k]);
-         }
-#endif
-         fprintf(dump, "%lu pid %d cpu %d size %llu addr %llx type %d\n", l->rdt, l->pid, l->cpu, (unsigned long long)l->size, (unsigned long long)l->addr, (int)l->entry_type);
-      }
-      fclose(dump);
-   }
+extern "C" void *aligned_alloc(size_t align, size_t sz) {
+   if(!libc_aligned_alloc)
+      m_init();
+   void *addr = libc_aligned_alloc(align, sz);
+   log_allocation(addr, sz, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+   return addr;
 }
 
-void
-__attribute__((constructor))
-m_init(void) {
-   libc_calloc = (void * ( *)(size_t, size_t)) dlsym(RTLD_NEXT, "calloc");
-   libc_malloc = (void * ( *)(size_t)) dlsym(RTLD_NEXT, "malloc");
-   libc_realloc = (void * ( *)(void *, size_t)) dlsym(RTLD_NEXT, "realloc");
-   libc_free = (void ( *)(void *)) dlsym(RTLD_NEXT, "free");
+extern "C" void *valloc(size_t sz) {
+   if(!libc_valloc)
+      m_init();
+   void *addr = libc_valloc(sz);
+   log_allocation(addr, sz, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+   return addr;
+}
+
+extern "C" void *pvalloc(size_t sz) {
+   if(!libc_pvalloc)
+      m_init();
+   void *addr = libc_pvalloc(sz);
+   // pvalloc rounds the size up to the next page
+   size_t page = sysconf(_SC_PAGESIZE);
+   log_allocation(addr, (sz + page - 1) & ~(page - 1), ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+   return addr;
+}
+
+extern "C" void free(void *p) {
+   if(!libc_free)
+      m_init();
+   if(p == 0) {
+      libc_free(p);
+      return;
+   }
+   int cpu;
+   log_release(p, event_time(&cpu));
+   libc_free(p);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) {
+   void *addr;
+   if(!libc_calloc) {
+      memset(empty_data, 0, sizeof(*empty_data));
+      return empty_data;
+   }
+   addr = libc_calloc(nmemb, size);
+   log_allocation(addr, nmemb * size, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+   return addr;
+}
+
+static void *resize_block(void *ptr, size_t, size_t size) {
+   return libc_realloc(ptr, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+   if(!libc_realloc)
+      m_init();
+   return tracked_realloc(resize_block, ptr, 0, size, 1, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+}
+
+/* Logged like realloc(), glibc's reallocarray calls realloc and would be logged twice */
+extern "C" void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+   size_t sz;
+   if(__builtin_mul_overflow(nmemb, size, &sz)) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   if(!libc_realloc)
+      m_init();
+   return tracked_realloc(resize_block, ptr, 0, sz, 1, ALLOCATION_EVENT_ALLOC, __builtin_return_address(0));
+}
+
+/*
+ * Throwing operator new: calls the new handler until the allocation succeeds
+ * and throws std::bad_alloc if there is none. The nothrow variants return
+ * nullptr instead. Inlined into the operators, so that get_trace() skips
+ * them like malloc() and they do not add a frame of their own.
+ */
+static inline __attribute__((always_inline)) void *tracked_new(size_t align, size_t sz, void *caller) {
+   if(!libc_malloc)
+      m_init();
+   void *addr;
+   while(!(addr = align ? libc_memalign(align, sz) : libc_malloc(sz))) {
+      std::new_handler handler = std::get_new_handler();
+      if(!handler)
+         throw std::bad_alloc();
+      handler();
+   }
+   log_allocation(addr, sz, ALLOCATION_EVENT_ALLOC, caller);
+   return addr;
+}
+
+static inline __attribute__((always_inline)) void *tracked_new_nothrow(size_t align, size_t sz, void *caller) noexcept {
+   try {
+      return tracked_new(align, sz, caller);
+   } catch(const std::bad_alloc &) {
+      return nullptr;
+   }
+}
+
+void *operator new(size_t sz) {
+   return tracked_new(0, sz, __builtin_return_address(0));
+}
+
+void *operator new(size_t sz, const std::nothrow_t &) noexcept {
+   return tracked_new_nothrow(0, sz, __builtin_return_address(0));
+}
+
+void *operator new[](size_t sz) {
+   return tracked_new(0, sz, __builtin_return_address(0));
+}
+
+void *operator new[](size_t sz, const std::nothrow_t &) noexcept {
+   return tracked_new_nothrow(0, sz, __builtin_return_address(0));
+}
+
+void *operator new(size_t sz, std::align_val_t align) {
+   return tracked_new(static_cast<size_t>(align), sz, __builtin_return_address(0));
+}
+
+void *operator new(size_t sz, std::align_val_t align, const std::nothrow_t &) noexcept {
+   return tracked_new_nothrow(static_cast<size_t>(align), sz, __builtin_return_address(0));
+}
+
+void *operator new[](size_t sz, std::align_val_t align) {
+   return tracked_new(static_cast<size_t>(align), sz, __builtin_return_address(0));
+}
+
+void *operator new[](size_t sz, std::align_val_t align, const std::nothrow_t &) noexcept {
+   return tracked_new_nothrow(static_cast<size_t>(align), sz, __builtin_return_address(0));
+}
+
+void operator delete(void *ptr) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+   free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+   free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+   free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+   free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+   free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+   free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+   free(ptr);
+}
+
+extern "C" void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset) {
+   if(!libc_mmap)
+      m_init();
+   return map_region(libc_mmap, start, length, prot, flags, fd, offset, __builtin_return_address(0));
+}
+
+extern "C" void *mmap64(void *start, size_t length, int prot, int flags, int fd, off_t offset) {
+   if(!libc_mmap64)
+      m_init();
+   return map_region(libc_mmap64, start, length, prot, flags, fd, offset, __builtin_return_address(0));
+}
+
+extern "C" int munmap(void *start, size_t length) {
+   if(!libc_munmap)
+      m_init();
+   if(!TrackingEnabled)
+      return libc_munmap(start, length);
+   int cpu;
+   uint64_t rdt = event_time(&cpu);
+   pthread_mutex_lock(&mappings_lock);
+   int ret = libc_munmap(start, length);
+   if(ret == 0)
+      release_mappings((uintptr_t)start, length, rdt);
+   pthread_mutex_unlock(&mappings_lock);
+   return ret;
+}
+
+/* The remapped pages end at their old address and are tracked again at the new one */
+extern "C" void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...) {
+   void *new_address = NULL;
+   if(flags & MREMAP_FIXED) {
+      va_list args;
+      va_start(args, flags);
+      new_address = va_arg(args, void *);
+      va_end(args);
+   }
+   if(!libc_mremap)
+      m_init();
+   if(!TrackingEnabled)
+      return libc_mremap(old_address, old_size, new_size, flags, new_address);
+   struct live_object o;
+   int cpu, tracked = new_object(&o, 0, new_size, ALLOCATION_EVENT_MREMAP, 0, __builtin_return_address(0));
+   uint64_t rdt = tracked ? o.start : event_time(&cpu);
+   pthread_mutex_lock(&mappings_lock);
+   void *addr = libc_mremap(old_address, old_size, new_size, flags, new_address);
+   if(addr != MAP_FAILED) {
+      release_mappings((uintptr_t)old_address, old_size, rdt);
+      // MREMAP_FIXED replaces the mappings at the new address
+      release_mappings((uintptr_t)addr, new_size, rdt);
+      if(tracked) {
+         o.addr = (uintptr_t)addr;
+         insert_mapping(&o);
+      }
+   }
+   pthread_mutex_unlock(&mappings_lock);
+   if(tracked && addr != MAP_FAILED && PageSampleMinSize && new_size >= PageSampleMinSize)
+      track_large_object((uintptr_t)addr, new_size);
+   return addr;
+}
+
+/*
+ * libnuma allocators. They are resolved when they are first called, libnuma
+ * may be loaded after the tracker. The mmap(), mbind() and munmap() calls
+ * made by libnuma itself are not logged, the object is logged by the hook.
+ */
+static void *resolve_numa(const char *name) {
+   void *f = dlsym(RTLD_NEXT, name);
+   if(!f) {
+      fprintf(stderr, "%s not found\n", name);
+      abort();
+   }
+   return f;
+}
+
+#define NUMA_MODE_LOCAL      0   /* MPOL_DEFAULT */
+#define NUMA_MODE_BIND       2   /* MPOL_BIND */
+#define NUMA_MODE_INTERLEAVE 3   /* MPOL_INTERLEAVE */
+
+static inline __attribute__((always_inline)) void *numa_allocation(void *(*alloc)(size_t), size_t sz, const char *call, int mode, void *caller) {
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   void *addr = alloc(sz);
+   _in_trace = in_trace;
+   if(addr)
+      log_page_policy(call, addr, sz, mode, NULL, 0);
+   log_allocation(addr, sz, ALLOCATION_EVENT_NUMA, caller);
+   return addr;
+}
+
+extern "C" void *numa_alloc_onnode(size_t sz, int node) {
+   if(!libc_numa_alloc_onnode)
+      libc_numa_alloc_onnode = (void * ( *)(size_t, int)) resolve_numa("numa_alloc_onnode");
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   void *addr = libc_numa_alloc_onnode(sz, node);
+   _in_trace = in_trace;
+   if(addr) {
+      unsigned long mask = 1UL << (node & 63);
+      log_page_policy("numa_alloc_onnode", addr, sz, NUMA_MODE_BIND, &mask, 64);
+   }
+   log_allocation(addr, sz, ALLOCATION_EVENT_NUMA, __builtin_return_address(0));
+   return addr;
+}
+
+extern "C" void *numa_alloc_interleaved(size_t sz) {
+   if(!libc_numa_alloc_interleaved)
+      libc_numa_alloc_interleaved = (void * ( *)(size_t)) resolve_numa("numa_alloc_interleaved");
+   return numa_allocation(libc_numa_alloc_interleaved, sz, "numa_alloc_interleaved", NUMA_MODE_INTERLEAVE, __builtin_return_address(0));
+}
+
+extern "C" void *numa_alloc_local(size_t sz) {
+   if(!libc_numa_alloc_local)
+      libc_numa_alloc_local = (void * ( *)(size_t)) resolve_numa("numa_alloc_local");
+   return numa_allocation(libc_numa_alloc_local, sz, "numa_alloc_local", NUMA_MODE_LOCAL, __builtin_return_address(0));
+}
+
+extern "C" void *numa_alloc(size_t sz) {
+   if(!libc_numa_alloc)
+      libc_numa_alloc = (void * ( *)(size_t)) resolve_numa("numa_alloc");
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   void *addr = libc_numa_alloc(sz);
+   _in_trace = in_trace;
+   log_allocation(addr, sz, ALLOCATION_EVENT_NUMA, __builtin_return_address(0));
+   return addr;
+}
+
+static void *resize_numa(void *old_addr, size_t old_size, size_t new_size) {
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   void *addr = libc_numa_realloc(old_addr, old_size, new_size);
+   _in_trace = in_trace;
+   return addr;
+}
+
+extern "C" void *numa_realloc(void *old_addr, size_t old_size, size_t new_size) {
+   if(!libc_numa_realloc)
+      libc_numa_realloc = (void * ( *)(void *, size_t, size_t)) resolve_numa("numa_realloc");
+   return tracked_realloc(resize_numa, old_addr, old_size, new_size, 0, ALLOCATION_EVENT_NUMA, __builtin_return_address(0));
+}
+
+extern "C" void numa_free(void *mem, size_t size) {
+   if(!libc_numa_free)
+      libc_numa_free = (void ( *)(void *, size_t)) resolve_numa("numa_free");
+   int cpu;
+   log_release(mem, event_time(&cpu));
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   libc_numa_free(mem, size);
+   _in_trace = in_trace;
+}
+
+/* mbind() and set_mempolicy() are thin system call wrappers of libnuma, they are called directly */
+extern "C" long mbind(void *start, unsigned long len, int mode, const unsigned long *nodemask, unsigned long maxnode, unsigned flags) {
+   long ret = syscall(SYS_mbind, start, len, mode, nodemask, maxnode, flags);
+   if(ret == 0)
+      log_page_policy("mbind", start, len, mode, nodemask, maxnode);
+   return ret;
+}
+
+extern "C" long set_mempolicy(int mode, const unsigned long *nodemask, unsigned long maxnode) {
+   long ret = syscall(SYS_set_mempolicy, mode, nodemask, maxnode);
+   if(ret == 0)
+      log_page_policy("set_mempolicy", NULL, 0, mode, nodemask, maxnode);
+   return ret;
+}
+
+/* Only the advices that change huge page backing are logged, the advice is written as the mode */
+extern "C" int madvise(void *addr, size_t length, int advice) {
+   int ret = syscall(SYS_madvise, addr, length, advice);
+   if(ret == 0 && (advice == MADV_HUGEPAGE || advice == MADV_NOHUGEPAGE || advice == MADV_COLLAPSE))
+      log_page_policy("madvise", addr, length, advice, NULL, 0);
+   return ret;
+}
+
+/* Returns the id of the tag, 0 if the tag table is full */
+static uint32_t intern_region_tag(const char *tag) {
+   static __thread const char *last_tag;
+   static __thread uint32_t last_id;
+   uint32_t i, id = 0;
+   if(!tag)
+      tag = "";
+   // Pools usually pass the same constant, the name is compared in case the buffer was reused
+   if(tag == last_tag && strncmp(region_tags[last_id - 1], tag, REGION_TAG_LENGTH - 1) == 0)
+      return last_id;
+   pthread_mutex_lock(&region_tags_lock);
+   for(i = 0; i < nb_region_tags && !id; i++)
+      if(strncmp(region_tags[i], tag, REGION_TAG_LENGTH - 1) == 0)
+         id = i + 1;
+   if(!id && nb_region_tags < MAX_REGION_TAGS) {
+      char *name = region_tags[nb_region_tags];
+      strncpy(name, tag, REGION_TAG_LENGTH - 1);
+      // one tag per line in the text format
+      for(i = 0; name[i]; i++)
+         if(name[i] == '\n')
+            name[i] = ' ';
+      id = ++nb_region_tags;
+   } else if(!id) {
+      region_tags_full++;
+   }
+   pthread_mutex_unlock(&region_tags_lock);
+   if(id) {
+      last_tag = tag;
+      last_id = id;
+   }
+   return id;
+}
+
+/*
+ * Annotations of custom pools, see pmp_annotate.h. A region is tracked like
+ * any other object, samples in it are attributed to the region instead of the
+ * block of the pool.
+ */
+extern "C" void pmp_tracker_region_alloc(void *ptr, size_t size, const char *tag) {
+   if(!ptr || !TrackingEnabled)
+      return;
+   log_object((uintptr_t)ptr | LIVE_REGION_BIT, ptr, size, ALLOCATION_EVENT_REGION, intern_region_tag(tag), __builtin_return_address(0));
+}
+
+extern "C" void pmp_tracker_region_free(void *ptr) {
+   int cpu;
+   if(ptr)
+      log_release_key((uintptr_t)ptr | LIVE_REGION_BIT, event_time(&cpu));
+}
+
+/*
+ * Thread stacks are tracked as ALLOCATION_EVENT_STACK objects from the start to
+ * the end of the thread, regardless of the size filter, sampling and pauses.
+ * The call path is the one of pthread_create(). For the main thread glibc reads
+ * the stack from /proc/self/maps and limits it to RLIMIT_STACK. Stacks share
+ * the key space of pool regions, a user supplied stack can start at a tracked
+ * allocation. Threads that are cancelled keep their stack until exit.
+ */
+static __thread uintptr_t thread_stack_key;   /* live table key of the stack of the thread, 0 if not tracked */
+
+struct thread_start {
+   void *(*start_routine)(void *);
+   void *arg;
+   uint32_t stack_id;
+};
+
+static void track_thread_stack(uint32_t stack_id) {
+   pthread_attr_t attr;
+   void *addr = NULL;
+   size_t size = 0;
+   if(!TrackingEnabled || _in_trace)
+      return;
+   _in_trace = 1;
+   if(pthread_getattr_np(pthread_self(), &attr) == 0) {
+      pthread_attr_getstack(&attr, &addr, &size);
+      pthread_attr_destroy(&attr);
+   }
+   _in_trace = 0;
+   if(!addr || !get_ring())
+      return;
+   struct live_object o;
+   o.addr = (uintptr_t)addr | LIVE_REGION_BIT;
+   o.start = event_time(&o.cpu);
+   o.size = size;
+   o.type = ALLOCATION_EVENT_STACK;
+   o.stack_id = stack_id;
+   o.tid = tid;
+   o.tag = 0;
+   if(live_insert(&o))
+      thread_stack_key = o.addr;
+}
+
+static void release_thread_stack(void) {
+   int cpu;
+   if(!thread_stack_key)
+      return;
+   log_release_key(thread_stack_key, event_time(&cpu));
+   thread_stack_key = 0;
+}
+
+static void *start_thread(void *arg) {
+   struct thread_start start = *(struct thread_start *)arg;
+   libc_free(arg);
+   track_thread_stack(start.stack_id);
+   void *ret = start.start_routine(start.arg);
+   release_thread_stack();
+   return ret;
+}
+
+extern "C" int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg) {
+   if(!libc_pthread_create)
+      libc_pthread_create = (int ( *)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *)) dlsym(RTLD_NEXT, "pthread_create");
+   // The writer thread is created while tracing
+   if(!TrackingEnabled || _in_trace || !get_ring())
+      return libc_pthread_create(thread, attr, start_routine, arg);
+   struct thread_start *start = (struct thread_start *)libc_malloc(sizeof(*start));
+   if(!start)
+      return libc_pthread_create(thread, attr, start_routine, arg);
+   start->start_routine = start_routine;
+   start->arg = arg;
+   get_trace(&start->stack_id, __builtin_return_address(0));
+   int ret = libc_pthread_create(thread, attr, start_thread, start);
+   if(ret != 0)
+      libc_free(start);
+   return ret;
+}
+
+extern "C" void pthread_exit(void *retval) {
+   if(!libc_pthread_exit)
+      libc_pthread_exit = (void ( *)(void *)) dlsym(RTLD_NEXT, "pthread_exit");
+   release_thread_stack();
+   libc_pthread_exit(retval);
+   __builtin_unreachable();
+}
+
+void write_log(FILE *dump, struct log *l) {
+   fprintf(dump, "%lu end %lu pid %d tid %d cpu %d size %llu addr %llx type %d stack %u tag %u\n", l->start, l->end, l->pid, l->tid, l->cpu, (unsigned long long)l->size, (unsigned long long)l->addr, (int)l->entry_type, l->stack_id, l->tag);
+}
+
+void write_log_binary(struct ring *r, struct log *l) {
+   uint8_t buff[11 * ALLOCATION_VARINT_MAX];
+   size_t n = 0;
+   buff[n++] = ALLOCATION_RECORD_OBJECT;
+   n += allocation_put_varint(buff + n, allocation_zigzag_encode((int64_t)(l->start - r->last_rdt)));
+   n += allocation_put_varint(buff + n, allocation_zigzag_encode((int64_t)((uint64_t)l->addr - r->last_addr)));
+   n += allocation_put_varint(buff + n, l->size);
+   n += allocation_put_varint(buff + n, (uint64_t)l->entry_type);
+   n += allocation_put_varint(buff + n, (uint64_t)l->cpu);
+   n += allocation_put_varint(buff + n, l->pid);
+   n += allocation_put_varint(buff + n, (uint64_t)l->tid);
+   n += allocation_put_varint(buff + n, l->stack_id);
+   n += allocation_put_varint(buff + n, l->end ? (l->end > l->start ? l->end - l->start : 0) + 1 : 0);
+   n += allocation_put_varint(buff + n, l->tag);
+   fwrite_unlocked(buff, 1, n, r->dump);
+   r->last_rdt = l->start;
+   r->last_addr = (uint64_t)l->addr;
+}
+
+/* Converts the timestamps of the entry to nanoseconds and writes it to the file of r */
+void write_entry(struct ring *r, struct log *l) {
+   if(UseTsc) {
+      l->start = tsc_to_nsecs(l->start);
+      if(l->end)
+         l->end = tsc_to_nsecs(l->end);
+   }
+   if(BinaryFormat)
+      write_log_binary(r, l);
+   else
+      write_log(r->dump, l);
+}
+
+/* Stacks are written as raw instruction pointers, prepareDatabase symbolizes them with the maps snapshot */
+void write_stack(FILE *dump, uint32_t id, struct stack_entry *e) {
+   unsigned int k;
+   uint8_t buff[(MAX_CALLCHAIN_SIZE + 2) * ALLOCATION_VARINT_MAX + 1];
+   size_t n = 0;
+   if(!BinaryFormat) {
+      fprintf(dump, "stack %u\n", id);
+      for (k = 0; k < e->size; k++)
+         fprintf (dump, "%*.*s[%p]\n", (int)k,(int)k,"",e->frames[k]);
+      return;
+   }
+   buff[n++] = ALLOCATION_RECORD_STACK;
+   n += allocation_put_varint(buff + n, id);
+   n += allocation_put_varint(buff + n, e->size);
+   uint64_t last = 0;
+   for (k = 0; k < e->size; k++) {
+      n += allocation_put_varint(buff + n, allocation_zigzag_encode((int64_t)((uint64_t)e->frames[k] - last)));
+      last = (uint64_t)e->frames[k];
+   }
+   fwrite_unlocked(buff, 1, n, dump);
+}
+
+void write_region_tag(FILE *dump, uint32_t id, const char *name) {
+   uint8_t buff[2 * ALLOCATION_VARINT_MAX + 1];
+   size_t n = 0, length = strlen(name);
+   if(!BinaryFormat) {
+      fprintf(dump, "tag %u %s\n", id, name);
+      return;
+   }
+   buff[n++] = ALLOCATION_RECORD_TAG;
+   n += allocation_put_varint(buff + n, id);
+   n += allocation_put_varint(buff + n, length);
+   fwrite_unlocked(buff, 1, n, dump);
+   fwrite_unlocked(name, 1, length, dump);
+}
+
+struct build_id_search {
+   uintptr_t addr;
+   char build_id[2 * 64 + 1];
+};
+
+/* dl_iterate_phdr callback, finds the object containing addr and reads its GNU build id note */
+static int find_build_id(struct dl_phdr_info *info, size_t size, void *data) {
+   struct build_id_search *search = (struct build_id_search *)data;
+   int i, found = 0;
+   for(i = 0; i < info->dlpi_phnum; i++) {
+      const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+      uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+      if(ph->p_type == PT_LOAD && search->addr >= start && search->addr < start + ph->p_memsz)
+         found = 1;
+   }
+   if(!found)
+      return 0;
+   for(i = 0; i < info->dlpi_phnum; i++) {
+      const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+      if(ph->p_type != PT_NOTE)
+         continue;
+      const char *note = (const char *)(info->dlpi_addr + ph->p_vaddr);
+      const char *end = note + ph->p_memsz;
+      while(note + sizeof(ElfW(Nhdr)) <= end) {
+         const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+         const unsigned char *desc = (const unsigned char *)note + sizeof(*nhdr) + ((nhdr->n_namesz + 3) & ~3);
+         if(nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(note + sizeof(*nhdr), "GNU", 4) == 0) {
+            unsigned int k;
+            for(k = 0; k < nhdr->n_descsz && k < 64; k++)
+               sprintf(search->build_id + 2 * k, "%02x", desc[k]);
+            return 1;
+         }
+         note = (const char *)desc + ((nhdr->n_descsz + 3) & ~3);
+      }
+   }
+   return 1;
+}
+
+/*
+ * Snapshot of the executable mappings of the process:
+ * start end offset build-id path, addresses in hex, "-" if there is no build id
+ */
+void write_maps() {
+   char line[4096 + 128];
+   FILE *maps = fopen("/proc/self/maps", "r");
+   if(!maps)
+      return;
+   FILE *dump = open_file(0, "allocationMaps", 0);
+   while(fgets(line, sizeof(line), maps)) {
+      unsigned long start, end, offset;
+      char perms[5];
+      int path_start = 0;
+      if(sscanf(line, "%lx-%lx %4s %lx %*s %*d %n", &start, &end, perms, &offset, &path_start) < 4 || path_start == 0)
+         continue;
+      if(perms[2] != 'x' || line[path_start] != '/')
+         continue;
+      line[strcspn(line, "\n")] = '\0';
+      struct build_id_search search;
+      search.addr = start;
+      strcpy(search.build_id, "-");
+      dl_iterate_phdr(find_build_id, &search);
+      fprintf(dump, "%lx %lx %lx %s %s\n", start, end, offset, search.build_id, line + path_start);
+   }
+   fclose(maps);
+   fclose(dump);
+}
+
+/*
+ * smaps only reports Rss and AnonHugePages per mapping, large objects usually own their
+ * mapping, when they share one the values are prorated to the part they cover.
+ */
+static void sample_thp(struct large_object *objects, size_t nb_objects, uint64_t now) {
+   static size_t rss[PAGE_SAMPLE_MAX_OBJECTS], huge[PAGE_SAMPLE_MAX_OBJECTS];
+   static int smaps_failed;
+   char line[512];
+   uintptr_t start = 0, end = 0;
+   size_t i;
+
+   if(smaps_failed)
+      return;
+   int in_trace = _in_trace;
+   _in_trace = 1; // stdio allocates its buffer
+   FILE *smaps = fopen("/proc/self/smaps", "r");
+   if(!smaps) {
+      _in_trace = in_trace;
+      smaps_failed = 1;
+      fprintf(stderr, "Cannot open /proc/self/smaps, huge page backing is not sampled\n");
+      return;
+   }
+   memset(rss, 0, nb_objects * sizeof(*rss));
+   memset(huge, 0, nb_objects * sizeof(*huge));
+   while(fgets(line, sizeof(line), smaps)) {
+      unsigned long a, b, kb;
+      size_t *counter;
+      if(sscanf(line, "%lx-%lx ", &a, &b) == 2) {
+         start = a;
+         end = b;
+         continue;
+      }
+      if(sscanf(line, "Rss: %lu kB", &kb) == 1)
+         counter = rss;
+      else if(sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+         counter = huge;
+      else
+         continue;
+      if(!kb)
+         continue;
+      for(i = 0; i < nb_objects; i++) {
+         uintptr_t lo = objects[i].addr > start ? objects[i].addr : start;
+         uintptr_t hi = objects[i].addr + objects[i].size < end ? objects[i].addr + objects[i].size : end;
+         if(lo < hi)
+            counter[i] += (size_t)((double)kb * (hi - lo) / (end - start));
+      }
+   }
+   fclose(smaps);
+   _in_trace = in_trace;
+   for(i = 0; i < nb_objects; i++)
+      fprintf(pages_dump, "thp %lu %lx %lu %lu\n", (unsigned long)now, (unsigned long)objects[i].addr, (unsigned long)rss[i], (unsigned long)huge[i]);
+}
+
+/*
+ * Writes the buffered policy calls and, if the interval elapsed, the nodes on
+ * which the pages of the large objects are resident and their huge page backing:
+ *    policy time tid call addr length mode nodemask
+ *    residency time addr node pages
+ *    thp time addr rss_kb anon_huge_kb
+ * Up to PAGE_SAMPLE_MAX_PAGES evenly spaced pages are queried per object, pages are
+ * scaled to the whole object. Node -1 counts pages that were not touched yet.
+ */
+void sample_pages(int force) {
+   static struct large_object objects[PAGE_SAMPLE_MAX_OBJECTS];
+   static struct page_policy policies[MAX_PAGE_POLICIES];
+   static void *pages[PAGE_SAMPLE_MAX_PAGES];
+   static int status[PAGE_SAMPLE_MAX_PAGES];
+   static uint64_t last_sample;
+   static int move_pages_failed;
+   size_t i, k, nb_objects = 0, nb_policies;
+   uint64_t now = get_nsecs();
+   int sample = PageSampleMinSize && (force || now - last_sample >= PageSampleInterval * 1000000ULL);
+
+   pthread_mutex_lock(&pages_lock);
+   nb_policies = nb_page_policies;
+   memcpy(policies, page_policies, nb_policies * sizeof(*policies));
+   nb_page_policies = 0;
+   if(sample) {
+      nb_objects = nb_large_objects;
+      memcpy(objects, large_objects, nb_objects * sizeof(*objects));
+   }
+   pthread_mutex_unlock(&pages_lock);
+   if(!nb_policies && !nb_objects)
+      return;
+   if(sample)
+      last_sample = now;
+
+   if(!pages_dump)
+      pages_dump = open_file(0, "allocationPages", 0);
+   for(i = 0; i < nb_policies; i++) {
+      struct page_policy *p = &policies[i];
+      fprintf(pages_dump, "policy %lu %d %s %lx %lu %d %lx\n", (unsigned long)(UseTsc ? tsc_to_nsecs(p->time) : p->time), p->tid, p->call, (unsigned long)p->addr, (unsigned long)p->length, p->mode, p->nodemask);
+   }
+   long page_size = sysconf(_SC_PAGESIZE);
+   for(i = 0; i < nb_objects && !move_pages_failed; i++) {
+      size_t nb_pages = (objects[i].size + page_size - 1) / page_size;
+      size_t count = nb_pages < PAGE_SAMPLE_MAX_PAGES ? nb_pages : PAGE_SAMPLE_MAX_PAGES;
+      uintptr_t first = objects[i].addr & ~(uintptr_t)(page_size - 1);
+      for(k = 0; k < count; k++)
+         pages[k] = (void *)(first + (k * nb_pages / count) * page_size);
+      if(syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0) {
+         if(errno == ENOSYS) {
+            move_pages_failed = 1;
+            fprintf(stderr, "move_pages() is not supported, NUMA residency is not sampled\n");
+            break;
+         }
+         continue;
+      }
+      // Nodes and not resident pages (-1), any other error means the object is gone
+      size_t counts[65] = { 0 };
+      for(k = 0; k < count; k++) {
+         if(status[k] >= 0 && status[k] < 64)
+            counts[status[k] + 1]++;
+         else if(status[k] == -ENOENT)
+            counts[0]++;
+      }
+      for(k = 0; k < 65; k++)
+         if(counts[k])
+            fprintf(pages_dump, "residency %lu %lx %d %lu\n", (unsigned long)now, (unsigned long)objects[i].addr, (int)k - 1, (unsigned long)(counts[k] * nb_pages / count));
+   }
+   if(nb_objects)
+      sample_thp(objects, nb_objects, now);
+   fflush(pages_dump);
+}
+
+/* Writes all stacks that were added since the last call to the stack file of the process */
+void drain_stacks() {
+   uint32_t n = __atomic_load_n(&nb_stacks, __ATOMIC_ACQUIRE);
+   while(nb_written_stacks < n) {
+      uint32_t slot = __atomic_load_n(&stack_slots[nb_written_stacks], __ATOMIC_ACQUIRE);
+      if(slot == 0)
+         break; // not yet published, continue next time
+      if(slot == STACK_SLOT_SKIPPED) {
+         nb_written_stacks++;
+         continue;
+      }
+      struct stack_entry *e = &stack_table[slot - 1];
+      while(__atomic_load_n(&e->id, __ATOMIC_ACQUIRE) == 0)
+         sched_yield();
+      if(!stack_dump)
+         stack_dump = open_file(0, "allocationStacks", BinaryFormat);
+      write_stack(stack_dump, nb_written_stacks + 1, e);
+      nb_written_stacks++;
+   }
+   pthread_mutex_lock(&region_tags_lock);
+   for(; nb_written_region_tags < nb_region_tags; nb_written_region_tags++) {
+      if(!stack_dump)
+         stack_dump = open_file(0, "allocationStacks", BinaryFormat);
+      write_region_tag(stack_dump, nb_written_region_tags + 1, region_tags[nb_written_region_tags]);
+   }
+   pthread_mutex_unlock(&region_tags_lock);
+   if(stack_dump)
+      fflush(stack_dump);
+}
+
+/* Writes all committed entries of all rings to their files, returns the number of written entries */
+size_t drain_rings() {
+   size_t written = 0;
+   if(UseTsc)
+      calibrate_tsc();
+   drain_stacks();
+   struct ring *r;
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+      struct log *entries = __atomic_load_n(&r->entries, __ATOMIC_ACQUIRE);
+      if(!entries)
+         continue;
+      // Read the state first: all events of a retired ring are committed before it is retired
+      int retired = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == RING_RETIRED;
+      size_t tail = r->tail;
+      size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      if(tail != head && !r->dump)
+         r->dump = open_file(r->tid, "allocationData", BinaryFormat);
+      written += head - tail;
+      for(; tail != head; tail++) {
+         write_entry(r, &entries[tail & (RING_SIZE - 1)]);
+         // Hand slots back early so that a waiting thread can continue
+         if((tail & 1023) == 1023)
+            __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+      }
+      __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+      if(retired) {
+         if(r->dump) {
+            fclose(r->dump);
+            r->dump = NULL;
+         }
+         __atomic_store_n(&r->entries, (struct log*) NULL, __ATOMIC_RELAXED);
+         libc_free(entries);
+         __atomic_store_n(&r->state, RING_FREE, __ATOMIC_RELEASE);
+      }
+   }
+   return written;
+}
+
+void *writer_main(void *arg) {
+   // Allocations of the writer itself must never be logged
+   _in_trace = 1;
+   pthread_mutex_lock(&writer_lock);
+   while(!writer_stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+      if(deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+      pthread_mutex_unlock(&writer_lock);
+      pthread_mutex_lock(&drain_lock);
+      drain_rings();
+      sample_pages(0);
+      pthread_mutex_unlock(&drain_lock);
+      pthread_mutex_lock(&writer_lock);
+   }
+   pthread_mutex_unlock(&writer_lock);
+   return NULL;
+}
+
+static void start_writer(void) {
+   int in_trace = _in_trace;
+   _in_trace = 1;
+   if(pthread_create(&writer, NULL, writer_main, NULL) == 0)
+      __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+   else
+      fprintf(stderr, "Can not start allocation writer thread, allocations are not logged\n");
+   _in_trace = in_trace;
+}
+
+void write_metadata() {
+   size_t dropped = __atomic_load_n(&exited_dropped, __ATOMIC_RELAXED);
+   struct ring *r;
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+      dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+   FILE *meta = open_file(0, "allocationMeta", 0);
+   fprintf(meta, "dropped %lu\n", (unsigned long)dropped);
+   fprintf(meta, "stacks %lu\n", (unsigned long)__atomic_load_n(&nb_stacks, __ATOMIC_ACQUIRE));
+   fprintf(meta, "stack_table_full %lu\n", (unsigned long)__atomic_load_n(&stack_table_full, __ATOMIC_RELAXED));
+   fprintf(meta, "live_table_full %lu\n", (unsigned long)__atomic_load_n(&live_table_full, __ATOMIC_RELAXED));
+   fprintf(meta, "large_objects_full %lu\n", (unsigned long)large_objects_full);
+   fprintf(meta, "page_policies_dropped %lu\n", (unsigned long)page_policies_dropped);
+   fprintf(meta, "region_tags_full %lu\n", (unsigned long)region_tags_full);
+   size_t unwind_samples = 0;
+   uint64_t unwind_ns = 0;
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+      unwind_samples += r->unwind_samples;
+      unwind_ns += r->unwind_ns;
+   }
+   fprintf(meta, "unwind_samples %lu\n", (unsigned long)unwind_samples);
+   fprintf(meta, "unwind_ns %lu\n", (unsigned long)unwind_ns);
+   fclose(meta);
+   if(dropped)
+      fprintf(stderr, "Allocation tracker dropped %lu events\n", (unsigned long)dropped);
+   if(shm_dropped)
+      fprintf(stderr, "Allocation tracker lost %lu bytes because the collector exited\n", (unsigned long)shm_dropped);
+}
+
+/* Writes the objects that are still live at exit to <pid>.allocationLive */
+void write_live_objects() {
+   struct ring out;
+   size_t i;
+   memset(&out, 0, sizeof(out));
+   for(i = 0; i < LIVE_TABLE_SIZE + nb_mappings; i++) {
+      struct live_object *e = i < LIVE_TABLE_SIZE ? &live_table[i] : &mappings[i - LIVE_TABLE_SIZE];
+      if(e->addr <= LIVE_BUSY || e->start < live_epoch)
+         continue;
+      if(!out.dump)
+         out.dump = open_file(0, "allocationLive", BinaryFormat);
+      struct log l;
+      l.start = e->start;
+      l.end = 0;
+      l.addr = (void*)(e->addr & ~LIVE_REGION_BIT);
+      l.size = e->size;
+      l.entry_type = e->type;
+      l.cpu = e->cpu;
+      l.tid = e->tid;
+      l.pid = _getpid();
+      l.stack_id = e->stack_id;
+      l.tag = e->tag;
+      write_entry(&out, &l);
+   }
+   if(out.dump)
+      fclose(out.dump);
+}
+
+static int bye_done = 0;
+void
+__attribute__((destructor))
+bye(void) {
+   if(__atomic_exchange_n(&bye_done, 1, __ATOMIC_ACQ_REL))
+      return;
+
+   if(__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&writer_lock);
+      writer_stop = 1;
+      pthread_cond_signal(&writer_cond);
+      pthread_mutex_unlock(&writer_lock);
+      pthread_join(writer, NULL);
+      __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+   }
+
+   _in_trace = 1;
+   pthread_mutex_lock(&drain_lock);
+   drain_rings();
+   sample_pages(1);
+   if(pages_dump) {
+      fclose(pages_dump);
+      pages_dump = NULL;
+   }
+   struct ring *r, *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+   if(first) {
+      write_live_objects();
+      write_maps();
+   }
+   drain_stacks();
+   for(r = first; r; r = r->next) {
+      if(r->dump) {
+         fclose(r->dump);
+         r->dump = NULL;
+      }
+   }
+   if(stack_dump) {
+      fclose(stack_dump);
+      stack_dump = NULL;
+   }
+   if(first)
+      write_metadata();
+   pthread_mutex_unlock(&drain_lock);
+}
+
+/*
+ * fork() from a tracked process: the writer and all other threads are gone in
+ * the child and its events belong to a new process. The files are flushed
+ * before the fork, the child drops everything that was not written yet and
+ * starts its own files. Stacks stay valid, the child writes all of them again.
+ */
+static void fork_prepare(void) {
+   struct ring *r;
+   // Taken first, a thread that holds it may wait for the writer to drain its ring
+   pthread_mutex_lock(&mappings_lock);
+   pthread_mutex_lock(&drain_lock);
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+      if(r->dump)
+         fflush(r->dump);
+   if(stack_dump)
+      fflush(stack_dump);
+   if(pages_dump)
+      fflush(pages_dump);
+   pthread_mutex_lock(&pages_lock);
+   pthread_mutex_lock(&region_tags_lock);
+}
+
+static void fork_parent(void) {
+   pthread_mutex_unlock(&region_tags_lock);
+   pthread_mutex_unlock(&pages_lock);
+   pthread_mutex_unlock(&drain_lock);
+   pthread_mutex_unlock(&mappings_lock);
+}
+
+static void fork_child(void) {
+   struct ring *r;
+   int cpu;
+   pid = 0;
+   tid = 0;
+   ExecGeneration = 0;
+   set_image_name();
+   _in_trace = 1;
+   for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+      if(r->dump)
+         fclose(r->dump);
+      libc_free(r->entries);
+      r->entries = NULL;
+      r->dump = NULL;
+      r->head = 0;
+      r->tail = 0;
+      r->dropped = 0;
+      r->unwind_calls = 0;
+      r->unwind_samples = 0;
+      r->unwind_ns = 0;
+      r->state = RING_FREE;
+   }
+   thread_ring = NULL;
+   pthread_setspecific(ring_key, NULL);
+   exited_dropped = 0;
+
+   if(stack_dump)
+      fclose(stack_dump);
+   stack_dump = NULL;
+   nb_written_stacks = 0;
+   stack_table_full = 0;
+   nb_written_region_tags = 0;
+   region_tags_full = 0;
+   // Stacks that other threads were interning at the time of the fork are never published
+   uint32_t i, n = nb_stacks;
+   for(i = 0; i < STACK_TABLE_SIZE; i++)
+      if(stack_table[i].hash && !stack_table[i].id)
+         stack_table[i].hash = 0;
+   for(i = 0; i < n; i++)
+      if(!stack_slots[i])
+         stack_slots[i] = STACK_SLOT_SKIPPED;
+
+   live_epoch = event_time(&cpu);
+   live_table_full = 0;
+
+   // Large objects of the parent are not sampled by the child
+   if(pages_dump)
+      fclose(pages_dump);
+   pages_dump = NULL;
+   nb_large_objects = 0;
+   nb_page_policies = 0;
+   large_objects_full = 0;
+   page_policies_dropped = 0;
+   pthread_mutex_init(&pages_lock, NULL);
+   pthread_mutex_init(&region_tags_lock, NULL);
+   pthread_mutex_init(&mappings_lock, NULL);
+   shm_dropped = 0;
+
+   pthread_mutex_init(&writer_lock, NULL);
+   pthread_cond_init(&writer_cond, NULL);
+   pthread_mutex_init(&drain_lock, NULL);
+   writer_once = PTHREAD_ONCE_INIT;
+   writer_running = 0;
+   writer_stop = 0;
+   _in_trace = 0;
+
+   // The stack of the forking thread is inherited, it becomes the main thread of the child
+   if(thread_stack_key) {
+      struct live_object o;
+      live_remove(thread_stack_key, &o);
+      thread_stack_key = 0;
+   }
+   track_thread_stack(0);
+}
+
+/*
+ * exec() replaces the image without running destructors: the files are
+ * completed first. Returns the environment for the new image, which gets the
+ * next image name, or NULL if the process is not tracked.
+ */
+static char **prepare_exec(char *const envp[]) {
+   static char exec_var[64];
+   size_t i, n = 0;
+   if(!TrackingEnabled)
+      return NULL;
+   bye();
+   _in_trace = 1;
+   while(envp && envp[n])
+      n++;
+   char **env = (char **)libc_malloc((n + 2) * sizeof(char *));
+   if(!env)
+      return NULL;
+   snprintf(exec_var, sizeof(exec_var), "ALLOCATION_EXEC=%d:%d", _getpid(), ExecGeneration + 1);
+   for(i = 0, n = 0; envp && envp[i]; i++)
+      if(strncmp(envp[i], "ALLOCATION_EXEC=", 16) != 0)
+         env[n++] = envp[i];
+   env[n++] = exec_var;
+   env[n] = NULL;
+   return env;
+}
+
+/* The files are already complete, the process is not tracked any more */
+static void exec_failed(char **env) {
+   if(!TrackingEnabled)
+      return;
+   TrackingEnabled = 0;
+   libc_free(env);
+}
+
+extern "C" int execve(const char *path, char *const argv[], char *const envp[]) {
+   char **env = prepare_exec(envp);
+   int ret = libc_execve(path, argv, env ? env : envp);
+   int err = errno;
+   exec_failed(env);
+   errno = err;
+   return ret;
+}
+
+extern "C" int execvpe(const char *file, char *const argv[], char *const envp[]) {
+   char **env = prepare_exec(envp);
+   int ret = libc_execvpe(file, argv, env ? env : envp);
+   int err = errno;
+   exec_failed(env);
+   errno = err;
+   return ret;
+}
+
+extern "C" int execv(const char *path, char *const argv[]) {
+   return execve(path, argv, environ);
+}
+
+extern "C" int execvp(const char *file, char *const argv[]) {
+   return execvpe(file, argv, environ);
+}
+
+/* Copies the arguments of execl(), execlp() and execle() to argv, returns the va_list positioned after the NULL */
+#define COLLECT_EXEC_ARGS(argv, arg, ap) \
+   size_t nb_args = 1; \
+   va_start(ap, arg); \
+   while(va_arg(ap, char *)) \
+      nb_args++; \
+   va_end(ap); \
+   char **argv = (char **)alloca((nb_args + 1) * sizeof(char *)); \
+   argv[0] = (char *)arg; \
+   va_start(ap, arg); \
+   for(size_t k = 1; k <= nb_args; k++) \
+      argv[k] = va_arg(ap, char *);
+
+extern "C" int execl(const char *path, const char *arg, ...) {
+   va_list ap;
+   COLLECT_EXEC_ARGS(argv, arg, ap);
+   va_end(ap);
+   return execve(path, argv, environ);
+}
+
+extern "C" int execlp(const char *file, const char *arg, ...) {
+   va_list ap;
+   COLLECT_EXEC_ARGS(argv, arg, ap);
+   va_end(ap);
+   return execvpe(file, argv, environ);
+}
+
+extern "C" int execle(const char *path, const char *arg, ...) {
+   va_list ap;
+   COLLECT_EXEC_ARGS(argv, arg, ap);
+   char *const *envp = va_arg(ap, char *const *);
+   va_end(ap);
+   return execve(path, argv, envp);
+}
+
+/* Returns 1 if name is an entry of the comma separated list */
+static int in_list(const char *list, const char *name) {
+   size_t len = strlen(name);
+   while(*list) {
+      size_t entry = strcspn(list, ",");
+      if(entry == len && strncmp(list, name, len) == 0)
+         return 1;
+      list += entry;
+      if(*list == ',')
+         list++;
+   }
+   return 0;
+}
+
+static int is_tracked_program(void) {
+   const char *include = getenv("ALLOCATION_INCLUDE");
+   if(include != nullptr && *include)
+      return in_list(include, program_invocation_short_name);
+   const char *exclude = getenv("ALLOCATION_EXCLUDE");
+   if(exclude == nullptr)
+      exclude = DefaultExcludes;
+   return !in_list(exclude, program_invocation_short_name);
+}
+
+/* Allocations done while libunwind is loaded still use the previous unwinder */
+static void load_libunwind(void) {
+   void *libunwind = dlopen("libunwind.so.8", RTLD_NOW);
+   if(libunwind)
+      libunwind_backtrace = (int ( *)(void **, int)) dlsym(libunwind, "unw_backtrace");
+   if(!libunwind_backtrace) {
+      fprintf(stderr, "libunwind not found, using frame pointers to collect stack traces\n");
+      Unwinder = UNWINDER_FRAME_POINTER;
+      return;
+   }
+   // Cache unwind information per thread, avoids locking in the unwinder
+   int (*set_caching_policy)(void *, int) = (int ( *)(void *, int)) dlsym(libunwind, "_ULx86_64_set_caching_policy");
+   void **local_addr_space = (void **) dlsym(libunwind, "_ULx86_64_local_addr_space");
+   if(set_caching_policy && local_addr_space)
+      set_caching_policy(*local_addr_space, 2 /* UNW_CACHE_PER_THREAD */);
+   Unwinder = UNWINDER_LIBUNWIND;
+}
+
+/* Idempotent, the hooks resolve the libc functions before the constructor if they are called first */
+static void resolve_libc(void) {
+   libc_calloc = (void * ( *)(size_t, size_t)) dlsym(RTLD_NEXT, "calloc");
+   libc_malloc = (void * ( *)(size_t)) dlsym(RTLD_NEXT, "malloc");
+   libc_realloc = (void * ( *)(void *, size_t)) dlsym(RTLD_NEXT, "realloc");
+   libc_free = (void ( *)(void *)) dlsym(RTLD_NEXT, "free");
    libc_mmap = (void * ( *)(void *, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap");
    libc_munmap = (int ( *)(void *, size_t)) dlsym(RTLD_NEXT, "munmap");
    libc_mmap64 = (void * ( *)(void *, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap64");
    libc_memalign = (void * ( *)(size_t, size_t)) dlsym(RTLD_NEXT, "memalign");
    libc_posix_memalign = (int ( *)(void **, size_t, size_t)) dlsym(RTLD_NEXT, "posix_memalign");
-   const char* s = getenv("ALLOCATION_MIN_SIZE");
+   libc_aligned_alloc = (void * ( *)(size_t, size_t)) dlsym(RTLD_NEXT, "aligned_alloc");
+   libc_valloc = (void * ( *)(size_t)) dlsym(RTLD_NEXT, "valloc");
+   libc_pvalloc = (void * ( *)(size_t)) dlsym(RTLD_NEXT, "pvalloc");
+   libc_mremap = (void * ( *)(void *, size_t, size_t, int, ...)) dlsym(RTLD_NEXT, "mremap");
+   libc_execve = (int ( *)(const char *, char *const [], char *const [])) dlsym(RTLD_NEXT, "execve");
+   libc_execvpe = (int ( *)(const char *, char *const [], char *const [])) dlsym(RTLD_NEXT, "execvpe");
+   libc_pthread_create = (int ( *)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *)) dlsym(RTLD_NEXT, "pthread_create");
+   libc_pthread_exit = (void ( *)(void *)) dlsym(RTLD_NEXT, "pthread_exit");
+}
+
+/*
+ * Runs from the first hook that is called or as constructor, whichever comes
+ * first. Everything after resolve_libc() only runs once per process: the
+ * calibration, the thread key and the fork handlers must not be created again.
+ */
+static int init_state = 0;   /* 0: not started, 1: running, 2: done */
+
+void
+__attribute__((constructor))
+m_init(void) {
+   resolve_libc();
+   int expected = 0;
+   if(!__atomic_compare_exchange_n(&init_state, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return;
+   // Hooks that run while the configuration is read still see TrackingEnabled == 0
+   const int tracked = is_tracked_program();
+   const char* s = getenv("ALLOCATION_EXEC");
+   if (s != nullptr)
+   {
+	   int exec_pid, generation;
+	   if(sscanf(s, "%d:%d", &exec_pid, &generation) == 2 && exec_pid == _getpid())
+		   ExecGeneration = generation;
+   }
+   set_image_name();
+   s = getenv("ALLOCATION_DIR");
+   if (s != nullptr && *s)
+   {
+	   OutputDir = s;
+   }
+   s = getenv("ALLOCATION_MIN_SIZE");
    if (s != nullptr)
    {
 	   AllocationMinSize = atol(s);
    }
+   s = getenv("ALLOCATION_PAGE_SAMPLE_MIN_SIZE");
+   if (s != nullptr)
+   {
+	   PageSampleMinSize = atol(s);
+   }
+   s = getenv("ALLOCATION_PAGE_SAMPLE_INTERVAL_MS");
+   if (s != nullptr && atoi(s) > 0)
+   {
+	   PageSampleInterval = atoi(s);
+   }
+   s = getenv("ALLOCATION_SAMPLE_INTERVAL");
+   if (s != nullptr)
+   {
+	   SampleInterval = atol(s);
+   }
+   s = getenv("ALLOCATION_STACK_DEPTH");
+   if (s != nullptr)
+   {
+	   StackDepth = atoi(s);
+	   if(StackDepth < 1)
+		   StackDepth = 1;
+	   if(StackDepth > MAX_CALLCHAIN_SIZE)
+		   StackDepth = MAX_CALLCHAIN_SIZE;
+   }
+   s = getenv("ALLOCATION_UNWINDER");
+   if (s != nullptr)
+   {
+	   if(strcmp(s, "fp") == 0)
+		   Unwinder = UNWINDER_FRAME_POINTER;
+	   else if(strcmp(s, "caller") == 0)
+		   Unwinder = UNWINDER_CALLER;
+	   else if(strcmp(s, "libunwind") == 0)
+		   load_libunwind();
+   }
+   s = getenv("ALLOCATION_FORMAT");
+   if (s != nullptr && strcmp(s, "text") == 0)
+   {
+	   BinaryFormat = 0;
+   }
+   if(tracked)
+   {
+	   // Excluded programs log no events and must not pay for the calibration
+	   s = getenv("ALLOCATION_CLOCK");
+	   if (has_invariant_tsc() && (s == nullptr || strcmp(s, "monotonic") != 0))
+	   {
+		   tsc_start = read_calibration();
+		   // First rate, the writer refines it before every drain
+		   while(get_nsecs() - tsc_start.ns < 1000000)
+			   ;
+		   calibrate_tsc();
+		   UseTsc = 1;
+	   }
+	   s = getenv("ALLOCATION_SHM");
+	   if (s != nullptr && *s)
+	   {
+		   attach_shm(s);
+	   }
+	   if(pthread_key_create(&ring_key, retire_thread) != 0)
+		   fprintf(stderr, "Can not create the allocation tracker thread key, rings of exited threads are not released\n");
+	   pthread_atfork(fork_prepare, fork_parent, fork_child);
+	   __atomic_store_n(&TrackingEnabled, 1, __ATOMIC_RELEASE);
+   }
+   if(!thread_stack_key)
+      track_thread_stack(0);
+   __atomic_store_n(&init_state, 2, __ATOMIC_RELEASE);
 }
@@ -0,0 +1,52 @@
+#ifndef PMP_ANNOTATE_H
+#define PMP_ANNOTATE_H
+
+/*
+ * Annotations for custom pool and arena allocators.
+ *
+ * The allocation tracker only sees the blocks a pool gets from malloc() or
+ * mmap(). pmp_region_alloc() reports an object the pool carved out of such a
+ * block, pmp_region_free() its release. Regions are stored as objects of type
+ * ALLOCATION_EVENT_REGION with their own call path, samples in a region are
+ * attributed to the region instead of the block. tag names the pool, e.g.
+ * "node pool", only the first 63 characters are kept.
+ *
+ * Regions that are not freed are live until exit, also when the block of
+ * the pool is released.
+ *
+ * The calls are implemented by the preloaded ldlib.so. Without it the weak
+ * references stay null and the calls do nothing. Define PMP_ANNOTATE_DISABLE
+ * to remove the calls completely.
+ *
+ * Include this header only, the tracker does not need to be linked.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void pmp_tracker_region_alloc(void *ptr, size_t size, const char *tag) __attribute__((weak));
+void pmp_tracker_region_free(void *ptr) __attribute__((weak));
+
+/* Inlined so that the call path of the region ends in the caller */
+static inline __attribute__((always_inline)) void pmp_region_alloc(void *ptr, size_t size, const char *tag) {
+#ifndef PMP_ANNOTATE_DISABLE
+   if(pmp_tracker_region_alloc)
+      pmp_tracker_region_alloc(ptr, size, tag);
+#endif
+}
+
+static inline __attribute__((always_inline)) void pmp_region_free(void *ptr) {
+#ifndef PMP_ANNOTATE_DISABLE
+   if(pmp_tracker_region_free)
+      pmp_tracker_region_free(ptr);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
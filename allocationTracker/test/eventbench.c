@@ -0,0 +1,64 @@
+/*
+ * Per event overhead of the tracker timestamps.
+ *
+ * Measures the two clock sources of event_time() in ldlib.c on their own
+ * (rdtscp against clock_gettime() + sched_getcpu()) and the cost of a small
+ * malloc/free pair, which is the cost per logged object when the program runs
+ * with LD_PRELOAD=ldlib.so. "make bench" runs it without the tracker, with the
+ * tracker and with ALLOCATION_CLOCK=monotonic.
+ *
+ * usage: eventbench [iterations]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+static uint64_t get_nsecs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the measured calls */
+static volatile uint64_t sink;
+
+int main(int argc, char **argv) {
+   long i, n = argc > 1 ? atol(argv[1]) : 10000000;
+   uint64_t start, sum = 0;
+   if(n <= 0) {
+      fprintf(stderr, "usage: eventbench [iterations]\n");
+      return 1;
+   }
+
+#ifdef __x86_64__
+   start = get_nsecs();
+   for(i = 0; i < n; i++) {
+      unsigned int aux;
+      sum += __rdtscp(&aux) + (aux & 0xfff);
+   }
+   printf("rdtscp                        %6.1f ns/event\n", (double)(get_nsecs() - start) / n);
+#endif
+
+   start = get_nsecs();
+   for(i = 0; i < n; i++)
+      sum += get_nsecs() + sched_getcpu();
+   printf("clock_gettime + sched_getcpu  %6.1f ns/event\n", (double)(get_nsecs() - start) / n);
+
+   start = get_nsecs();
+   for(i = 0; i < n; i++) {
+      char *p = (char *)malloc(32);
+      *(volatile char *)p = 0;
+      sum += (uintptr_t)p;
+      free(p);
+   }
+   printf("malloc + free                 %6.1f ns/object\n", (double)(get_nsecs() - start) / n);
+
+   sink = sum;
+   return 0;
+}
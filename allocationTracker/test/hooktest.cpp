@@ -0,0 +1,136 @@
+/*
+ * Calls every hooked allocation function. Runs with LD_PRELOAD=ldlib.so from
+ * hooktest.sh, which compares the objects logged by the tracker with the
+ * objects this program expects, one line per object on stdout:
+ *    <addr> <size> <type> <released>
+ * addr is hexadecimal, released is 0 for objects that are live at exit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define EVENT_ALLOC   1
+#define EVENT_MREMAP  3
+#define EVENT_MMAP    100
+
+static size_t page;
+
+static void expect(void *addr, size_t size, int type, int released) {
+   printf("%llx %zu %d %d\n", (unsigned long long)(uintptr_t)addr, size, type, released);
+}
+
+static char *map(void *at, size_t pages, int flags) {
+   void *addr = mmap(at, pages * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+   if(addr == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+   }
+   return (char *)addr;
+}
+
+static int map_type(int flags) {
+   return EVENT_MMAP + (MAP_PRIVATE | MAP_ANONYMOUS | flags);
+}
+
+int main() {
+   page = sysconf(_SC_PAGESIZE);
+
+   void *p = malloc(1001);
+   expect(p, 1001, EVENT_ALLOC, 1);
+   free(p);
+
+   p = calloc(1, 1002);
+   expect(p, 1002, EVENT_ALLOC, 1);
+   free(p);
+
+   p = malloc(1003);
+   expect(p, 1003, EVENT_ALLOC, 1);
+   void *q = realloc(p, 1004);
+   expect(q, 1004, EVENT_ALLOC, 1);
+   free(q);
+
+   // A failed realloc keeps the block tracked
+   p = malloc(1010);
+   if(realloc(p, SIZE_MAX / 2) != NULL)
+      return 1;
+   expect(p, 1010, EVENT_ALLOC, 1);
+   free(p);
+
+   p = memalign(64, 1005);
+   expect(p, 1005, EVENT_ALLOC, 1);
+   free(p);
+
+   if(posix_memalign(&p, 64, 1006) != 0)
+      return 1;
+   expect(p, 1006, EVENT_ALLOC, 1);
+   free(p);
+
+   p = aligned_alloc(64, 1088);
+   expect(p, 1088, EVENT_ALLOC, 1);
+   free(p);
+
+   p = valloc(1007);
+   expect(p, 1007, EVENT_ALLOC, 1);
+   free(p);
+
+   p = pvalloc(page + 1);
+   expect(p, 2 * page, EVENT_ALLOC, 1);
+   free(p);
+
+   char *c = new char[1008];
+   expect(c, 1008, EVENT_ALLOC, 1);
+   delete[] c;
+
+   // Whole region
+   char *m = map(NULL, 3, 0);
+   expect(m, 3 * page, map_type(0), 1);
+   munmap(m, 3 * page);
+
+   // Head, then the rest
+   m = map(NULL, 4, 0);
+   munmap(m, page);
+   expect(m, page, map_type(0), 1);
+   munmap(m + page, 3 * page);
+   expect(m + page, 3 * page, map_type(0), 1);
+
+   // Tail, then the rest
+   m = map(NULL, 5, 0);
+   munmap(m + 4 * page, page);
+   expect(m + 4 * page, page, map_type(0), 1);
+   munmap(m, 4 * page);
+   expect(m, 4 * page, map_type(0), 1);
+
+   // Middle, the region becomes two objects, one is live at exit
+   m = map(NULL, 6, 0);
+   munmap(m + 2 * page, page);
+   expect(m + 2 * page, page, map_type(0), 1);
+   munmap(m, 2 * page);
+   expect(m, 2 * page, map_type(0), 1);
+   expect(m + 3 * page, 3 * page, map_type(0), 0);
+
+   // Moved by mremap
+   m = map(NULL, 7, 0);
+   char *r = (char *)mremap(m, 7 * page, 14 * page, MREMAP_MAYMOVE);
+   if(r == MAP_FAILED)
+      return 1;
+   expect(m, 7 * page, map_type(0), 1);
+   expect(r, 14 * page, EVENT_MREMAP, 1);
+   munmap(r, 14 * page);
+
+   // Replaced by mmap(MAP_FIXED)
+   m = map(NULL, 8, 0);
+   char *f = map(m + page, 1, MAP_FIXED);
+   expect(m + page, page, map_type(0), 1);
+   munmap(m, 8 * page);
+   expect(m, page, map_type(0), 1);
+   expect(f, page, map_type(MAP_FIXED), 1);
+   expect(m + 2 * page, 6 * page, map_type(0), 1);
+
+   // Live at exit
+   p = malloc(1009);
+   expect(p, 1009, EVENT_ALLOC, 0);
+   return 0;
+}
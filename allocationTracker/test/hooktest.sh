@@ -0,0 +1,26 @@
+#!/bin/bash
+# Runs hooktest with the tracker and checks that every object it expects was logged
+# usage: hooktest.sh <ldlib.so> <hooktest>
+set -e
+tracker=$(realpath "$1")
+program=$(realpath "$2")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+ALLOCATION_DIR="$dir" ALLOCATION_FORMAT=text ALLOCATION_UNWINDER=caller LD_PRELOAD="$tracker" "$program" > "$dir/expected"
+
+# <start> end <end> pid <pid> tid <tid> cpu <cpu> size <size> addr <addr> type <type> stack <id> tag <id>
+cat "$dir"/*.allocationData "$dir"/*.allocationLive 2>/dev/null | awk '{ print $13, $11, $15, ($3 != 0) }' > "$dir/logged"
+
+failed=0
+while read -r line; do
+   if ! grep -qxF "$line" "$dir/logged"; then
+      echo "not logged: $line (addr size type released)"
+      failed=1
+   fi
+done < "$dir/expected"
+
+if [ $failed -ne 0 ]; then
+   exit 1
+fi
+echo "hooktest: $(wc -l < "$dir/expected") objects logged as expected"
@@ -321,6 +321,11 @@ def populate_memory_level():
     con.execute('insert into memory_levels values (?, ?)', (0x100, "Remote Cache (2 hops)"))
     con.execute('insert into memory_levels values (?, ?)', (0x200, "I/O"))
     con.execute('insert into memory_levels values (?, ?)', (0x400, "Uncached Memory"))
+    con.execute('insert into memory_levels values (?, ?)', (0x800, "L4"))
+    con.execute('insert into memory_levels values (?, ?)', (0x1000, "PMEM"))
+    con.execute('insert into memory_levels values (?, ?)', (0x2000, "CXL"))
+    con.execute('insert into memory_levels values (?, ?)', (0x4000, "Any Cache"))
+    con.execute('insert into memory_levels values (?, ?)', (0x8000, "Remote PMEM"))
     con.execute('end transaction')
 
 def populate_memory_snoop():
@@ -331,6 +336,8 @@ def populate_memory_snoop():
     con.execute('insert into memory_snoop values (?, ?)', (0x08, "Snoop Miss"))
     con.execute('insert into memory_snoop values (?, ?)', (0x10, "Snoop Hit Modified"))
     con.execute('insert into memory_snoop values (?, ?)', (0x02 | 0x08, "No Snoop and Snoop Miss"))
+    con.execute('insert into memory_snoop values (?, ?)', (0x20, "Snoop Forward"))
+    con.execute('insert into memory_snoop values (?, ?)', (0x40, "Snoop Peer"))
     con.execute('end transaction')
 
 def populate_memory_lock():
@@ -366,6 +373,7 @@ class mem_data_src:
 	mem_dtlb = 0
         mem_lvlnum = 0
         mem_remote = 0
+        mem_snoopx = 0
 
 class Data_src_bits( ctypes.LittleEndianStructure ):
     _fields_ = [
@@ -377,7 +385,8 @@ class Data_src_bits( ctypes.LittleEndianStructure ):
             ("mem_dtlb_hit_miss", ctypes.c_uint64, 3),
             ("mem_dtlb", ctypes.c_uint64, 4),
             ("mem_lvlnum",ctypes.c_uint64,4),
-            ("mem_remote",ctypes.c_uint64,1)
+            ("mem_remote",ctypes.c_uint64,1),
+            ("mem_snoopx",ctypes.c_uint64,2)
             ]
 
 class Data_src_t( ctypes.Union):
@@ -387,6 +396,16 @@ class Data_src_t( ctypes.Union):
             ("asInt", ctypes.c_uint64)
             ]
 
+# memory_levels id of mem_lvl_num | mem_remote << 4, remote caches and DRAM map to the old remote levels
+level_of_number = [
+    # local: NA, L1, L2, L3, L4, reserved, reserved, reserved, uncached, CXL, I/O, any cache, LFB, RAM, PMEM, NA
+    0, 0x01, 0x04, 0x08, 0x800, 0, 0, 0, 0x400, 0x2000, 0x200, 0x4000, 0x02, 0x10, 0x1000, 0,
+    # remote
+    0, 0x01, 0x04, 0x80, 0x800, 0, 0, 0, 0x400, 0x2000, 0x200, 0x80, 0x02, 0x20, 0x8000, 0]
+
+# memory_snoop id of mem_snoopx (forward, peer), 0 keeps mem_snoop
+snoop_of_extended = [0, 0x20, 0x40, 0x20]
+
 def decode_data_src(data_src_bit):
     data_src = Data_src_t()
     data_src.asInt = data_src_bit
@@ -400,36 +419,13 @@ def decode_data_src(data_src_bit):
     mds.mem_dtlb = data_src.mem_dtlb
     mds.mem_lvlnum = data_src.mem_lvlnum
     mds.mem_remote = data_src.mem_remote
+    mds.mem_snoopx = data_src.mem_snoopx
 
-    #convert new (skylake) format to old one
+    #convert new (skylake) format to the memory_levels and memory_snoop ids
     if(mds.mem_lvl == 0):
-        if(mds.mem_lvlnum == 0x01):
-            mds.mem_level = 1
-        if(mds.mem_lvlnum == 0x02):
-            mds.mem_level = 4
-        if(mds.mem_lvlnum == 0x03):
-            if(mds.mem_remote == 0x01):
-                mds.mem_level = 128
-            else:
-                mds.mem_lvel = 8
-        #if(mds.mem_lvlnum == 0x04):
-            #unsupported by old format
-        if(mds.mem_lvlnum == 0x0b):
-            if(mds.mem_remote == 0x01):
-                mds.mem_level = 128
-            #else:
-                #unsupported by old format
-        if(mds.mem_lvlnum == 0x0c):
-            mds.mem_level = 2
-        if(mds.mem_lvlnum == 0x0d):
-            if(mds.mem_remote == 0x01):
-                mds.mem_lvl = 32
-            else:
-                mds.mem_lvel = 16
-        #if(mds.mem_lvlnum == 0x0e):
-            #unsupported by old format
-        #if(mds.mem_lvlnum == 0x0f):
-            #unsupported by old format
+        mds.mem_lvl = level_of_number[mds.mem_lvlnum | mds.mem_remote << 4]
+    if(snoop_of_extended[mds.mem_snoopx] != 0):
+        mds.mem_snoop = snoop_of_extended[mds.mem_snoopx]
     return mds
 
 def trace_begin():
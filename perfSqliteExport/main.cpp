@@ -0,0 +1,920 @@
+/*
+ * perfSqliteExport: exports the samples of a perf.data file to a sqlite database.
+ *
+ * usage: perfSqliteExport [-i perf.data] [-c] [-j threads] <output database>
+ * -c also exports the call path of every sample.
+ *
+ * Writes the same tables as exportToSqlite.py through perf script, with the
+ * ids perf's db export assigns. Threads, maps and symbols are resolved here,
+ * rows are written with prepared statements in a single transaction.
+ *
+ * -j splits perf.data at round boundaries into parts that are exported by
+ * worker threads (default: one per core). A single pass over perf.data indexes
+ * the parts and the mmap, comm and fork records delivered before each of them.
+ * Each worker writes the samples of its part to a shard database with ids of
+ * its own, symbols are loaded once for all workers. The ids of the parts are
+ * merged in part order, so the output is the one of a sequential export, and
+ * the shards are appended to the output at the end.
+ *
+ * -i - reads the output of perf record -o - from stdin while perf records,
+ * with a single thread, so only the last rounds remain when perf exits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <algorithm>
+
+#include "perfdata.h"
+#include "symbols.h"
+
+static void log(const char *message) {
+   time_t now = time(NULL);
+   char stamp[64];
+   strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+   printf("%s %s\n", stamp, message);
+   fflush(stdout);
+}
+
+class Statement {
+public:
+   Statement(sqlite3 *db, const char *sql) {
+      if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+         fprintf(stderr, "Can not prepare %s: %s\n", sql, sqlite3_errmsg(db));
+         exit(1);
+      }
+   }
+   ~Statement() {
+      sqlite3_finalize(stmt);
+   }
+   Statement &bind(int64_t value) {
+      sqlite3_bind_int64(stmt, ++column, value);
+      return *this;
+   }
+   Statement &bind(const std::string &value) {
+      sqlite3_bind_text(stmt, ++column, value.c_str(), value.size(), SQLITE_STATIC);
+      return *this;
+   }
+   void insert() {
+      if(sqlite3_step(stmt) != SQLITE_DONE) {
+         fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+         exit(1);
+      }
+      sqlite3_reset(stmt);
+      column = 0;
+   }
+
+private:
+   sqlite3_stmt *stmt = nullptr;
+   int column = 0;
+};
+
+static void execute(sqlite3 *db, const char *sql) {
+   char *error = nullptr;
+   if(sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+      fprintf(stderr, "%s failed: %s\n", sql, error);
+      sqlite3_free(error);
+      exit(1);
+   }
+}
+
+static const char *samplesTable = "CREATE TABLE samples (id integer PRIMARY KEY, evsel_id bigint, machine_id bigint, \
+thread_id bigint, comm_id bigint, dso_id bigint, symbol_id bigint, sym_offset bigint, ip bigint, time bigint, cpu integer, \
+to_dso_id bigint, to_symbol_id bigint, to_sym_offset bigint, to_ip bigint, period bigint, weight bigint, \
+transaction_id bigint, data_src bigint, memory_opcode integer, memory_hit_miss integer, memory_level integer, \
+memory_snoop integer, memory_lock integer, memory_dtlb_hit_miss integer, memory_dtlb integer, branch_type integer, \
+in_tx boolean, call_path_id bigint)";
+static const char *insertSampleSql = "INSERT INTO samples VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)";
+
+static void createTables(sqlite3 *db, bool callchains) {
+   execute(db, "CREATE TABLE selected_events (id integer PRIMARY KEY, name varchar(80))");
+   execute(db, "CREATE TABLE machines (id integer PRIMARY KEY, pid integer, root_dir varchar(4096))");
+   execute(db, "CREATE TABLE threads (id integer PRIMARY KEY, machine_id bigint, process_id bigint, pid integer, tid integer)");
+   execute(db, "CREATE TABLE comms (id integer PRIMARY KEY, comm varchar(16))");
+   execute(db, "CREATE TABLE comm_threads (id integer PRIMARY KEY, comm_id bigint, thread_id bigint)");
+   execute(db, "CREATE TABLE dsos (id integer PRIMARY KEY, machine_id bigint, short_name varchar(256), long_name varchar(4096), build_id varchar(64))");
+   execute(db, "CREATE TABLE symbols (id integer PRIMARY KEY, dso_id bigint, sym_start bigint, sym_end bigint, binding integer, name varchar(2048))");
+   execute(db, "CREATE TABLE branch_types (id integer NOT NULL PRIMARY KEY, name varchar(80))");
+   execute(db, "CREATE TABLE memory_opcodes (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_hit_miss (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_levels (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_snoop (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_lock (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_dtlb_hit_miss (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, "CREATE TABLE memory_dtlb (id integer NOT NULL PRIMARY KEY, name varchar(50))");
+   execute(db, samplesTable);
+   if(callchains) {
+      execute(db, "CREATE TABLE call_paths (id integer PRIMARY KEY, parent_id bigint, symbol_id bigint, ip bigint)");
+      execute(db, "CREATE TABLE calls (id integer PRIMARY KEY, thread_id bigint, comm_id bigint, call_path_id bigint, \
+call_time bigint, return_time bigint, branch_count bigint, call_id bigint, return_id bigint, parent_call_path_id bigint, \
+flags integer)");
+   }
+
+   execute(db, "CREATE VIEW machines_view AS SELECT id, pid, root_dir, \
+CASE WHEN id=0 THEN 'unknown' WHEN pid=-1 THEN 'host' ELSE 'guest' END AS host_or_guest FROM machines");
+   execute(db, "CREATE VIEW dsos_view AS SELECT id, machine_id, \
+(SELECT host_or_guest FROM machines_view WHERE id = machine_id) AS host_or_guest, short_name, long_name, build_id FROM dsos");
+   execute(db, "CREATE VIEW symbols_view AS SELECT id, name, (SELECT short_name FROM dsos WHERE id=dso_id) AS dso, \
+dso_id, sym_start, sym_end, CASE WHEN binding=0 THEN 'local' WHEN binding=1 THEN 'global' ELSE 'weak' END AS binding FROM symbols");
+   execute(db, "CREATE VIEW threads_view AS SELECT id, machine_id, \
+(SELECT host_or_guest FROM machines_view WHERE id = machine_id) AS host_or_guest, process_id, pid, tid FROM threads");
+   execute(db, "CREATE VIEW comm_threads_view AS SELECT comm_id, (SELECT comm FROM comms WHERE id = comm_id) AS command, \
+thread_id, (SELECT pid FROM threads WHERE id = thread_id) AS pid, (SELECT tid FROM threads WHERE id = thread_id) AS tid FROM comm_threads");
+   if(callchains) {
+      execute(db, "CREATE VIEW call_paths_view AS SELECT c.id, printf(\"%X\",c.ip) AS ip, c.symbol_id, \
+(SELECT name FROM symbols WHERE id = c.symbol_id) AS symbol, (SELECT dso_id FROM symbols WHERE id = c.symbol_id) AS dso_id, \
+(SELECT dso FROM symbols_view  WHERE id = c.symbol_id) AS dso_short_name, c.parent_id, printf(\"%X\",p.ip) AS parent_ip, \
+p.symbol_id AS parent_symbol_id, (SELECT name FROM symbols WHERE id = p.symbol_id) AS parent_symbol, \
+(SELECT dso_id FROM symbols WHERE id = p.symbol_id) AS parent_dso_id, \
+(SELECT dso FROM symbols_view  WHERE id = p.symbol_id) AS parent_dso_short_name \
+FROM call_paths c INNER JOIN call_paths p ON p.id = c.parent_id");
+      execute(db, "CREATE VIEW calls_view AS SELECT calls.id, thread_id, (SELECT pid FROM threads WHERE id = thread_id) AS pid, \
+(SELECT tid FROM threads WHERE id = thread_id) AS tid, (SELECT comm FROM comms WHERE id = comm_id) AS command, call_path_id, \
+printf(\"%X\",ip) AS ip, symbol_id, (SELECT name FROM symbols WHERE id = symbol_id) AS symbol, call_time, return_time, \
+return_time - call_time AS elapsed_time, branch_count, call_id, return_id, \
+CASE WHEN flags=1 THEN 'no call' WHEN flags=2 THEN 'no return' WHEN flags=3 THEN 'no call/return' ELSE '' END AS flags, \
+parent_call_path_id FROM calls INNER JOIN call_paths ON call_paths.id = call_path_id");
+   }
+   execute(db, "CREATE VIEW samples_view AS SELECT id, time, cpu, (SELECT pid FROM threads WHERE id = thread_id) AS pid, \
+(SELECT tid FROM threads WHERE id = thread_id) AS tid, (SELECT comm FROM comms WHERE id = comm_id) AS command, \
+(SELECT name FROM selected_events WHERE id = evsel_id) AS event, printf(\"%X\",ip) AS ip_hex, \
+(SELECT name FROM symbols WHERE id = symbol_id) AS symbol, sym_offset, \
+(SELECT short_name FROM dsos WHERE id = dso_id) AS dso_short_name, printf(\"%X\",to_ip) AS to_ip, \
+(SELECT name FROM symbols WHERE id = to_symbol_id) AS to_symbol, to_sym_offset, \
+(SELECT short_name FROM dsos WHERE id = to_dso_id) AS to_dso_short_name, \
+(SELECT name FROM branch_types WHERE id = branch_type) AS branch_type_name, in_tx FROM samples");
+}
+
+static void populateMemoryTables(sqlite3 *db) {
+   execute(db, "INSERT INTO memory_opcodes VALUES (1,'NA'),(2,'Load'),(4,'Store'),(8,'Prefetch'),(16,'Code')");
+   execute(db, "INSERT INTO memory_hit_miss VALUES (1,'NA'),(2,'Hit'),(4,'Miss')");
+   execute(db, "INSERT INTO memory_levels VALUES (1,'L1'),(2,'LFB'),(4,'L2'),(8,'L3'),(16,'Local DRAM'),\
+(32,'Remote DRAM (1 hop)'),(64,'Remote DRAM (2 hops)'),(128,'Remote Cache (1 hops)'),(256,'Remote Cache (2 hops)'),\
+(512,'I/O'),(1024,'Uncached Memory'),(2048,'L4'),(4096,'PMEM'),(8192,'CXL'),(16384,'Any Cache'),(32768,'Remote PMEM')");
+   execute(db, "INSERT INTO memory_snoop VALUES (1,'NA'),(2,'No Snoop'),(4,'Snoop Hit'),(8,'Snoop Miss'),\
+(16,'Snoop Hit Modified'),(10,'No Snoop and Snoop Miss'),(32,'Snoop Forward'),(64,'Snoop Peer')");
+   execute(db, "INSERT INTO memory_lock VALUES (1,'NA'),(2,'Locked')");
+   execute(db, "INSERT INTO memory_dtlb_hit_miss VALUES (1,'NA'),(2,'Hit'),(4,'Miss')");
+   execute(db, "INSERT INTO memory_dtlb VALUES (1,'L1'),(2,'L2'),(3,'L1 or L2'),(4,'Hardware Walker'),(8,'OS Fault Handler')");
+}
+
+struct MemoryDataSource {
+   int64_t op, hitMiss, level, snoop, lock, dtlbHitMiss, dtlb;
+};
+
+/*
+ * memory_levels id of the Skylake and later mem_lvl_num encoding, used when
+ * the old mem_lvl bits are not set. Indexed by mem_lvl_num | mem_remote << 4,
+ * remote caches and DRAM map to the old remote levels.
+ */
+static const uint16_t levelOfNumber[32] = {
+   // local
+   0, 1 /* L1 */, 4 /* L2 */, 8 /* L3 */, 2048 /* L4 */, 0, 0, 0, 1024 /* uncached */, 8192 /* CXL */, 512 /* I/O */,
+   16384 /* any cache */, 2 /* LFB */, 16 /* RAM */, 4096 /* PMEM */, 0 /* NA */,
+   // remote
+   0, 1, 4, 128, 2048, 0, 0, 0, 1024, 8192, 512, 128, 2, 32, 32768, 0
+};
+
+/* memory_snoop id of the mem_snoopx bits, 0 keeps mem_snoop */
+static const uint8_t snoopOfExtended[4] = { 0, 32, 64, 32 };
+
+/*
+ * Splits perf_mem_data_src into the columns of the memory tables. Newer
+ * encodings are folded in through the tables above, without branches.
+ */
+static MemoryDataSource decodeDataSource(uint64_t dataSrc) {
+   MemoryDataSource m;
+   m.op = dataSrc & 0x1f;
+   m.hitMiss = (dataSrc >> 5) & 0x7;
+   const uint64_t level = (dataSrc >> 8) & 0x7ff;
+   const uint64_t snoop = (dataSrc >> 19) & 0x1f;
+   m.lock = (dataSrc >> 24) & 0x3;
+   m.dtlbHitMiss = (dataSrc >> 26) & 0x7;
+   m.dtlb = (dataSrc >> 29) & 0xf;
+   const uint64_t levelNum = (dataSrc >> 33) & 0x1f; // mem_lvl_num and mem_remote
+   const uint64_t snoopX = snoopOfExtended[(dataSrc >> 38) & 0x3];
+   m.level = level ? level : levelOfNumber[levelNum];
+   m.snoop = snoopX ? snoopX : snoop;
+   return m;
+}
+
+struct Comm {
+   std::string str;
+   uint64_t db_id = 0;
+};
+
+struct Map {
+   uint64_t start, end, pgoff;
+   Dso *dso;
+};
+
+typedef std::map<uint64_t, Map> Maps;
+
+struct Thread {
+   uint32_t pid, tid;
+   std::shared_ptr<Maps> maps;
+   Comm *comm = nullptr;
+   Comm *execComm = nullptr;
+   uint64_t db_id = 0;
+};
+
+struct Location {
+   Dso *dso = nullptr;
+   const Symbol *symbol = nullptr;
+   uint64_t symbolId = 0;
+   uint64_t offset = 0;
+};
+
+/* Replaces the parts of older maps the new one overlaps, like an mmap over an existing mapping */
+static void insertMap(Maps &maps, const Map &map) {
+   auto it = maps.lower_bound(map.start);
+   if(it != maps.begin())
+      --it;
+   while(it != maps.end() && it->second.start < map.end) {
+      const Map old = it->second;
+      if(old.end <= map.start) {
+         ++it;
+         continue;
+      }
+      it = maps.erase(it);
+      if(old.start < map.start) {
+         Map left = old;
+         left.end = map.start;
+         maps[left.start] = left;
+      }
+      if(old.end > map.end) {
+         Map right = old;
+         right.pgoff += map.end - old.start;
+         right.start = map.end;
+         maps[right.start] = right;
+      }
+   }
+   maps[map.start] = map;
+}
+
+static const Map *findMap(const Maps &maps, uint64_t ip) {
+   auto it = maps.upper_bound(ip);
+   if(it == maps.begin())
+      return nullptr;
+   --it;
+   return ip < it->second.end ? &it->second : nullptr;
+}
+
+struct CallPathKey {
+   uint64_t parent, symbol, ip;
+   bool operator==(const CallPathKey &o) const {
+      return parent == o.parent && symbol == o.symbol && ip == o.ip;
+   }
+};
+
+struct CallPathHash {
+   size_t operator()(const CallPathKey &k) const {
+      return (k.parent * 0x9e3779b97f4a7c15ULL) ^ (k.symbol * 0xc2b2ae3d27d4eb4fULL) ^ k.ip;
+   }
+};
+
+/* Ids of the rows the samples refer to, assigned on first use */
+class Ids {
+public:
+   virtual ~Ids() {}
+   virtual uint64_t event(const PerfEvent &event) = 0;
+   /* The main thread of the process is exported first */
+   virtual uint64_t thread(uint32_t pid, uint32_t tid) = 0;
+   /* A comm is exported together with the thread that uses it */
+   virtual uint64_t comm(uint64_t threadId, const std::string &str) = 0;
+   virtual uint64_t dso(const std::string &shortName, const std::string &longName, const std::string &buildId) = 0;
+   virtual uint64_t symbol(uint64_t dsoId, const Symbol &symbol) = 0;
+   virtual uint64_t callPath(const CallPathKey &key) = 0;
+};
+
+/* The ids of the output database, every id is inserted with its row */
+class Registry : public Ids {
+public:
+   Registry(sqlite3 *db, bool callchains)
+       : insertEvent(db, "INSERT INTO selected_events VALUES (?,?)"),
+         insertMachine(db, "INSERT INTO machines VALUES (?,?,?)"),
+         insertThread(db, "INSERT INTO threads VALUES (?,?,?,?,?)"),
+         insertComm(db, "INSERT INTO comms VALUES (?,?)"),
+         insertCommThread(db, "INSERT INTO comm_threads VALUES (?,?,?)"),
+         insertDso(db, "INSERT INTO dsos VALUES (?,?,?,?,?)"),
+         insertSymbol(db, "INSERT INTO symbols VALUES (?,?,?,?,?,?)") {
+      if(callchains)
+         insertCallPath.reset(new Statement(db, "INSERT INTO call_paths VALUES (?,?,?,?)"));
+      // id 0 means unknown, it is easier to create records for them than to replace the zeroes with NULLs
+      insertEvent.bind(0).bind(std::string("unknown")).insert();
+      insertMachine.bind(0).bind(0).bind(std::string("unknown")).insert();
+      insertThread.bind(0).bind(0).bind(0).bind(-1).bind(-1).insert();
+      insertComm.bind(0).bind(std::string("unknown")).insert();
+      insertDso.bind(0).bind(0).bind(std::string("unknown")).bind(std::string("unknown")).bind(std::string("")).insert();
+      insertSymbol.bind(0).bind(0).bind(0).bind(0).bind(0).bind(std::string("unknown")).insert();
+      Statement insertSample(db, insertSampleSql);
+      for(int i = 0; i < 29; i++)
+         insertSample.bind(0);
+      insertSample.insert();
+      if(callchains)
+         insertCallPath->bind(0).bind(0).bind(0).bind(0).insert();
+   }
+
+   uint64_t event(const PerfEvent &event) override {
+      uint64_t &id = events[&event];
+      if(!id) {
+         if(events.size() == 1) {
+            // perf's host machine, the only one this exporter knows
+            insertMachine.bind(1).bind(-1).bind(std::string("")).insert();
+         }
+         id = events.size();
+         insertEvent.bind(id).bind(event.name).insert();
+      }
+      return id;
+   }
+
+   uint64_t thread(uint32_t pid, uint32_t tid) override {
+      const auto key = std::make_pair(pid, tid);
+      auto it = threads.find(key);
+      if(it != threads.end())
+         return it->second;
+      const uint64_t processId = pid == tid ? threads.size() + 1 : thread(pid, pid);
+      const uint64_t id = threads.size() + 1;
+      threads[key] = id;
+      insertThread.bind(id).bind(1).bind(processId).bind((int32_t)pid).bind((int32_t)tid).insert();
+      return id;
+   }
+
+   uint64_t comm(uint64_t threadId, const std::string &str) override {
+      uint64_t &id = comms[std::make_pair(threadId, str)];
+      if(!id) {
+         id = comms.size();
+         insertComm.bind(id).bind(str).insert();
+         // One comm_threads row per comm, both get the same id
+         insertCommThread.bind(id).bind(id).bind(threadId).insert();
+      }
+      return id;
+   }
+
+   uint64_t dso(const std::string &shortName, const std::string &longName, const std::string &buildId) override {
+      uint64_t &id = dsos[longName];
+      if(!id) {
+         id = dsos.size();
+         insertDso.bind(id).bind(1).bind(shortName).bind(longName).bind(buildId).insert();
+      }
+      return id;
+   }
+
+   uint64_t symbol(uint64_t dsoId, const Symbol &symbol) override {
+      uint64_t &id = symbols[std::make_pair(std::make_pair(dsoId, symbol.start), symbol.name)];
+      if(!id) {
+         id = symbols.size();
+         insertSymbol.bind(id).bind(dsoId).bind(symbol.address).bind(symbol.address + (symbol.end - symbol.start))
+             .bind(symbol.binding).bind(symbol.name).insert();
+      }
+      return id;
+   }
+
+   uint64_t callPath(const CallPathKey &key) override {
+      uint64_t &id = callPaths[key];
+      if(!id) {
+         id = callPaths.size();
+         insertCallPath->bind(id).bind(key.parent).bind(key.symbol).bind(key.ip).insert();
+      }
+      return id;
+   }
+
+private:
+   Statement insertEvent, insertMachine, insertThread, insertComm, insertCommThread, insertDso, insertSymbol;
+   std::unique_ptr<Statement> insertCallPath;
+   std::map<const PerfEvent *, uint64_t> events;
+   std::map<std::pair<uint32_t, uint32_t>, uint64_t> threads;
+   std::map<std::pair<uint64_t, std::string>, uint64_t> comms;
+   std::unordered_map<std::string, uint64_t> dsos;
+   std::map<std::pair<std::pair<uint64_t, uint64_t>, std::string>, uint64_t> symbols;
+   std::unordered_map<CallPathKey, uint64_t, CallPathHash> callPaths;
+};
+
+/* Columns of the samples table that hold ids of a part, the kind of merged_id() */
+enum IdKind { EventIds, ThreadIds, CommIds, DsoIds, SymbolIds, CallPathIds, IdKinds };
+
+/*
+ * The ids of a part of a parallel export. They are assigned in the order of
+ * first use like Registry does, and the rows are kept. merge() hands the rows
+ * to the registry once the parts before were merged, so every row gets the id
+ * of a sequential export, and keeps the id it got for every id of the part.
+ */
+class PartIds : public Ids {
+public:
+   uint64_t event(const PerfEvent &event) override {
+      uint64_t &id = eventIds[&event];
+      if(!id) {
+         events.push_back(&event);
+         id = events.size();
+      }
+      return id;
+   }
+
+   uint64_t thread(uint32_t pid, uint32_t tid) override {
+      const auto key = std::make_pair(pid, tid);
+      auto it = threadIds.find(key);
+      if(it != threadIds.end())
+         return it->second;
+      if(pid != tid)
+         thread(pid, pid);
+      threads.push_back(key);
+      return threadIds[key] = threads.size();
+   }
+
+   uint64_t comm(uint64_t threadId, const std::string &str) override {
+      const auto key = std::make_pair(threadId, str);
+      uint64_t &id = commIds[key];
+      if(!id) {
+         comms.push_back(key);
+         id = comms.size();
+      }
+      return id;
+   }
+
+   uint64_t dso(const std::string &shortName, const std::string &longName, const std::string &buildId) override {
+      uint64_t &id = dsoIds[longName];
+      if(!id) {
+         dsos.push_back({shortName, longName, buildId});
+         id = dsos.size();
+      }
+      return id;
+   }
+
+   uint64_t symbol(uint64_t dsoId, const Symbol &symbol) override {
+      uint64_t &id = symbolIds[std::make_pair(std::make_pair(dsoId, symbol.start), symbol.name)];
+      if(!id) {
+         symbols.push_back(std::make_pair(dsoId, symbol));
+         id = symbols.size();
+      }
+      return id;
+   }
+
+   uint64_t callPath(const CallPathKey &key) override {
+      uint64_t &id = callPathIds[key];
+      if(!id) {
+         callPaths.push_back(key);
+         id = callPaths.size();
+      }
+      return id;
+   }
+
+   /* Ids of the registry, by IdKind and id of the part */
+   std::vector<uint64_t> merged[IdKinds];
+
+   /* True if every id of the part is the merged one, like in the first part */
+   bool unchanged() const {
+      for(const std::vector<uint64_t> &ids : merged) {
+         for(size_t id = 0; id < ids.size(); id++) {
+            if(ids[id] != id)
+               return false;
+         }
+      }
+      return true;
+   }
+
+   void merge(Registry &registry) {
+      for(std::vector<uint64_t> &ids : merged)
+         ids.assign(1, 0);
+      for(const PerfEvent *event : events)
+         merged[EventIds].push_back(registry.event(*event));
+      for(const auto &thread : threads)
+         merged[ThreadIds].push_back(registry.thread(thread.first, thread.second));
+      for(const auto &comm : comms)
+         merged[CommIds].push_back(registry.comm(merged[ThreadIds][comm.first], comm.second));
+      for(const DsoRow &dso : dsos)
+         merged[DsoIds].push_back(registry.dso(dso.shortName, dso.longName, dso.buildId));
+      for(const auto &symbol : symbols)
+         merged[SymbolIds].push_back(registry.symbol(merged[DsoIds][symbol.first], symbol.second));
+      // A parent has a smaller id than its children
+      for(const CallPathKey &key : callPaths)
+         merged[CallPathIds].push_back(registry.callPath({merged[CallPathIds][key.parent], merged[SymbolIds][key.symbol], key.ip}));
+   }
+
+private:
+   struct DsoRow {
+      std::string shortName, longName, buildId;
+   };
+
+   std::map<const PerfEvent *, uint64_t> eventIds;
+   std::map<std::pair<uint32_t, uint32_t>, uint64_t> threadIds;
+   std::map<std::pair<uint64_t, std::string>, uint64_t> commIds;
+   std::unordered_map<std::string, uint64_t> dsoIds;
+   std::map<std::pair<std::pair<uint64_t, uint64_t>, std::string>, uint64_t> symbolIds;
+   std::unordered_map<CallPathKey, uint64_t, CallPathHash> callPathIds;
+   std::vector<const PerfEvent *> events;
+   std::vector<std::pair<uint32_t, uint32_t>> threads;
+   std::vector<std::pair<uint64_t, std::string>> comms;
+   std::vector<DsoRow> dsos;
+   std::vector<std::pair<uint64_t, Symbol>> symbols;
+   std::vector<CallPathKey> callPaths;
+};
+
+/*
+ * Follows the processes of a part of perf.data and writes its samples.
+ * Sample ids continue after firstSample, the number of samples in front of
+ * the part, so the samples of all parts have the ids of a sequential export.
+ */
+class Exporter : public PerfHandler {
+public:
+   Exporter(Ids &ids, SymbolCache &symbols, const PerfData &perf, sqlite3 *db, bool callchains, uint64_t firstSample)
+       : ids(ids), symbols(symbols), perf(perf), callchains(callchains), eventIds(perf.events.size(), 0),
+         insertSample(db, insertSampleSql),
+         lastSampleId(firstSample) {}
+
+   void mmap(int32_t pid, uint32_t tid, uint64_t start, uint64_t len, uint64_t pgoff, const char *filename) override {
+      Map map = {start, start + len, pgoff, nullptr};
+      if(map.end < start)
+         map.end = UINT64_MAX;
+      if(pid == -1) {
+         map.dso = findDso(filename, true);
+         insertMap(kernelMaps, map);
+      } else {
+         map.dso = findDso(filename, false);
+         insertMap(*findThread(pid, tid)->maps, map);
+      }
+   }
+
+   void comm(uint32_t pid, uint32_t tid, const char *str, bool exec) override {
+      Thread *thread = findThread(pid, tid);
+      thread->comm = newComm(str);
+      if(exec)
+         thread->execComm = thread->comm;
+   }
+
+   void fork(uint32_t pid, uint32_t ppid, uint32_t tid, uint32_t ptid) override {
+      Thread *parent = findThread(ppid, ptid);
+      std::unique_ptr<Thread> thread(new Thread());
+      thread->pid = pid;
+      thread->tid = tid;
+      if(pid == ppid)
+         thread->maps = parent->maps;
+      else
+         thread->maps = std::make_shared<Maps>(*parent->maps);
+      thread->comm = newComm(parent->comm->str);
+      threads[tid] = std::move(thread);
+   }
+
+   void sample(const PerfSample &sample) override {
+      const size_t event = sample.event - perf.events.data();
+      // The events of a pipe are only known once it is read
+      if(event >= eventIds.size())
+         eventIds.resize(perf.events.size(), 0);
+      uint64_t &eventId = eventIds[event];
+      if(!eventId)
+         eventId = ids.event(*sample.event);
+      Thread *thread = findThread(sample.pid, sample.tid);
+      Comm *comm = exportThreads(thread);
+      Location location = resolve(thread, sample.cpumode, sample.ip);
+      uint64_t callPathId = callchains ? exportCallPath(thread, sample) : 0;
+      const MemoryDataSource m = decodeDataSource(sample.data_src);
+
+      insertSample.bind(++lastSampleId).bind(eventId).bind(1).bind(thread->db_id).bind(comm->db_id)
+          .bind(location.dso ? location.dso->db_id : 0).bind(location.symbolId)
+          .bind(location.offset).bind(sample.ip).bind(sample.time).bind((int32_t)sample.cpu)
+          // Data addresses do not correlate with symbols, perf exports them without
+          .bind(0).bind(0).bind(0).bind(sample.addr)
+          .bind(sample.period).bind(sample.weight).bind(sample.transaction).bind(sample.data_src)
+          .bind(m.op).bind(m.hitMiss).bind(m.level).bind(m.snoop).bind(m.lock).bind(m.dtlbHitMiss).bind(m.dtlb)
+          .bind(0).bind(0).bind(callPathId).insert();
+      samples++;
+   }
+
+   uint64_t samples = 0;
+
+private:
+   Dso *findDso(const std::string &filename, bool kernel) {
+      std::string name = filename;
+      if(kernel && name.compare(0, 17, "[kernel.kallsyms]") == 0)
+         name = "[kernel.kallsyms]";
+      std::unique_ptr<Dso> &dso = dsos[name];
+      if(!dso) {
+         dso.reset(new Dso(name, kernel, symbols));
+         if(kernel && name != "[kernel.kallsyms]") {
+            // Modules are named like in /proc/kallsyms, [name] without path and extension, - replaced by _
+            std::string module = name.substr(name.rfind('/') + 1);
+            module = module.substr(0, module.find('.'));
+            if(module[0] == '[')
+               module = module.substr(1, module.size() - 2);
+            for(char &c : module) {
+               if(c == '-')
+                  c = '_';
+            }
+            dso->shortName = "[" + module + "]";
+         }
+         auto buildId = perf.buildIds.find(name);
+         if(buildId != perf.buildIds.end())
+            dso->buildId = buildId->second;
+      }
+      return dso.get();
+   }
+
+   Comm *newComm(const std::string &str) {
+      comms.emplace_back();
+      comms.back().str = str;
+      return &comms.back();
+   }
+
+   /* Threads without fork or comm record get the name perf gives them */
+   Thread *findThread(uint32_t pid, uint32_t tid) {
+      auto it = threads.find(tid);
+      if(it != threads.end())
+         return it->second.get();
+      std::unique_ptr<Thread> thread(new Thread());
+      thread->pid = pid;
+      thread->tid = tid;
+      if(pid != tid && pid != (uint32_t)-1)
+         thread->maps = findThread(pid, pid)->maps;
+      else
+         thread->maps = std::make_shared<Maps>();
+      thread->comm = newComm(":" + std::to_string((int32_t)tid));
+      Thread *result = thread.get();
+      threads[tid] = std::move(thread);
+      return result;
+   }
+
+   /* Exports the thread, its process and their comms, returns the comm of the process */
+   Comm *exportThreads(Thread *thread) {
+      Thread *main = findThread(thread->pid, thread->pid);
+      if(!main->db_id)
+         main->db_id = ids.thread(main->pid, main->tid);
+      if(!thread->db_id)
+         thread->db_id = ids.thread(thread->pid, thread->tid);
+      Comm *comm = main->execComm ? main->execComm : main->comm;
+      if(!comm->db_id)
+         comm->db_id = ids.comm(main->db_id, comm->str);
+      if(thread != main && !thread->comm->db_id)
+         thread->comm->db_id = ids.comm(thread->db_id, thread->comm->str);
+      return comm;
+   }
+
+   /* Finds and exports dso and symbol of ip, a user space ip outside of the maps may be a kernel one */
+   Location resolve(Thread *thread, uint16_t cpumode, uint64_t ip) {
+      Location location;
+      const Map *map = nullptr;
+      if(cpumode == PERF_RECORD_MISC_USER)
+         map = findMap(*thread->maps, ip);
+      if(cpumode == PERF_RECORD_MISC_KERNEL || (cpumode == PERF_RECORD_MISC_USER && !map))
+         map = findMap(kernelMaps, ip);
+      if(!map)
+         return location;
+      location.dso = map->dso;
+      const uint64_t offset = map->dso->kernel || map->dso->anonymous ? ip : ip - map->start + map->pgoff;
+      location.symbol = map->dso->find(offset);
+      if(!location.symbol)
+         location.symbol = map->dso->unknown(offset);
+      location.offset = offset - location.symbol->start;
+      Dso *dso = location.dso;
+      if(!dso->db_id)
+         dso->db_id = ids.dso(dso->shortName, dso->longName, dso->buildId);
+      uint64_t &symbolId = dso->symbolId(location.symbol);
+      if(!symbolId)
+         symbolId = ids.symbol(dso->db_id, *location.symbol);
+      location.symbolId = symbolId;
+      return location;
+   }
+
+   uint64_t findCallPath(uint64_t parent, uint64_t symbol, uint64_t ip) {
+      const CallPathKey key = {parent, symbol, ip};
+      uint64_t &id = callPaths[key];
+      if(!id)
+         id = ids.callPath(key);
+      return id;
+   }
+
+   /* Path from the outermost caller to the sample ip, 0 without callchain */
+   uint64_t exportCallPath(Thread *thread, const PerfSample &sample) {
+      entries.clear();
+      uint16_t cpumode = sample.cpumode;
+      for(uint64_t i = 0; i < sample.nr_callchain; i++) {
+         uint64_t ip;
+         memcpy(&ip, sample.callchain + i * sizeof(uint64_t), sizeof(ip));
+         if(ip >= PERF_CONTEXT_MAX) {
+            switch(ip) {
+            case PERF_CONTEXT_HV:
+               cpumode = PERF_RECORD_MISC_HYPERVISOR;
+               break;
+            case PERF_CONTEXT_KERNEL:
+               cpumode = PERF_RECORD_MISC_KERNEL;
+               break;
+            case PERF_CONTEXT_USER:
+               cpumode = PERF_RECORD_MISC_USER;
+               break;
+            default:
+               cpumode = PERF_RECORD_MISC_GUEST_USER;
+               break;
+            }
+            continue;
+         }
+         entries.push_back({ip, cpumode});
+      }
+      if(entries.empty())
+         return 0;
+      // The root of all call paths, exported with the first one
+      uint64_t id = findCallPath(0, 0, 0);
+      for(size_t i = entries.size(); i-- > 0;) {
+         Location location = resolve(thread, entries[i].cpumode, entries[i].ip);
+         // Same as perf, nodes with a symbol are merged regardless of the ip
+         id = findCallPath(id, location.symbolId, location.symbol ? 0 : entries[i].ip);
+      }
+      return id;
+   }
+
+   struct Entry {
+      uint64_t ip;
+      uint16_t cpumode;
+   };
+
+   Ids &ids;
+   SymbolCache &symbols;
+   const PerfData &perf;
+   bool callchains;
+   std::vector<uint64_t> eventIds;
+   Statement insertSample;
+   uint64_t lastSampleId;
+   std::unordered_map<uint32_t, std::unique_ptr<Thread>> threads;
+   std::deque<Comm> comms;
+   std::unordered_map<std::string, std::unique_ptr<Dso>> dsos;
+   Maps kernelMaps;
+   std::unordered_map<CallPathKey, uint64_t, CallPathHash> callPaths;
+   std::vector<Entry> entries;
+};
+
+static sqlite3 *openDatabase(const std::string &path) {
+   // Existing files are overwritten
+   unlink(path.c_str());
+   sqlite3 *db;
+   if(sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+      fprintf(stderr, "Can not open %s: %s\n", path.c_str(), sqlite3_errmsg(db));
+      exit(1);
+   }
+   execute(db, "PRAGMA synchronous = OFF");
+   execute(db, "PRAGMA journal_mode = OFF");
+   execute(db, "PRAGMA cache_size = 10000");
+   return db;
+}
+
+struct Shard {
+   std::string path;
+   sqlite3 *db = nullptr;
+   PerfPart part;
+   PartIds ids;
+   uint64_t samples = 0;
+   uint64_t unhandled = 0;
+};
+
+/* Writes the samples of one part of perf.data to a database of its own, with the ids of the part */
+static void exportShard(SymbolCache &symbols, const PerfData &perf, bool callchains, Shard &shard) {
+   shard.db = openDatabase(shard.path);
+   execute(shard.db, samplesTable);
+   execute(shard.db, "BEGIN TRANSACTION");
+   {
+      Exporter exporter(shard.ids, symbols, perf, shard.db, callchains, shard.part.samples);
+      shard.unhandled = perf.process(exporter, shard.part);
+      shard.samples = exporter.samples;
+   }
+   execute(shard.db, "COMMIT");
+}
+
+/* merged_id(kind, id): the id of the output database for an id of the shard */
+static void mergedId(sqlite3_context *context, int, sqlite3_value **args) {
+   const PartIds *ids = (const PartIds *)sqlite3_user_data(context);
+   const int kind = sqlite3_value_int(args[0]);
+   const sqlite3_int64 id = sqlite3_value_int64(args[1]);
+   if(kind < 0 || kind >= IdKinds || id < 0 || (uint64_t)id >= ids->merged[kind].size()) {
+      sqlite3_result_error(context, "id not in the shard", -1);
+      return;
+   }
+   sqlite3_result_int64(context, ids->merged[kind][id]);
+}
+
+/* Once the ids are merged, replaces the ids of the part in the shard with the ones of the output */
+static void mergeShard(Shard &shard) {
+   if(!shard.ids.unchanged()) {
+      sqlite3_create_function(shard.db, "merged_id", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, (void *)&shard.ids, mergedId, NULL, NULL);
+      execute(shard.db, "BEGIN TRANSACTION");
+      execute(shard.db, "UPDATE samples SET evsel_id = merged_id(0, evsel_id), thread_id = merged_id(1, thread_id), \
+comm_id = merged_id(2, comm_id), dso_id = merged_id(3, dso_id), symbol_id = merged_id(4, symbol_id), \
+call_path_id = merged_id(5, call_path_id)");
+      execute(shard.db, "COMMIT");
+   }
+   sqlite3_close(shard.db);
+   shard.db = nullptr;
+}
+
+static void usage() {
+   fprintf(stderr, "usage: perfSqliteExport [-i perf.data] [-c] [-j threads] <output database>\n");
+}
+
+int main(int argc, char **argv) {
+   const char *input = "perf.data";
+   bool callchains = false;
+   unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+   int opt;
+   while((opt = getopt(argc, argv, "i:cj:h")) != -1) {
+      switch(opt) {
+      case 'i':
+         input = optarg;
+         break;
+      case 'c':
+         callchains = true;
+         break;
+      case 'j':
+         jobs = std::max(1, atoi(optarg));
+         break;
+      default:
+         usage();
+         return opt == 'h' ? 0 : 1;
+      }
+   }
+   if(optind + 1 != argc) {
+      usage();
+      return 1;
+   }
+   const std::string output = argv[optind];
+
+   const bool pipe = strcmp(input, "-") == 0;
+   PerfData perf;
+   if(pipe ? !perf.openPipe(stdin) : !perf.open(input))
+      return 1;
+   // A pipe can not be split
+   if(pipe)
+      jobs = 1;
+
+   log("Creating database...");
+   sqlite3 *db = openDatabase(output);
+   createTables(db, callchains);
+   populateMemoryTables(db);
+
+   log("Exporting perf.data to sqlite...");
+   // Small files may have fewer rounds than jobs
+   const std::vector<PerfPart> parts = pipe ? std::vector<PerfPart>(1) : perf.split(jobs);
+   std::vector<Shard> shards(parts.size());
+   SymbolCache symbols;
+   execute(db, "BEGIN TRANSACTION");
+   {
+      Registry registry(db, callchains);
+      if(parts.size() == 1) {
+         Exporter exporter(registry, symbols, perf, db, callchains, 0);
+         shards[0].unhandled = pipe ? perf.processPipe(exporter) : perf.process(exporter, parts[0]);
+         shards[0].samples = exporter.samples;
+         if(pipe) {
+            // perf writes the build ids to a pipe when it stops recording, after the dsos were exported
+            Statement update(db, "UPDATE dsos SET build_id = ? WHERE long_name = ? AND build_id = ''");
+            for(const auto &buildId : perf.buildIds)
+               update.bind(buildId.second).bind(buildId.first).insert();
+         }
+      } else {
+         // Every worker replays the processes in front of its part and writes its samples to a shard
+         std::vector<std::thread> workers;
+         for(size_t i = 0; i < parts.size(); i++) {
+            shards[i].path = output + ".shard" + std::to_string(i);
+            shards[i].part = parts[i];
+            workers.emplace_back(exportShard, std::ref(symbols), std::cref(perf), callchains, std::ref(shards[i]));
+         }
+         for(std::thread &worker : workers)
+            worker.join();
+         // In part order, the rows get the ids of a sequential export
+         workers.clear();
+         for(Shard &shard : shards) {
+            shard.ids.merge(registry);
+            workers.emplace_back(mergeShard, std::ref(shard));
+         }
+         for(std::thread &worker : workers)
+            worker.join();
+      }
+   }
+   execute(db, "COMMIT");
+
+   uint64_t samples = 0, unhandled = 0;
+   for(const Shard &shard : shards) {
+      samples += shard.samples;
+      unhandled += shard.unhandled;
+      if(shard.path.empty())
+         continue;
+      // Parts are in sample id order, the rows are appended without decoding
+      Statement attach(db, "ATTACH DATABASE ? AS shard");
+      attach.bind(shard.path).insert();
+      execute(db, "INSERT INTO samples SELECT * FROM shard.samples");
+      execute(db, "DETACH DATABASE shard");
+      unlink(shard.path.c_str());
+   }
+   if(callchains)
+      execute(db, "CREATE INDEX pcpid_idx ON calls (parent_call_path_id)");
+   sqlite3_close(db);
+
+   char message[128];
+   snprintf(message, sizeof(message), "Perf export done, %llu samples", (unsigned long long)samples);
+   log(message);
+   if(unhandled)
+      printf("Warning: %llu unhandled events\n", (unsigned long long)unhandled);
+   return 0;
+}
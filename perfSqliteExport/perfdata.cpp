@@ -0,0 +1,669 @@
+#include "perfdata.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+// "PERFILE2"
+#define PERF_MAGIC 0x32454c4946524550ULL
+
+#define HEADER_BUILD_ID 2
+#define HEADER_EVENT_DESC 12
+
+#define PERF_RECORD_HEADER_ATTR 64
+#define PERF_RECORD_HEADER_TRACING_DATA 66
+#define PERF_RECORD_HEADER_BUILD_ID 67
+#define PERF_RECORD_FINISHED_ROUND 68
+#define PERF_RECORD_AUXTRACE 71
+#define PERF_RECORD_HEADER_FEATURE 80
+#define PERF_RECORD_USER_TYPE_START 64
+#define PERF_RECORD_MISC_BUILD_ID_SIZE (1 << 15)
+
+// Newer than the uapi headers of older distributions
+#define SAMPLE_WEIGHT_STRUCT (1ULL << 24)
+#define SAMPLE_BRANCH_HW_INDEX (1ULL << 17)
+#define SAMPLE_BRANCH_COUNTERS (1ULL << 19)
+#define FORMAT_LOST (1ULL << 4)
+
+struct perf_file_section {
+   uint64_t offset;
+   uint64_t size;
+};
+
+struct perf_file_header {
+   uint64_t magic;
+   uint64_t size;
+   uint64_t attr_size;
+   struct perf_file_section attrs;
+   struct perf_file_section data;
+   struct perf_file_section event_types;
+   uint64_t adds_features[4];
+};
+
+static inline uint64_t u64at(const char *p) {
+   uint64_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static inline uint32_t u32at(const char *p) {
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static inline uint16_t recordSize(const char *record) {
+   perf_event_header header;
+   memcpy(&header, record, sizeof(header));
+   return header.size;
+}
+
+PerfData::~PerfData() {
+   if(data)
+      munmap((void *)data, length);
+}
+
+bool PerfData::open(const char *path) {
+   int fd = ::open(path, O_RDONLY);
+   if(fd < 0) {
+      fprintf(stderr, "Can not open %s: %s\n", path, strerror(errno));
+      return false;
+   }
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(perf_file_header)) {
+      fprintf(stderr, "%s is not a perf.data file\n", path);
+      close(fd);
+      return false;
+   }
+   length = st.st_size;
+   void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(addr == MAP_FAILED) {
+      fprintf(stderr, "mmap %s failed: %s\n", path, strerror(errno));
+      return false;
+   }
+   data = (const char *)addr;
+   madvise(addr, length, MADV_SEQUENTIAL);
+
+   perf_file_header header;
+   memcpy(&header, data, sizeof(header));
+   if(header.magic != PERF_MAGIC) {
+      // Written with -o -, a pipe header is only magic and size
+      fprintf(stderr, "%s is not a perf.data file of this byte order or was written to a pipe\n", path);
+      return false;
+   }
+   if(header.data.offset + header.data.size > length) {
+      fprintf(stderr, "%s is truncated, perf record did not finish\n", path);
+      return false;
+   }
+   dataOffset = header.data.offset;
+   dataSize = header.data.size;
+   if(!readAttrs(header.attrs.offset, header.attrs.size, header.attr_size))
+      return false;
+
+   // One section per feature bit, in bit order, behind the data section
+   const char *feature = data + header.data.offset + header.data.size;
+   for(int bit = 0; bit < 256; bit++) {
+      if(!(header.adds_features[bit / 64] & (1ULL << (bit % 64))))
+         continue;
+      if(feature + sizeof(perf_file_section) > data + length)
+         break;
+      perf_file_section section;
+      memcpy(&section, feature, sizeof(section));
+      feature += sizeof(section);
+      if(section.offset + section.size > length)
+         continue;
+      if(bit == HEADER_EVENT_DESC) {
+         const std::vector<std::string> names = readEventDesc(data + section.offset, section.size);
+         for(size_t i = 0; i < names.size() && i < events.size(); i++)
+            events[i].name = names[i];
+      } else if(bit == HEADER_BUILD_ID) {
+         readBuildIds(data + section.offset, section.size);
+      }
+   }
+   for(size_t i = 0; i < events.size(); i++) {
+      if(events[i].name.empty())
+         events[i].name = "unknown";
+   }
+   return true;
+}
+
+bool PerfData::openPipe(FILE *in) {
+   // magic and the size of this header
+   uint64_t header[2];
+   if(fread(header, sizeof(header), 1, in) != 1 || header[0] != PERF_MAGIC || header[1] != sizeof(header)) {
+      fprintf(stderr, "Input is not written by perf record -o - with this byte order\n");
+      return false;
+   }
+   pipe = in;
+   return true;
+}
+
+bool PerfData::readAttrs(uint64_t offset, uint64_t size, uint64_t attrSize) {
+   if(attrSize <= sizeof(perf_file_section) || offset + size > length || size / attrSize == 0) {
+      fprintf(stderr, "perf.data has no events\n");
+      return false;
+   }
+   const uint64_t nr = size / attrSize;
+   const uint64_t eventAttrSize = attrSize - sizeof(perf_file_section);
+   events.resize(nr);
+   for(uint64_t i = 0; i < nr; i++) {
+      const char *p = data + offset + i * attrSize;
+      PerfEvent &event = events[i];
+      memset(&event.attr, 0, sizeof(event.attr));
+      memcpy(&event.attr, p, std::min<uint64_t>(eventAttrSize, sizeof(event.attr)));
+      perf_file_section ids;
+      memcpy(&ids, p + eventAttrSize, sizeof(ids));
+      if(ids.offset + ids.size <= length) {
+         for(uint64_t j = 0; j < ids.size / sizeof(uint64_t); j++)
+            event.ids.push_back(u64at(data + ids.offset + j * sizeof(uint64_t)));
+      }
+   }
+   indexEvents();
+   return true;
+}
+
+/* attr (attr.size bytes), u64 ids[] */
+bool PerfData::readPipeAttr(const char *p, uint64_t size) {
+   if(size < 8)
+      return false;
+   uint32_t attrSize = u32at(p + 4);
+   if(attrSize == 0)
+      attrSize = PERF_ATTR_SIZE_VER0;
+   if(attrSize > size)
+      return false;
+   events.emplace_back();
+   PerfEvent &event = events.back();
+   memset(&event.attr, 0, sizeof(event.attr));
+   memcpy(&event.attr, p, std::min<uint64_t>(attrSize, sizeof(event.attr)));
+   for(uint64_t offset = attrSize; offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t))
+      event.ids.push_back(u64at(p + offset));
+   const size_t i = events.size() - 1;
+   event.name = i < pipeNames.size() && !pipeNames[i].empty() ? pipeNames[i] : "unknown";
+   // Growing events moved them
+   indexEvents();
+   return true;
+}
+
+void PerfData::indexEvents() {
+   // perf record uses the same sample_type layout for the ids of all events
+   sampleType = events[0].attr.sample_type;
+   sampleIdAll = events[0].attr.sample_id_all;
+   eventsById.clear();
+   for(size_t i = 0; i < events.size(); i++) {
+      for(uint64_t id : events[i].ids)
+         eventsById[id] = &events[i];
+   }
+}
+
+/* u32 nr, u32 attr size, then per event: attr, u32 nr ids, string name, u64 ids[] */
+std::vector<std::string> PerfData::readEventDesc(const char *p, uint64_t size) const {
+   std::vector<std::string> names;
+   const char *end = p + size;
+   if(size < 8)
+      return names;
+   const uint32_t nr = u32at(p);
+   const uint32_t attrSize = u32at(p + 4);
+   p += 8;
+   for(uint32_t i = 0; i < nr; i++) {
+      if(p + attrSize + 8 > end)
+         break;
+      p += attrSize;
+      const uint32_t nrIds = u32at(p);
+      const uint32_t len = u32at(p + 4);
+      p += 8;
+      if(p + len > end)
+         break;
+      names.emplace_back(p, strnlen(p, len));
+      p += len + (uint64_t)nrIds * sizeof(uint64_t);
+   }
+   return names;
+}
+
+/* perf_event_header, s32 pid, u8 build_id[24], char filename[] */
+void PerfData::readBuildIds(const char *p, uint64_t size) {
+   const char *end = p + size;
+   while(p + sizeof(perf_event_header) + 28 <= end) {
+      perf_event_header header;
+      memcpy(&header, p, sizeof(header));
+      if(header.size < sizeof(perf_event_header) + 28 || p + header.size > end)
+         return;
+      const unsigned char *id = (const unsigned char *)p + sizeof(perf_event_header) + 4;
+      unsigned idSize = (header.misc & PERF_RECORD_MISC_BUILD_ID_SIZE) ? std::min<unsigned>(id[20], 20) : 20;
+      std::string hex;
+      char digits[3];
+      for(unsigned i = 0; i < idSize; i++) {
+         snprintf(digits, sizeof(digits), "%02x", id[i]);
+         hex += digits;
+      }
+      const char *filename = p + sizeof(perf_event_header) + 28;
+      buildIds[std::string(filename, strnlen(filename, p + header.size - filename))] = hex;
+      p += header.size;
+   }
+}
+
+/* The event id is the first u64 of a sample with PERF_SAMPLE_IDENTIFIER and the last one of other records */
+const PerfEvent *PerfData::eventOf(const char *record, uint32_t type, uint16_t size) const {
+   if(events.size() == 1)
+      return &events[0];
+   const char *body = record + sizeof(perf_event_header);
+   uint64_t id;
+   if(sampleType & PERF_SAMPLE_IDENTIFIER) {
+      if(size < sizeof(perf_event_header) + 8)
+         return nullptr;
+      id = type == PERF_RECORD_SAMPLE ? u64at(body) : u64at(record + size - 8);
+   } else if(sampleType & PERF_SAMPLE_ID) {
+      if(type != PERF_RECORD_SAMPLE)
+         return nullptr;
+      int pos = 0;
+      for(uint64_t bit : {PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_TIME, PERF_SAMPLE_ADDR})
+         pos += (sampleType & bit) ? 1 : 0;
+      if(size < sizeof(perf_event_header) + (pos + 1) * 8)
+         return nullptr;
+      id = u64at(body + pos * 8);
+   } else {
+      return &events[0];
+   }
+   auto it = eventsById.find(id);
+   return it == eventsById.end() ? nullptr : it->second;
+}
+
+/* Records without a time are not reordered */
+uint64_t PerfData::timeOf(const char *record, uint32_t type, uint16_t size) const {
+   if(!(sampleType & PERF_SAMPLE_TIME))
+      return 0;
+   if(type == PERF_RECORD_SAMPLE) {
+      int pos = 0;
+      for(uint64_t bit : {PERF_SAMPLE_IDENTIFIER, PERF_SAMPLE_IP, PERF_SAMPLE_TID})
+         pos += (sampleType & bit) ? 1 : 0;
+      if(size < sizeof(perf_event_header) + (pos + 1) * 8)
+         return 0;
+      return u64at(record + sizeof(perf_event_header) + pos * 8);
+   }
+   if(!sampleIdAll)
+      return 0;
+   // sample_id trailer: tid, time, id, stream_id, cpu, identifier
+   int pos = 1;
+   for(uint64_t bit : {PERF_SAMPLE_ID, PERF_SAMPLE_STREAM_ID, PERF_SAMPLE_CPU, PERF_SAMPLE_IDENTIFIER})
+      pos += (sampleType & bit) ? 1 : 0;
+   if(size < sizeof(perf_event_header) + pos * 8)
+      return 0;
+   return u64at(record + size - pos * 8);
+}
+
+bool PerfData::parseSample(const char *record, uint16_t size, PerfSample &sample) const {
+   memset(&sample, 0, sizeof(sample));
+   sample.event = eventOf(record, PERF_RECORD_SAMPLE, size);
+   if(!sample.event)
+      return false;
+   const perf_event_attr &attr = sample.event->attr;
+   const uint64_t type = attr.sample_type;
+   const char *p = record + sizeof(perf_event_header);
+   const char *end = record + size;
+   sample.cpumode = ((const perf_event_header *)record)->misc & PERF_RECORD_MISC_CPUMODE_MASK;
+
+#define NEED(n) if(p + (n) > end) return false
+   if(type & PERF_SAMPLE_IDENTIFIER) {
+      NEED(8);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_IP) {
+      NEED(8);
+      sample.ip = u64at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_TID) {
+      NEED(8);
+      sample.pid = u32at(p);
+      sample.tid = u32at(p + 4);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_TIME) {
+      NEED(8);
+      sample.time = u64at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_ADDR) {
+      NEED(8);
+      sample.addr = u64at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_ID)
+      p += 8;
+   if(type & PERF_SAMPLE_STREAM_ID)
+      p += 8;
+   if(type & PERF_SAMPLE_CPU) {
+      NEED(8);
+      sample.cpu = u32at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_PERIOD) {
+      NEED(8);
+      sample.period = u64at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_READ) {
+      const uint64_t format = attr.read_format;
+      uint64_t values = 1;
+      if(format & PERF_FORMAT_GROUP) {
+         NEED(8);
+         values = u64at(p);
+         p += 8;
+      }
+      if(!(format & PERF_FORMAT_GROUP))
+         p += 8;
+      if(format & PERF_FORMAT_TOTAL_TIME_ENABLED)
+         p += 8;
+      if(format & PERF_FORMAT_TOTAL_TIME_RUNNING)
+         p += 8;
+      const uint64_t perValue = ((format & PERF_FORMAT_GROUP) ? 1 : 0) + ((format & PERF_FORMAT_ID) ? 1 : 0) + ((format & FORMAT_LOST) ? 1 : 0);
+      if(format & PERF_FORMAT_GROUP)
+         p += values * perValue * 8;
+      else
+         p += perValue * 8;
+   }
+   if(type & PERF_SAMPLE_CALLCHAIN) {
+      NEED(8);
+      sample.nr_callchain = u64at(p);
+      p += 8;
+      NEED(sample.nr_callchain * 8);
+      sample.callchain = p;
+      p += sample.nr_callchain * 8;
+   }
+   if(type & PERF_SAMPLE_RAW) {
+      NEED(4);
+      // size includes the padding to the next u64
+      p += 4 + u32at(p);
+   }
+   if(type & PERF_SAMPLE_BRANCH_STACK) {
+      NEED(8);
+      const uint64_t nr = u64at(p);
+      p += 8;
+      if(attr.branch_sample_type & SAMPLE_BRANCH_HW_INDEX)
+         p += 8;
+      p += nr * 24;
+      if(attr.branch_sample_type & SAMPLE_BRANCH_COUNTERS)
+         p += nr * 8;
+   }
+   if(type & PERF_SAMPLE_REGS_USER) {
+      NEED(8);
+      const uint64_t abi = u64at(p);
+      p += 8;
+      if(abi)
+         p += __builtin_popcountll(attr.sample_regs_user) * 8;
+   }
+   if(type & PERF_SAMPLE_STACK_USER) {
+      NEED(8);
+      const uint64_t stackSize = u64at(p);
+      p += 8 + stackSize;
+      if(stackSize)
+         p += 8;
+   }
+   if(type & (PERF_SAMPLE_WEIGHT | SAMPLE_WEIGHT_STRUCT)) {
+      NEED(8);
+      sample.weight = u64at(p);
+      // var1_dw, the latency
+      if(!(type & PERF_SAMPLE_WEIGHT))
+         sample.weight &= 0xffffffffULL;
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_DATA_SRC) {
+      NEED(8);
+      sample.data_src = u64at(p);
+      p += 8;
+   }
+   if(type & PERF_SAMPLE_TRANSACTION) {
+      NEED(8);
+      sample.transaction = u64at(p);
+      p += 8;
+   }
+#undef NEED
+   return true;
+}
+
+/* Returns false if the record was not understood */
+bool PerfData::deliver(PerfHandler &handler, const char *record) const {
+   perf_event_header header;
+   memcpy(&header, record, sizeof(header));
+   const char *body = record + sizeof(header);
+   const char *end = record + header.size;
+   switch(header.type) {
+   case PERF_RECORD_MMAP:
+      // pid, tid, start, len, pgoff, filename
+      if(body + 32 < end)
+         handler.mmap((int32_t)u32at(body), u32at(body + 4), u64at(body + 8), u64at(body + 16), u64at(body + 24), body + 32);
+      break;
+   case PERF_RECORD_MMAP2:
+      // pid, tid, start, len, pgoff, maj, min, ino, ino_generation or build id, prot, flags, filename
+      if(body + 64 < end)
+         handler.mmap((int32_t)u32at(body), u32at(body + 4), u64at(body + 8), u64at(body + 16), u64at(body + 24), body + 64);
+      break;
+   case PERF_RECORD_COMM:
+      if(body + 8 < end)
+         handler.comm(u32at(body), u32at(body + 4), body + 8, header.misc & PERF_RECORD_MISC_COMM_EXEC);
+      break;
+   case PERF_RECORD_FORK:
+      // pid, ppid, tid, ptid, time
+      if(body + 16 <= end)
+         handler.fork(u32at(body), u32at(body + 4), u32at(body + 8), u32at(body + 12));
+      break;
+   case PERF_RECORD_SAMPLE: {
+      PerfSample sample;
+      if(!parseSample(record, header.size, sample))
+         return false;
+      handler.sample(sample);
+      break;
+   }
+   default:
+      break;
+   }
+   return true;
+}
+
+/* Delivers the queued records up to limit in time order, the later ones stay queued */
+uint64_t PerfData::flush(PerfHandler &handler, Queue &queue, uint64_t limit) const {
+   uint64_t unhandled = 0;
+   std::vector<Queued> &records = queue.records;
+   std::stable_sort(records.begin(), records.end(), [](const Queued &a, const Queued &b) { return a.time < b.time; });
+   auto later = std::upper_bound(records.begin(), records.end(), limit, [](uint64_t time, const Queued &q) { return time < q.time; });
+   for(auto it = records.begin(); it != later; ++it)
+      unhandled += deliver(handler, it->record) ? 0 : 1;
+   records.erase(records.begin(), later);
+   return unhandled;
+}
+
+/* The next round may still have records up to the largest time of this one */
+uint64_t PerfData::finishRound(PerfHandler &handler, Queue &queue) const {
+   const uint64_t unhandled = flush(handler, queue, queue.flushTime);
+   queue.flushTime = queue.maxTime;
+   return unhandled;
+}
+
+uint64_t PerfData::process(PerfHandler &handler, const PerfPart &part) const {
+   uint64_t unhandled = 0;
+   // The processes and maps at the start of the part
+   for(size_t i = 0; i < part.replay; i++)
+      unhandled += deliver(handler, replay[i]) ? 0 : 1;
+   // The records of the part are queued behind the ones carried over
+   Queue queue;
+   for(const char *record : part.carried) {
+      perf_event_header carried;
+      memcpy(&carried, record, sizeof(carried));
+      queue.records.push_back({timeOf(record, carried.type, carried.size), record});
+   }
+   queue.flushTime = part.flushTime;
+   queue.maxTime = part.maxTime;
+   const char *p = data + part.begin;
+   const char *stop = data + std::min(part.end, dataOffset + dataSize);
+   while(p + sizeof(perf_event_header) <= stop) {
+      perf_event_header header;
+      memcpy(&header, p, sizeof(header));
+      if(header.size < sizeof(header) || p + header.size > stop) {
+         fprintf(stderr, "Invalid record at offset %llu, skipping the rest of the file\n", (unsigned long long)(p - data));
+         unhandled++;
+         break;
+      }
+      if(header.type == PERF_RECORD_FINISHED_ROUND)
+         unhandled += finishRound(handler, queue);
+      else if(header.type < PERF_RECORD_USER_TYPE_START)
+         queue.push(timeOf(p, header.type, header.size), p);
+      p += header.size;
+   }
+   // The records still queued at the end of the other parts are carried over to the next one
+   if(part.last)
+      unhandled += flush(handler, queue, UINT64_MAX);
+   return unhandled;
+}
+
+std::vector<PerfPart> PerfData::split(unsigned parts) {
+   std::vector<PerfPart> result(1);
+   result[0].begin = dataOffset;
+   const uint64_t end = dataOffset + dataSize;
+   replay.clear();
+   // Follows the ordered queue of a sequential pass, only the mmap, comm and fork records are sorted
+   Queue queue;
+   std::vector<Queued> delivered;
+   uint64_t samples = 0;
+   const char *p = data + dataOffset;
+   while(parts > 1 && p + sizeof(perf_event_header) <= data + end && result.size() < parts) {
+      perf_event_header header;
+      memcpy(&header, p, sizeof(header));
+      if(header.size < sizeof(header) || p + header.size > data + end)
+         break;
+      if(header.type == PERF_RECORD_FINISHED_ROUND) {
+         std::vector<Queued> &records = queue.records;
+         auto later = std::stable_partition(records.begin(), records.end(), [&](const Queued &q) { return q.time <= queue.flushTime; });
+         delivered.clear();
+         for(auto it = records.begin(); it != later; ++it) {
+            perf_event_header record;
+            memcpy(&record, it->record, sizeof(record));
+            PerfSample sample;
+            // Samples that are not understood get no id
+            if(record.type == PERF_RECORD_SAMPLE)
+               samples += parseSample(it->record, record.size, sample) ? 1 : 0;
+            else if(record.type == PERF_RECORD_MMAP || record.type == PERF_RECORD_MMAP2 ||
+                    record.type == PERF_RECORD_COMM || record.type == PERF_RECORD_FORK)
+               delivered.push_back(*it);
+         }
+         std::stable_sort(delivered.begin(), delivered.end(), [](const Queued &a, const Queued &b) { return a.time < b.time; });
+         for(const Queued &q : delivered)
+            replay.push_back(q.record);
+         records.erase(records.begin(), later);
+         queue.flushTime = queue.maxTime;
+         const uint64_t offset = p + header.size - data;
+         if(offset >= dataOffset + dataSize * result.size() / parts && offset < end) {
+            result.back().end = offset;
+            result.back().last = false;
+            result.emplace_back();
+            PerfPart &part = result.back();
+            part.begin = offset;
+            part.samples = samples;
+            part.replay = replay.size();
+            part.flushTime = queue.flushTime;
+            part.maxTime = queue.maxTime;
+            for(const Queued &q : records)
+               part.carried.push_back(q.record);
+         }
+      } else if(header.type < PERF_RECORD_USER_TYPE_START) {
+         queue.push(timeOf(p, header.type, header.size), p);
+      }
+      p += header.size;
+   }
+   result.back().end = end;
+   return result;
+}
+
+uint64_t PerfData::processPipe(PerfHandler &handler) {
+   // Records of the current round, kept until its end, and the records carried over from the rounds before
+   std::vector<char> round, carried, kept;
+   std::vector<size_t> offsets;
+   Queue queue;
+   uint64_t unhandled = 0;
+   bool started = false;
+   auto flushRound = [&](bool last) {
+      for(size_t offset : offsets) {
+         perf_event_header queued;
+         memcpy(&queued, &round[offset], sizeof(queued));
+         queue.push(timeOf(&round[offset], queued.type, queued.size), &round[offset]);
+      }
+      unhandled += last ? flush(handler, queue, UINT64_MAX) : finishRound(handler, queue);
+      // The records still queued move out of the round, which is reused
+      size_t size = 0;
+      for(const Queued &q : queue.records)
+         size += recordSize(q.record);
+      kept.clear();
+      // No reallocation below the reserved size, the new addresses stay valid
+      kept.reserve(size);
+      for(Queued &q : queue.records) {
+         const char *record = q.record;
+         q.record = kept.data() + kept.size();
+         kept.insert(kept.end(), record, record + recordSize(record));
+      }
+      carried.swap(kept);
+      offsets.clear();
+      round.clear();
+   };
+   perf_event_header header;
+   while(fread(&header, sizeof(header), 1, pipe) == 1) {
+      if(header.size < sizeof(header)) {
+         fprintf(stderr, "Invalid record in the pipe, skipping the rest of it\n");
+         unhandled++;
+         break;
+      }
+      const size_t start = round.size();
+      const uint64_t size = header.size - sizeof(header);
+      round.resize(start + header.size);
+      memcpy(&round[start], &header, sizeof(header));
+      if(size && fread(&round[start + sizeof(header)], size, 1, pipe) != 1) {
+         fprintf(stderr, "The pipe ended inside a record, perf record did not finish\n");
+         unhandled++;
+         round.resize(start);
+         break;
+      }
+      const char *body = &round[start + sizeof(header)];
+      // Records with a payload behind them, the size of the payload is not part of header.size
+      uint64_t payload = 0;
+      if(header.type == PERF_RECORD_HEADER_TRACING_DATA && size >= 4)
+         payload = (u32at(body) + 7) & ~7ULL;
+      else if(header.type == PERF_RECORD_AUXTRACE && size >= 8)
+         payload = u64at(body);
+
+      if(header.type == PERF_RECORD_HEADER_ATTR) {
+         // Events are referenced by address once samples were delivered
+         if(started || !readPipeAttr(body, size))
+            unhandled++;
+      } else if(header.type == PERF_RECORD_HEADER_FEATURE && size >= 8) {
+         if(u64at(body) == HEADER_EVENT_DESC) {
+            pipeNames = readEventDesc(body + 8, size - 8);
+            for(size_t i = 0; i < pipeNames.size() && i < events.size(); i++)
+               events[i].name = pipeNames[i].empty() ? "unknown" : pipeNames[i];
+         }
+      } else if(header.type == PERF_RECORD_HEADER_BUILD_ID) {
+         readBuildIds(&round[start], header.size);
+      } else if(header.type == PERF_RECORD_FINISHED_ROUND) {
+         round.resize(start);
+         flushRound(false);
+         continue;
+      } else if(header.type < PERF_RECORD_USER_TYPE_START) {
+         if(events.empty()) {
+            unhandled++;
+         } else {
+            started = true;
+            offsets.push_back(start);
+            continue;
+         }
+      }
+      // Only the records of the round are kept
+      round.resize(start);
+      for(char skip[4096]; payload; payload -= std::min<uint64_t>(payload, sizeof(skip))) {
+         if(fread(skip, std::min<uint64_t>(payload, sizeof(skip)), 1, pipe) != 1)
+            break;
+      }
+   }
+   flushRound(true);
+   return unhandled;
+}
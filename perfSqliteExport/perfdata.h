@@ -0,0 +1,151 @@
+#ifndef PERFDATA_H
+#define PERFDATA_H
+
+/*
+ * Reader for the perf.data files written by perf record.
+ *
+ * The file is mapped, the records of the data section are handed to a
+ * PerfHandler in timestamp order. perf record writes a
+ * PERF_RECORD_FINISHED_ROUND after every pass over the per cpu buffers.
+ * Like perf's ordered events, the end of a round delivers the queued records
+ * up to the largest time of the rounds before it, later records may still be
+ * preceded by records of the next round and are carried over.
+ *
+ * process() is const, several threads can process parts of the same file.
+ *
+ * perf record -o - writes a pipe header instead, followed by records that
+ * replace the header sections: the events and their ids (HEADER_ATTR), the
+ * features (HEADER_FEATURE) and the build ids (HEADER_BUILD_ID). Such a
+ * stream is read with openPipe() and processPipe() while perf still records,
+ * only the current round and the records carried over are kept in memory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/perf_event.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+struct PerfEvent {
+   struct perf_event_attr attr;
+   std::string name;
+   std::vector<uint64_t> ids;
+};
+
+struct PerfSample {
+   const PerfEvent *event;
+   uint16_t cpumode;
+   uint64_t ip;
+   uint32_t pid, tid;
+   uint64_t time;
+   uint64_t addr;
+   uint32_t cpu;
+   uint64_t period;
+   uint64_t weight;
+   uint64_t data_src;
+   uint64_t transaction;
+   uint64_t nr_callchain;
+   // Not aligned, read with memcpy
+   const char *callchain;
+};
+
+/*
+ * A part of the data section that ends at a round boundary. At its start the
+ * ordered queue still holds the carried records of the rounds in front of it,
+ * they are delivered with the part.
+ */
+struct PerfPart {
+   uint64_t begin, end;
+   /* Samples delivered in front of the part */
+   uint64_t samples = 0;
+   /* Number of mmap, comm and fork records delivered in front of the part */
+   size_t replay = 0;
+   /* State of the ordered queue at begin, carried is in file order */
+   uint64_t flushTime = 0, maxTime = 0;
+   std::vector<const char *> carried;
+   /* Only the last part delivers all queued records at its end */
+   bool last = true;
+};
+
+class PerfHandler {
+public:
+   virtual ~PerfHandler() {}
+   /* pid is -1 for kernel and module maps */
+   virtual void mmap(int32_t pid, uint32_t tid, uint64_t start, uint64_t len, uint64_t pgoff, const char *filename) = 0;
+   virtual void comm(uint32_t pid, uint32_t tid, const char *comm, bool exec) = 0;
+   virtual void fork(uint32_t pid, uint32_t ppid, uint32_t tid, uint32_t ptid) = 0;
+   virtual void sample(const PerfSample &sample) = 0;
+};
+
+class PerfData {
+public:
+   ~PerfData();
+   /* Prints an error and returns false if path is not a perf.data file */
+   bool open(const char *path);
+   /* Same for a stream written with perf record -o - */
+   bool openPipe(FILE *in);
+   /*
+    * Hands the records of the part to handler in the order a sequential pass
+    * delivers them, returns the number of records that were not understood.
+    * The mmap, comm and fork records in front of the part are handed over
+    * first, so that handler knows the processes at its start.
+    */
+   uint64_t process(PerfHandler &handler, const PerfPart &part) const;
+   /*
+    * At most parts parts of about the same size, in file order, the first
+    * starts and the last ends the data. Reads the file once and keeps the
+    * mmap, comm and fork records in the order they are delivered.
+    */
+   std::vector<PerfPart> split(unsigned parts);
+   /* Reads the stream up to its end, returns the number of records that were not understood */
+   uint64_t processPipe(PerfHandler &handler);
+
+   std::vector<PerfEvent> events;
+   /* hex build ids of the files in the HEADER_BUILD_ID feature, by file name */
+   std::unordered_map<std::string, std::string> buildIds;
+
+private:
+   struct Queued {
+      uint64_t time;
+      const char *record;
+   };
+
+   struct Queue {
+      std::vector<Queued> records;
+      /* Records up to flushTime are delivered at the end of the round */
+      uint64_t flushTime = 0, maxTime = 0;
+      void push(uint64_t time, const char *record) {
+         records.push_back({time, record});
+         maxTime = std::max(maxTime, time);
+      }
+   };
+
+   bool readAttrs(uint64_t offset, uint64_t size, uint64_t attrSize);
+   bool readPipeAttr(const char *p, uint64_t size);
+   void indexEvents();
+   std::vector<std::string> readEventDesc(const char *p, uint64_t size) const;
+   void readBuildIds(const char *p, uint64_t size);
+   const PerfEvent *eventOf(const char *record, uint32_t type, uint16_t size) const;
+   uint64_t timeOf(const char *record, uint32_t type, uint16_t size) const;
+   bool parseSample(const char *record, uint16_t size, PerfSample &sample) const;
+   bool deliver(PerfHandler &handler, const char *record) const;
+   uint64_t flush(PerfHandler &handler, Queue &queue, uint64_t limit) const;
+   uint64_t finishRound(PerfHandler &handler, Queue &queue) const;
+
+   const char *data = nullptr;
+   size_t length = 0;
+   uint64_t dataOffset = 0, dataSize = 0;
+   uint64_t sampleType = 0;
+   bool sampleIdAll = false;
+   FILE *pipe = nullptr;
+   /* Event names of the pipe, the feature can come before the events */
+   std::vector<std::string> pipeNames;
+   std::unordered_map<uint64_t, const PerfEvent *> eventsById;
+   /* The mmap, comm and fork records of the file in delivery order, written by split() */
+   std::vector<const char *> replay;
+};
+
+#endif
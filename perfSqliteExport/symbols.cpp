@@ -0,0 +1,260 @@
+#include "symbols.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+static bool startsWith(const std::string &s, const char *prefix) {
+   return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+Dso::Dso(const std::string &longName, bool kernel, SymbolCache &cache) : longName(longName), kernel(kernel), cache(cache) {
+   anonymous = !kernel && (startsWith(longName, "//anon") || startsWith(longName, "/dev/zero") ||
+                           startsWith(longName, "/anon_hugepage") || startsWith(longName, "[heap]") ||
+                           startsWith(longName, "[stack"));
+   size_t slash = longName.rfind('/');
+   if(longName[0] == '[' || startsWith(longName, "//") || slash == std::string::npos)
+      shortName = longName;
+   else
+      shortName = longName.substr(slash + 1);
+}
+
+static std::string demangle(const char *name) {
+   if(name[0] != '_' || name[1] != 'Z')
+      return name;
+   int status = 0;
+   char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+   if(demangled == nullptr)
+      return name;
+   std::string result(demangled);
+   free(demangled);
+   return result;
+}
+
+/* The alias perf would keep: sized, not weak, global, fewer leading underscores, longer name */
+static bool better(const Symbol &a, const Symbol &b) {
+   if((a.end > a.start) != (b.end > b.start))
+      return a.end > a.start;
+   if((a.binding == 2) != (b.binding == 2))
+      return b.binding == 2;
+   if((a.binding == 1) != (b.binding == 1))
+      return a.binding == 1;
+   size_t ua = strspn(a.name.c_str(), "_"), ub = strspn(b.name.c_str(), "_");
+   if(ua != ub)
+      return ua < ub;
+   return a.name.size() > b.name.size();
+}
+
+/* Sorts, removes aliases and extends symbols without size up to the next one */
+static void fixup(std::vector<Symbol> &symbols) {
+   std::stable_sort(symbols.begin(), symbols.end(), [](const Symbol &a, const Symbol &b) { return a.start < b.start; });
+   size_t out = 0;
+   for(size_t i = 0; i < symbols.size(); i++) {
+      if(out > 0 && symbols[out - 1].start == symbols[i].start) {
+         if(better(symbols[i], symbols[out - 1]))
+            symbols[out - 1] = std::move(symbols[i]);
+         continue;
+      }
+      if(out != i)
+         symbols[out] = std::move(symbols[i]);
+      out++;
+   }
+   symbols.resize(out);
+   for(size_t i = 0; i < symbols.size(); i++) {
+      if(symbols[i].end != symbols[i].start)
+         continue;
+      uint64_t end = i + 1 < symbols.size() ? symbols[i + 1].start : (symbols[i].start + 4096) & ~4095ULL;
+      symbols[i].end = end;
+   }
+}
+
+struct MappedFile {
+   const uint8_t *data = nullptr;
+   size_t size = 0;
+   ~MappedFile() {
+      if(data)
+         munmap((void *)data, size);
+   }
+   bool open(const std::string &path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if(fd < 0)
+         return false;
+      struct stat st;
+      if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Elf64_Ehdr)) {
+         void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if(addr != MAP_FAILED) {
+            data = (const uint8_t *)addr;
+            size = st.st_size;
+         }
+      }
+      close(fd);
+      return data != nullptr;
+   }
+};
+
+/* Function symbols of an ELF file, symtab only if dynsym is false */
+static bool readElf(const std::string &path, bool dynsym, std::vector<Symbol> &symbols) {
+   MappedFile f;
+   if(!f.open(path))
+      return false;
+   Elf64_Ehdr header;
+   memcpy(&header, f.data, sizeof(header));
+   if(memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+      header.e_shentsize != sizeof(Elf64_Shdr) || header.e_shoff + header.e_shnum * sizeof(Elf64_Shdr) > f.size ||
+      header.e_phentsize != sizeof(Elf64_Phdr) || header.e_phoff + header.e_phnum * sizeof(Elf64_Phdr) > f.size)
+      return false;
+   const auto *sections = (const Elf64_Shdr *)(f.data + header.e_shoff);
+   const auto *segments = (const Elf64_Phdr *)(f.data + header.e_phoff);
+   const Elf64_Shdr *symtab = nullptr;
+   for(int i = 0; i < header.e_shnum; i++) {
+      if(sections[i].sh_type == SHT_SYMTAB || (dynsym && sections[i].sh_type == SHT_DYNSYM && symtab == nullptr))
+         symtab = &sections[i];
+   }
+   if(symtab == nullptr || symtab->sh_link >= header.e_shnum || symtab->sh_entsize != sizeof(Elf64_Sym) ||
+      symtab->sh_offset + symtab->sh_size > f.size)
+      return false;
+   const Elf64_Shdr &strtab = sections[symtab->sh_link];
+   if(strtab.sh_offset + strtab.sh_size > f.size)
+      return false;
+   const char *names = (const char *)(f.data + strtab.sh_offset);
+   const auto *syms = (const Elf64_Sym *)(f.data + symtab->sh_offset);
+   const size_t numSyms = symtab->sh_size / sizeof(Elf64_Sym);
+   for(size_t i = 0; i < numSyms; i++) {
+      const Elf64_Sym &sym = syms[i];
+      const int type = ELF64_ST_TYPE(sym.st_info);
+      if((type != STT_FUNC && type != STT_GNU_IFUNC) || sym.st_value == 0 ||
+         sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE || sym.st_name >= strtab.sh_size)
+         continue;
+      // Debug files have the program headers of the binary, the file offset is the same
+      const Elf64_Phdr *load = nullptr;
+      for(int j = 0; j < header.e_phnum; j++) {
+         if(segments[j].p_type == PT_LOAD && sym.st_value >= segments[j].p_vaddr &&
+            sym.st_value < segments[j].p_vaddr + segments[j].p_memsz)
+            load = &segments[j];
+      }
+      if(load == nullptr)
+         continue;
+      Symbol s;
+      s.start = sym.st_value - load->p_vaddr + load->p_offset;
+      s.end = s.start + sym.st_size;
+      s.address = header.e_type == ET_EXEC ? s.start : sym.st_value;
+      const int bind = ELF64_ST_BIND(sym.st_info);
+      s.binding = bind == STB_LOCAL ? 0 : bind == STB_GLOBAL ? 1 : 2;
+      s.name = demangle(names + sym.st_name);
+      symbols.push_back(std::move(s));
+   }
+   return true;
+}
+
+void Dso::loadElf(std::vector<Symbol> &symbols) const {
+   std::string path = longName;
+   const char *deleted = " (deleted)";
+   if(path.size() > strlen(deleted) && path.compare(path.size() - strlen(deleted), std::string::npos, deleted) == 0)
+      path.resize(path.size() - strlen(deleted));
+   std::vector<std::string> candidates;
+   if(buildId.size() > 2) {
+      // perf record copies the binaries to its build id cache, they match the recording
+      const char *home = getenv("HOME");
+      if(home)
+         candidates.push_back(std::string(home) + "/.debug/.build-id/" + buildId.substr(0, 2) + "/" + buildId.substr(2) + "/elf");
+      candidates.push_back("/usr/lib/debug/.build-id/" + buildId.substr(0, 2) + "/" + buildId.substr(2) + ".debug");
+   }
+   candidates.push_back(path);
+   candidates.push_back("/usr/lib/debug" + path + ".debug");
+   for(const std::string &candidate : candidates) {
+      if(readElf(candidate, false, symbols))
+         return;
+   }
+   // Stripped, only the exported functions
+   for(const std::string &candidate : candidates) {
+      if(readElf(candidate, true, symbols))
+         return;
+   }
+}
+
+/* Kernel symbols of the kernel this runs on, modules are tagged with [name] */
+void Dso::loadKallsyms(std::vector<Symbol> &symbols) const {
+   FILE *f = fopen("/proc/kallsyms", "r");
+   if(f == nullptr)
+      return;
+   const bool module = shortName != "[kernel.kallsyms]";
+   char line[1024];
+   while(fgets(line, sizeof(line), f)) {
+      unsigned long long address;
+      char type;
+      char name[512];
+      char tag[256] = "";
+      if(sscanf(line, "%llx %c %511s %255s", &address, &type, name, tag) < 3 || address == 0)
+         continue;
+      if(type != 't' && type != 'T' && type != 'W')
+         continue;
+      if(module ? shortName != tag : tag[0] != '\0')
+         continue;
+      Symbol s;
+      s.start = s.end = s.address = address;
+      s.binding = type == 't' ? 0 : type == 'W' ? 2 : 1;
+      s.name = name;
+      symbols.push_back(std::move(s));
+   }
+   fclose(f);
+}
+
+std::vector<Symbol> Dso::load() const {
+   std::vector<Symbol> symbols;
+   if(kernel)
+      loadKallsyms(symbols);
+   else if(!anonymous && longName[0] != '[')
+      loadElf(symbols);
+   fixup(symbols);
+   return symbols;
+}
+
+std::shared_ptr<const std::vector<Symbol>> SymbolCache::symbols(const Dso &dso) {
+   Entry *entry;
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      std::unique_ptr<Entry> &e = entries[std::make_pair(dso.longName, dso.kernel)];
+      if(!e)
+         e.reset(new Entry());
+      entry = e.get();
+   }
+   // Without the lock, other files can be loaded meanwhile
+   std::call_once(entry->loaded, [&]() { entry->symbols = std::make_shared<const std::vector<Symbol>>(dso.load()); });
+   return entry->symbols;
+}
+
+const Symbol *Dso::find(uint64_t offset) {
+   if(!symbols) {
+      symbols = cache.symbols(*this);
+      symbolIds.resize(symbols->size(), 0);
+   }
+   auto it = std::upper_bound(symbols->begin(), symbols->end(), offset, [](uint64_t o, const Symbol &s) { return o < s.start; });
+   if(it != symbols->begin() && offset < (it - 1)->end)
+      return &*(it - 1);
+   auto unknownIt = unknowns.find(offset);
+   return unknownIt == unknowns.end() ? nullptr : &unknownIt->second;
+}
+
+const Symbol *Dso::unknown(uint64_t offset) {
+   auto it = unknowns.find(offset);
+   if(it == unknowns.end()) {
+      Symbol s;
+      s.start = s.end = s.address = offset;
+      s.binding = 0;
+      s.name = "unknown";
+      it = unknowns.emplace(offset, std::move(s)).first;
+   }
+   return &it->second;
+}
+
+uint64_t &Dso::symbolId(const Symbol *symbol) {
+   if(symbols && !symbols->empty() && symbol >= &symbols->front() && symbol <= &symbols->back())
+      return symbolIds[symbol - &symbols->front()];
+   return unknownIds[symbol->start];
+}
@@ -0,0 +1,79 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+/*
+ * Function symbols of the files mapped by the recorded processes.
+ *
+ * Symbols are looked up by file offset, the address perf uses for samples
+ * in a file mapping (ip - map start + pgoff). sym_start and sym_end are
+ * exported the same way perf does: file offsets for executables, symbol
+ * values for shared objects and absolute addresses for the kernel.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+
+struct Symbol {
+   uint64_t start, end;
+   uint64_t address;
+   // 0 local, 1 global, 2 weak
+   int binding;
+   std::string name;
+};
+
+class Dso;
+
+/*
+ * The symbols of every file are read once and shared by the Dso objects of
+ * that file, also by the ones of other threads.
+ */
+class SymbolCache {
+public:
+   std::shared_ptr<const std::vector<Symbol>> symbols(const Dso &dso);
+
+private:
+   struct Entry {
+      std::once_flag loaded;
+      std::shared_ptr<const std::vector<Symbol>> symbols;
+   };
+
+   std::mutex lock;
+   std::map<std::pair<std::string, bool>, std::unique_ptr<Entry>> entries;
+};
+
+/* A file as a thread of the export sees it, with the ids it exported */
+class Dso {
+public:
+   Dso(const std::string &longName, bool kernel, SymbolCache &cache);
+
+   /* Symbol at the file offset or address, nullptr if there is none */
+   const Symbol *find(uint64_t offset);
+   /* Same as perf, an ip without symbol gets an "unknown" symbol of its own */
+   const Symbol *unknown(uint64_t offset);
+   /* Database id of a symbol of this dso, 0 until it is exported */
+   uint64_t &symbolId(const Symbol *symbol);
+
+   std::string longName, shortName, buildId;
+   bool kernel;
+   // anonymous memory, JIT code and the like, map_ip is the identity
+   bool anonymous;
+   uint64_t db_id = 0;
+
+private:
+   friend class SymbolCache;
+   std::vector<Symbol> load() const;
+   void loadElf(std::vector<Symbol> &symbols) const;
+   void loadKallsyms(std::vector<Symbol> &symbols) const;
+
+   SymbolCache &cache;
+   std::shared_ptr<const std::vector<Symbol>> symbols;
+   std::vector<uint64_t> symbolIds;
+   std::map<uint64_t, Symbol> unknowns;
+   std::map<uint64_t, uint64_t> unknownIds;
+};
+
+#endif
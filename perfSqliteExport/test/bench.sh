@@ -0,0 +1,36 @@
+#!/bin/bash
+# Export throughput of perfSqliteExport with one and with all cores, and of
+# exportToSqlite.py through perf script if perf has scripting support
+# usage: bench.sh <perfSqliteExport> <perf.data>
+set -e
+exporter=$(realpath "$1")
+data=$(realpath "$2")
+here=$(dirname "$(realpath "$0")")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+perf=${PERF:-$here/../../perf}
+if [ ! -x "$perf" ]; then
+   perf=$(command -v perf || true)
+fi
+
+# usage: run <name> <database> <command...>
+run() {
+   local name=$1 db=$2
+   shift 2
+   local start=$(date +%s%N)
+   "$@" > "$dir/log" 2>&1 || { cat "$dir/log"; echo "$name failed"; exit 1; }
+   local ms=$((($(date +%s%N) - start) / 1000000))
+   local samples=$(($(sqlite3 "$db" "SELECT count(*) FROM samples") - 1))
+   printf "%-28s %9d samples %5d.%03d s %10d samples/s\n" "$name" $samples $((ms / 1000)) $((ms % 1000)) $((samples * 1000 / (ms ? ms : 1)))
+}
+
+run "perfSqliteExport -j1" "$dir/j1.db" "$exporter" -i "$data" -c -j1 "$dir/j1.db"
+if [ "$(nproc)" -gt 1 ]; then
+   run "perfSqliteExport -j$(nproc)" "$dir/jn.db" "$exporter" -i "$data" -c -j"$(nproc)" "$dir/jn.db"
+fi
+if [ -n "$perf" ] && "$perf" script -h 2>&1 | grep -q -- "--script"; then
+   run "exportToSqlite.py" "$dir/python.db" sh -c "cd '$dir' && '$perf' script -i '$data' -s '$here/../exportToSqlite.py' '$dir/python.db' -c"
+else
+   echo "exportToSqlite.py: no perf with scripting support, skipped"
+fi
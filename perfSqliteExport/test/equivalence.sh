@@ -0,0 +1,58 @@
+#!/bin/bash
+# Exports a perf.data file with perfSqliteExport and with exportToSqlite.py through
+# perf script and compares the tables row by row
+# usage: equivalence.sh <perfSqliteExport> <perf.data>
+# perf is $PERF, the perf built by the top level Makefile or the one in the PATH. It
+# needs python 2 scripting support for exportToSqlite.py. Without it, the rows of
+# perfSqliteExport are replayed through exportToSqlite.py with $PYTHON2 (python2),
+# which compares the tables and the data_src decoding but not the ids and symbols
+# perf assigns. Without python 2 either, the test is skipped.
+set -e
+exporter=$(realpath "$1")
+data=$(realpath "$2")
+here=$(dirname "$(realpath "$0")")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$exporter" -i "$data" -c -j1 "$dir/native.db" > "$dir/native.log"
+
+perf=${PERF:-$here/../../perf}
+if [ ! -x "$perf" ]; then
+   perf=$(command -v perf || true)
+fi
+python2=${PYTHON2:-python2}
+if [ -n "$perf" ] && "$perf" script -h 2>&1 | grep -q -- "--script"; then
+   source="perf script"
+   if ! (cd "$dir" && "$perf" script -i "$data" -s "$here/../exportToSqlite.py" "$dir/python.db" -c) > "$dir/python.log" 2>&1; then
+      cat "$dir/python.log"
+      echo "equivalence: perf script -s exportToSqlite.py failed"
+      exit 1
+   fi
+elif "$python2" -c "import sqlite3, ctypes" > /dev/null 2>&1; then
+   source="the rows of perfSqliteExport replayed without perf"
+   if ! "$python2" "$here/replayPython.py" "$here/../exportToSqlite.py" "$dir/native.db" "$dir/python.db" > "$dir/python.log" 2>&1; then
+      cat "$dir/python.log"
+      echo "equivalence: replaying the rows through exportToSqlite.py failed"
+      exit 1
+   fi
+else
+   echo "equivalence: no perf with scripting support and no python 2, skipped"
+   exit 0
+fi
+
+# exportToSqlite.py loses every 5001st sample, the test recording has fewer
+failed=0
+for table in selected_events machines threads comms comm_threads dsos symbols call_paths samples \
+   memory_opcodes memory_hit_miss memory_levels memory_snoop memory_lock memory_dtlb_hit_miss memory_dtlb; do
+   sqlite3 "$dir/native.db" "SELECT * FROM $table ORDER BY id" > "$dir/native.$table"
+   sqlite3 "$dir/python.db" "SELECT * FROM $table ORDER BY id" > "$dir/python.$table"
+   if ! diff -q "$dir/python.$table" "$dir/native.$table" > /dev/null; then
+      echo "$table differs (< exportToSqlite.py, > perfSqliteExport):"
+      diff "$dir/python.$table" "$dir/native.$table" | head -20
+      failed=1
+   fi
+done
+if [ $failed -ne 0 ]; then
+   exit 1
+fi
+echo "equivalence: $(($(wc -l < "$dir/native.samples") - 1)) samples, all tables equal, exportToSqlite.py through $source"
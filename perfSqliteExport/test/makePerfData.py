@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+# Writes a perf.data file like perf record -e mem-loads,mem-stores -d -W -g
+# records it, for the equivalence test and the benchmark of the exporters.
+#
+# usage: makePerfData.py <output> [samples]
+#
+# The samples of four cpus are read round by round, like perf record reads the
+# per cpu buffers, so rounds overlap in time and records are carried over from
+# one round to the next. Two processes with two threads each map a binary
+# without symbols and anonymous memory, all samples are user space samples.
+# Loads use the old mem_lvl encoding and the mem_lvl_num, mem_remote and
+# mem_snoopx fields of newer cpus.
+
+import random
+import struct
+import sys
+
+SAMPLE_IP = 1 << 0
+SAMPLE_TID = 1 << 1
+SAMPLE_TIME = 1 << 2
+SAMPLE_ADDR = 1 << 3
+SAMPLE_CALLCHAIN = 1 << 5
+SAMPLE_CPU = 1 << 7
+SAMPLE_PERIOD = 1 << 8
+SAMPLE_WEIGHT = 1 << 14
+SAMPLE_DATA_SRC = 1 << 15
+SAMPLE_IDENTIFIER = 1 << 16
+SAMPLE_TYPE = (SAMPLE_IDENTIFIER | SAMPLE_IP | SAMPLE_TID | SAMPLE_TIME | SAMPLE_ADDR | SAMPLE_CPU |
+               SAMPLE_PERIOD | SAMPLE_CALLCHAIN | SAMPLE_WEIGHT | SAMPLE_DATA_SRC)
+
+RECORD_COMM = 3
+RECORD_FORK = 7
+RECORD_SAMPLE = 9
+RECORD_MMAP2 = 10
+RECORD_FINISHED_ROUND = 68
+MISC_USER = 2
+MISC_COMM_EXEC = 1 << 13
+MISC_BUILD_ID_SIZE = 1 << 15
+CONTEXT_USER = (1 << 64) - 512
+
+HEADER_BUILD_ID = 2
+HEADER_EVENT_DESC = 12
+ATTR_SIZE = 128
+CPUS = 4
+
+EVENTS = [("cpu/mem-loads,ldlat=30/P", 4, 0x1cd, [101, 102, 103, 104]),
+          ("cpu/mem-stores/P", 4, 0x82d0, [201, 202, 203, 204])]
+
+BINARY = "/nonexistent/membench"
+BUILD_ID = bytes(range(1, 21))
+
+# op, hit/miss and lvl, snoop, lock, dtlb, lvl_num | remote << 4, snoopx
+def data_src(op, lvl, snoop, dtlb, lvl_num=0, snoopx=0):
+    return op | (lvl << 5) | (snoop << 19) | (0x01 << 24) | (dtlb << 26) | (lvl_num << 33) | (snoopx << 38)
+
+LOAD_SOURCES = [
+    data_src(0x02, 0x0a, 0x02, 0x0a),                  # L1 hit, dtlb L1 hit
+    data_src(0x02, 0x42, 0x04, 0x12),                  # L3 hit, snoop hit, dtlb L2 hit
+    data_src(0x02, 0x84, 0x08, 0x44),                  # local DRAM miss, dtlb walk
+    data_src(0x02, 0x0c, 0x01, 0x0a),                  # L1 miss
+    data_src(0x02, 0x02, 0x01, 0x0a, 0x04),            # L4 hit
+    data_src(0x02, 0x02, 0x01, 0x0a, 0x08),            # uncached
+    data_src(0x02, 0x02, 0x04, 0x12, 0x03, 0x02),      # L3 hit, snoop peer
+    data_src(0x02, 0x02, 0x04, 0x12, 0x1b, 0x01),      # remote any cache hit, snoop forward
+    data_src(0x02, 0x04, 0x01, 0x44, 0x1e),            # remote PMEM
+]
+STORE_SOURCES = [
+    data_src(0x04, 0x0a, 0x02, 0x0a),                  # L1 hit
+    data_src(0x04, 0x01, 0x01, 0x01),                  # not available
+]
+
+
+def padded(s):
+    b = s.encode() + b"\0"
+    return b + b"\0" * (-len(b) % 8)
+
+
+def record(rtype, misc, body):
+    return struct.pack("<IHH", rtype, misc, 8 + len(body)) + body
+
+
+def sample_id(pid, tid, time, cpu, event_id):
+    return struct.pack("<IIQIIQ", pid, tid, time, cpu, 0, event_id)
+
+
+def comm(pid, tid, name, time, exec_):
+    return record(RECORD_COMM, MISC_COMM_EXEC if exec_ else 0,
+                  struct.pack("<II", pid, tid) + padded(name) + sample_id(pid, tid, time, 0, EVENTS[0][3][0]))
+
+
+def fork(pid, ppid, tid, ptid, time):
+    return record(RECORD_FORK, 0, struct.pack("<IIIIQ", pid, ppid, tid, ptid, time) +
+                  sample_id(pid, tid, time, 0, EVENTS[0][3][0]))
+
+
+def mmap2(pid, tid, start, length, pgoff, name, time):
+    return record(RECORD_MMAP2, MISC_USER, struct.pack("<IIQQQIIQQII", pid, tid, start, length, pgoff, 8, 1, 1234, 0, 5, 2) +
+                  padded(name) + sample_id(pid, tid, time, 0, EVENTS[0][3][0]))
+
+
+def sample(event, pid, tid, time, cpu, ip, addr, callers, weight, data_src):
+    name, _, _, ids = EVENTS[event]
+    chain = [CONTEXT_USER, ip] + callers
+    body = struct.pack("<QQIIQQIIQ", ids[cpu], ip, pid, tid, time, addr, cpu, 0, 2000)
+    body += struct.pack("<Q", len(chain)) + struct.pack("<%dQ" % len(chain), *chain)
+    body += struct.pack("<QQ", weight, data_src)
+    return record(RECORD_SAMPLE, MISC_USER, body)
+
+
+def attr(event):
+    _, type_, config, _ = EVENTS[event]
+    # disabled, inherit, mmap, comm, freq, task, precise_ip 2, sample_id_all, mmap2, comm_exec
+    flags = (1 << 0) | (1 << 1) | (1 << 8) | (1 << 9) | (1 << 13) | (2 << 15) | (1 << 18) | (1 << 23) | (1 << 24)
+    a = struct.pack("<IIQQQQQ", type_, ATTR_SIZE, config, 2000, SAMPLE_TYPE, 0, flags)
+    return a + b"\0" * (ATTR_SIZE - len(a))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("usage: makePerfData.py <output> [samples]")
+    samples = int(sys.argv[2]) if len(sys.argv) > 2 else 4000
+    random.seed(1)
+
+    # pid, tid of the processes and threads, the second process is forked by the first
+    threads = [(1000, 1000), (1000, 1001), (1002, 1002), (1002, 1003)]
+    data = bytearray()
+    data += comm(1000, 1000, "membench", 1000, True)
+    data += mmap2(1000, 1000, 0x400000, 0x20000, 0, BINARY, 1100)
+    data += mmap2(1000, 1000, 0x7f0000000000, 0x100000, 0, "//anon", 1200)
+    data += fork(1000, 1000, 1001, 1000, 1300)
+    data += comm(1000, 1001, "worker", 1400, False)
+    data += fork(1002, 1000, 1002, 1000, 1500)
+    data += comm(1002, 1002, "membench-child", 1600, True)
+    data += fork(1002, 1002, 1003, 1002, 1700)
+    data += record(RECORD_FINISHED_ROUND, 0, b"")
+
+    # Functions of the binary, the callers of a sample come from a few call sites
+    functions = [0x401000 + 0x100 * i for i in range(64)]
+    sites = [[functions[(i * 7 + j) % 64] + 0x20 for j in range(random.randint(1, 4))] for i in range(32)]
+
+    per_round = CPUS * 25
+    rounds = (samples + per_round - 1) // per_round
+    now = 10000
+    last = [now] * CPUS
+    written = 0
+    for r in range(rounds):
+        # perf reads one cpu after the other, a later cpu has samples the next round can still precede
+        for cpu in range(CPUS):
+            read = now + (r + 1) * 100000 + cpu * 20000
+            count = min(per_round // CPUS, samples - written)
+            times = sorted(random.randint(last[cpu] + 1, read) for _ in range(count))
+            for time in times:
+                pid, tid = threads[random.randrange(len(threads))]
+                event = 0 if random.random() < 0.75 else 1
+                ip = random.choice(functions) + random.randrange(0x100)
+                if random.random() < 0.05:
+                    ip = 0x7f0000001000 + random.randrange(0x1000)
+                addr = 0x7f0000000000 + random.randrange(0x100000) if random.random() < 0.5 else 0x600000 + random.randrange(0x10000)
+                source = random.choice(STORE_SOURCES) if event == 1 else random.choice(LOAD_SOURCES)
+                data += sample(event, pid, tid, time, cpu, ip, addr, random.choice(sites), random.randint(30, 400), source)
+            written += count
+            last[cpu] = read
+        data += record(RECORD_FINISHED_ROUND, 0, b"")
+
+    # header, attrs with their ids, data, feature sections
+    header_size = 104
+    attrs_offset = header_size
+    ids_offset = attrs_offset + len(EVENTS) * (ATTR_SIZE + 16)
+    ids = bytearray()
+    attrs = bytearray()
+    for i, event in enumerate(EVENTS):
+        attrs += attr(i) + struct.pack("<QQ", ids_offset + len(ids), 8 * len(event[3]))
+        ids += struct.pack("<%dQ" % len(event[3]), *event[3])
+    data_offset = ids_offset + len(ids)
+    data_offset += -data_offset % 8
+
+    build_ids = record(0, MISC_BUILD_ID_SIZE, struct.pack("<i", 1000) + BUILD_ID + bytes([20]) + b"\0" * 3 + padded(BINARY))
+    event_desc = struct.pack("<II", len(EVENTS), ATTR_SIZE)
+    for i, event in enumerate(EVENTS):
+        name = event[0].encode() + b"\0"
+        name += b"\0" * (-len(name) % 64)
+        event_desc += attr(i) + struct.pack("<II", len(event[3]), len(name)) + name + struct.pack("<%dQ" % len(event[3]), *event[3])
+
+    features_offset = data_offset + len(data)
+    payload_offset = features_offset + 2 * 16
+    sections = struct.pack("<QQ", payload_offset, len(build_ids)) + struct.pack("<QQ", payload_offset + len(build_ids), len(event_desc))
+    feature_bits = (1 << HEADER_BUILD_ID) | (1 << HEADER_EVENT_DESC)
+
+    out = bytearray()
+    out += struct.pack("<QQQ", 0x32454c4946524550, header_size, ATTR_SIZE + 16)
+    out += struct.pack("<QQQQQQ", attrs_offset, len(attrs), data_offset, len(data), 0, 0)
+    out += struct.pack("<4Q", feature_bits, 0, 0, 0)
+    out += attrs + ids
+    out += b"\0" * (data_offset - len(out))
+    out += data + sections + build_ids + event_desc
+    with open(sys.argv[1], "wb") as f:
+        f.write(out)
+
+
+main()
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Exports a perf.data file with one and with several worker threads and compares the tables
+# usage: parallel.sh <perfSqliteExport> <perf.data>
+set -e
+exporter=$(realpath "$1")
+data=$(realpath "$2")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+"$exporter" -i "$data" -c -j1 "$dir/j1.db" > /dev/null
+failed=0
+for jobs in 2 3 4 7; do
+   "$exporter" -i "$data" -c -j$jobs "$dir/j$jobs.db" > /dev/null
+   for table in selected_events machines threads comms comm_threads dsos symbols call_paths samples; do
+      if ! cmp -s <(sqlite3 "$dir/j1.db" "SELECT * FROM $table ORDER BY id") <(sqlite3 "$dir/j$jobs.db" "SELECT * FROM $table ORDER BY id"); then
+         echo "parallel: $table differs between -j1 and -j$jobs"
+         failed=1
+      fi
+   done
+   rm -f "$dir/j$jobs.db"
+done
+
+if [ $failed -ne 0 ]; then
+   exit 1
+fi
+echo "parallel: -j2, -j3, -j4 and -j7 write the tables of -j1"
@@ -0,0 +1,41 @@
+# Writes a database with exportToSqlite.py from the rows of a perfSqliteExport database,
+# calling the db-export callbacks in the order perf script calls them. Without perf this
+# still compares the tables, memory tables and data_src decoding of exportToSqlite.py,
+# the ids and symbols come from perfSqliteExport.
+# usage: python2 replayPython.py <exportToSqlite.py> <perfSqliteExport database> <output database>
+import os
+import sqlite3
+import sys
+
+script, native, output = sys.argv[1:4]
+os.environ.setdefault('PERF_EXEC_PATH', '/nonexistent')
+sys.argv = [script, output, '-c']
+export = {'__name__': '__main__'}
+execfile(script, export)
+
+con = sqlite3.connect(native)
+def rows(sql):
+	return con.execute(sql + ' WHERE id != 0 ORDER BY id')
+
+export['trace_begin']()
+for row in rows('SELECT id, name FROM selected_events'):
+	export['evsel_table'](*row)
+for row in rows('SELECT id, pid, root_dir FROM machines'):
+	export['machine_table'](*row)
+for row in rows('SELECT id, machine_id, process_id, pid, tid FROM threads'):
+	export['thread_table'](*row)
+for row in rows('SELECT id, comm FROM comms'):
+	export['comm_table'](*row)
+for row in rows('SELECT id, comm_id, thread_id FROM comm_threads'):
+	export['comm_thread_table'](*row)
+for row in rows('SELECT id, machine_id, short_name, long_name, build_id FROM dsos'):
+	export['dso_table'](*row)
+for row in rows('SELECT id, dso_id, sym_start, sym_end, binding, name FROM symbols'):
+	export['symbol_table'](*row)
+for row in rows('SELECT id, parent_id, symbol_id, ip FROM call_paths'):
+	export['call_path_table'](*row)
+for row in rows('SELECT id, evsel_id, machine_id, thread_id, comm_id, dso_id, symbol_id, sym_offset, ip, time, cpu, '
+		'to_dso_id, to_symbol_id, to_sym_offset, to_ip, period, weight, transaction_id, data_src, branch_type, in_tx, '
+		'call_path_id FROM samples'):
+	export['sample_table'](*row)
+export['trace_end']()
@@ -0,0 +1,141 @@
+#include "allocationfilereader.h"
+#include "allocationformat.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace
+{
+// The file ends in the middle of a record
+struct TruncatedRecord : std::runtime_error
+{
+  TruncatedRecord() : std::runtime_error("Truncated allocation record") {}
+};
+}
+
+AllocationFileReader::AllocationFileReader(const QString& path) : file(path)
+{
+  if(!file.open(QIODevice::ReadOnly))
+  {
+    throw std::runtime_error("Can not open allocation file " + path.toStdString());
+  }
+  auto size = file.size();
+  if(size < static_cast<qint64>(sizeof(allocation_file_header)))
+  {
+    throw std::runtime_error("Allocation file too short " + path.toStdString());
+  }
+  const uint8_t* data = file.map(0,size);
+  if(data == nullptr)
+  {
+    throw std::runtime_error("Can not map allocation file " + path.toStdString());
+  }
+  allocation_file_header header;
+  memcpy(&header,data,sizeof(header));
+  if(memcmp(header.magic,ALLOCATION_FORMAT_MAGIC,sizeof(header.magic)) != 0)
+  {
+    throw std::runtime_error("Not a binary allocation file " + path.toStdString());
+  }
+  if(header.version != ALLOCATION_FORMAT_VERSION)
+  {
+    throw std::runtime_error("Unsupported allocation file version " + std::to_string(header.version));
+  }
+  fileTid = static_cast<int>(header.tid);
+  pos = data + sizeof(header);
+  end = data + size;
+}
+
+bool AllocationFileReader::isBinaryFile(const QString& path)
+{
+  QFile f(path);
+  if(!f.open(QIODevice::ReadOnly))
+  {
+    return false;
+  }
+  char magic[8];
+  return f.read(magic,sizeof(magic)) == sizeof(magic) && memcmp(magic,ALLOCATION_FORMAT_MAGIC,sizeof(magic)) == 0;
+}
+
+int AllocationFileReader::tid() const
+{
+  return fileTid;
+}
+
+uint64_t AllocationFileReader::readVarint()
+{
+  uint64_t v;
+  if(!allocation_get_varint(&pos,end,&v))
+  {
+    throw TruncatedRecord();
+  }
+  return v;
+}
+
+bool AllocationFileReader::next(Record& record)
+{
+  if(pos >= end)
+  {
+    return false;
+  }
+  try
+  {
+    return decode(record);
+  }
+  catch(const TruncatedRecord&)
+  {
+    // The application or the collector was killed while the file was written
+    std::cout << "Warning: " << file.fileName().toStdString() << " ends in the middle of a record, the record is ignored\n";
+    pos = end;
+    return false;
+  }
+}
+
+bool AllocationFileReader::decode(Record& record)
+{
+  auto tag = *pos++;
+  record.frames.clear();
+  if(tag == ALLOCATION_RECORD_OBJECT)
+  {
+    record.kind = Kind::Object;
+    lastTimestamp += allocation_zigzag_decode(readVarint());
+    lastAddress += allocation_zigzag_decode(readVarint());
+    record.timestamp = lastTimestamp;
+    record.address = lastAddress;
+    record.size = readVarint();
+    record.type = static_cast<int>(readVarint());
+    record.cpu = static_cast<int>(readVarint());
+    record.pid = static_cast<int>(readVarint());
+    record.tid = static_cast<int>(readVarint());
+    record.stackId = static_cast<unsigned int>(readVarint());
+    auto lifetime = readVarint();
+    record.timestampEnd = lifetime == 0 ? 0 : lastTimestamp + lifetime - 1;
+    record.tagId = static_cast<unsigned int>(readVarint());
+    return true;
+  }
+  if(tag == ALLOCATION_RECORD_TAG)
+  {
+    record.kind = Kind::Tag;
+    record.tagId = static_cast<unsigned int>(readVarint());
+    auto length = readVarint();
+    if(length > static_cast<uint64_t>(end - pos))
+    {
+      throw TruncatedRecord();
+    }
+    record.name.assign(reinterpret_cast<const char*>(pos),length);
+    pos += length;
+    return true;
+  }
+  if(tag != ALLOCATION_RECORD_STACK)
+  {
+    throw std::runtime_error("Unknown allocation record " + std::to_string(tag));
+  }
+  record.kind = Kind::Stack;
+  record.stackId = static_cast<unsigned int>(readVarint());
+  auto numFrames = readVarint();
+  uint64_t ip = 0;
+  for(uint64_t i = 0; i < numFrames; i++)
+  {
+    ip += allocation_zigzag_decode(readVarint());
+    record.frames.push_back(ip);
+  }
+  return true;
+}
@@ -0,0 +1,59 @@
+#ifndef ALLOCATIONFILEREADER_H
+#define ALLOCATIONFILEREADER_H
+
+#include <QFile>
+#include <QString>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Zero-copy reader for the binary allocation tracker format (see allocationformat.h)
+// The file is memory mapped and decoded in place
+class AllocationFileReader
+{
+public:
+  enum class Kind
+  {
+    Object,
+    Stack,
+    Tag
+  };
+
+  // Objects use all fields except frames and name, stacks use only stackId and frames, tags only tagId and name
+  struct Record
+  {
+    Kind kind;
+    unsigned int stackId;
+    unsigned long long timestamp;
+    unsigned long long timestampEnd; // 0 if the object was live at exit
+    unsigned long long address;
+    unsigned long long size;
+    int type;
+    int cpu;
+    int pid;
+    int tid;
+    std::vector<unsigned long long> frames;
+    unsigned int tagId;
+    std::string name;
+  };
+
+  explicit AllocationFileReader(const QString& path);
+  static bool isBinaryFile(const QString& path);
+  // Thread id of object files, process id of stack and live object files
+  int tid() const;
+  // A truncated record at the end of the file ends the file with a warning
+  bool next(Record& record);
+
+private:
+  QFile file;
+  const uint8_t* pos = nullptr;
+  const uint8_t* end = nullptr;
+  int fileTid = 0;
+  uint64_t lastTimestamp = 0;
+  uint64_t lastAddress = 0;
+
+  uint64_t readVarint();
+  bool decode(Record& record);
+};
+
+#endif // ALLOCATIONFILEREADER_H
@@ -5,28 +5,49 @@
 #include <regex>
 #include <vector>
 #include <limits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 #include "address2Line.h"
 #include <QStringBuilder>
 #include "counterattributes.h"
+#include "allocationfilereader.h"
+#include "allocationformat.h"
+#include "processmaps.h"
+#include "staticsymbols.h"
+#include "samplecolumns.h"
 
 struct AllocationInfoRaw
 {
   unsigned long long timestamp;
+  unsigned long long timestampEnd = 0; // 0 if the object was not released
   unsigned long long address;
   unsigned long long size;
   int type;
   int cpu;
   int pid;
   int tid;
+  unsigned int stackId = 0;
   long long callpathId;
+  unsigned int tagId = 0;
+  QString name; // tag of ALLOCATION_EVENT_REGION objects, variable of ALLOCATION_EVENT_STATIC objects
 };
 
+// Maps (image, stack id) of the allocation tracker to allocation_call_paths ids
+// The image is the pid, followed by -<n> for programs started with exec() by a tracked process
+typedef QHash<QPair<QString,unsigned int>,long long> StackCallpathMap;
+// Maps (image, tag id) of the allocation tracker to the name of the pool
+typedef QHash<QPair<QString,unsigned int>,QString> RegionTagMap;
+
 struct CallpathSymbolInfoRaw
 {
   QString name;
   QString dso;
+  QString buildId;
   long long ip;
   long long offset;
+  long long fileAddress = -1; // address for addr2line, ip is used if not set
 };
 
 void sqlitePerformanceSettings(QSqlDatabase& db)
@@ -47,7 +68,10 @@ void createAllocationsTable(QSqlDatabase& db)
   address_end bigint, \
   time_start bigint, \
   time_end bigint, \
-  call_path_id integer)");
+  call_path_id integer, \
+  sample_weight real default 1, \
+  type integer, \
+  name varchar(1024))");
 }
 
 void createAllocationsCallpathTable(QSqlDatabase& db)
@@ -60,6 +84,31 @@ void createAllocationsCallpathTable(QSqlDatabase& db)
   UNIQUE(parent_id,allocation_symbol_id))");
 }
 
+void createPageTables(QSqlDatabase& db)
+{
+  db.exec("DROP TABLE IF EXISTS allocation_node_residency");
+  db.exec("CREATE TABLE allocation_node_residency ( \
+  allocation_id bigint, \
+  time bigint, \
+  node integer, \
+  pages bigint)");
+  db.exec("DROP TABLE IF EXISTS allocation_page_backing");
+  db.exec("CREATE TABLE allocation_page_backing ( \
+  allocation_id bigint, \
+  time bigint, \
+  rss_kb bigint, \
+  anon_huge_kb bigint)");
+  db.exec("DROP TABLE IF EXISTS memory_policies");
+  db.exec("CREATE TABLE memory_policies ( \
+  thread_id bigint, \
+  time bigint, \
+  call varchar(32), \
+  address bigint, \
+  length bigint, \
+  mode integer, \
+  nodemask bigint)");
+}
+
 void createAllocationsSymbolsTable(QSqlDatabase& db)
 {
   db.exec("DROP TABLE IF EXISTS allocation_symbols");
@@ -148,7 +197,7 @@ bool isAllocationInfo(const QString& line)
 
 bool isDeallocation(const AllocationInfoRaw a)
 {
-  if(a.type == 0)
+  if(a.type == ALLOCATION_EVENT_FREE || a.type == ALLOCATION_EVENT_MUNMAP)
   {
     return true;
   }
@@ -160,7 +209,7 @@ bool isDeallocation(const AllocationInfoRaw a)
 
 bool isAllocation(const AllocationInfoRaw a)
 {
-  if(a.type == 1)
+  if(a.type == ALLOCATION_EVENT_ALLOC || a.type == ALLOCATION_EVENT_MREMAP || a.type >= ALLOCATION_EVENT_MMAP)
   {
     return true;
   }
@@ -182,72 +231,133 @@ void printWarningIncompleteEntry()
 
 
 
-void insertAllocation(const AllocationInfoRaw& ao, const long long threadId, const QSqlDatabase& db)
+// Mean number of bytes between two allocations logged by the tracker, 0 if every allocation is logged
+static unsigned long long allocationSampleInterval = 0;
+
+// Inverse of the probability that the tracker logs an allocation of this size
+double sampleWeight(const unsigned long long size)
+{
+  if(allocationSampleInterval == 0 || size == 0)
+  {
+    return 1.0;
+  }
+  return 1.0 / -std::expm1(-static_cast<double>(size) / allocationSampleInterval);
+}
+
+// Prepared statements and thread ids used while the tracker objects are inserted
+struct AllocationInserter
+{
+  QSqlQuery insertAllocation;
+  QSqlQuery selectThreadId;
+  QSqlQuery insertThread;
+  QSqlQuery updateProcessId;
+  QHash<QPair<int,int>,long long> threadIds;
+  // Allocations of trackers before format version 4 that were not released yet
+  QHash<unsigned long long,AllocationInfoRaw> openAllocations;
+};
+
+void prepareAllocationInserter(AllocationInserter& inserter)
+{
+  prepare(inserter.insertAllocation,"INSERT INTO allocations \
+  ( thread_id, cpu, address_start, address_end, \
+  time_start, time_end, call_path_id, sample_weight, type, name) \
+  VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+  prepare(inserter.selectThreadId, "SELECT id from threads where pid = ? AND tid = ?");
+  prepare(inserter.insertThread,"INSERT INTO threads \
+  ( machine_id, process_id, pid, tid) \
+  VALUES (1,?,?,?) ");
+  prepare(inserter.updateProcessId,"UPDATE threads SET process_id = id WHERE id = ?");
+}
+
+long long getThreadId(AllocationInserter& inserter, const int pid, const int tid, const QSqlDatabase& db)
+{
+  auto key = qMakePair(pid,tid);
+  auto it = inserter.threadIds.constFind(key);
+  if(it != inserter.threadIds.constEnd())
+  {
+    return it.value();
+  }
+  long long threadId = -1;
+  inserter.selectThreadId.bindValue(0,pid);
+  inserter.selectThreadId.bindValue(1,tid);
+  inserter.selectThreadId.exec();
+  if(inserter.selectThreadId.next())
+  {
+    threadId = inserter.selectThreadId.value(0).toLongLong();
+  }
+  else
+  {
+    inserter.selectThreadId.finish();
+    // Like perf, process_id is the id of the main thread of the process
+    long long processId = pid != tid ? getThreadId(inserter,pid,pid,db) : 0;
+    inserter.insertThread.bindValue(0,processId);
+    inserter.insertThread.bindValue(1,pid);
+    inserter.insertThread.bindValue(2,tid);
+    inserter.insertThread.exec();
+    threadId = getLastInsertedId(db);
+    if(pid == tid)
+    {
+      inserter.updateProcessId.bindValue(0,threadId);
+      inserter.updateProcessId.exec();
+    }
+  }
+  inserter.selectThreadId.finish();
+  inserter.threadIds.insert(key,threadId);
+  return threadId;
+}
+
+void insertAllocation(const AllocationInfoRaw& ao, const long long threadId, QSqlQuery& insertAllocation)
 {
-    QSqlQuery insertAllocation(db);
-    prepare(insertAllocation,"INSERT INTO allocations \
-    ( thread_id, cpu, address_start, address_end, \
-    time_start, time_end, call_path_id) \
-    VALUES (?, ?, ?, ?, ?, ?, ?)");
     insertAllocation.bindValue(0,threadId);
     insertAllocation.bindValue(1,ao.cpu);
     insertAllocation.bindValue(2,(long long) ao.address);
     insertAllocation.bindValue(3,(long long) (ao.address+ao.size));
     insertAllocation.bindValue(4,(long long) ao.timestamp);
-    insertAllocation.bindValue(5,std::numeric_limits<long long>::max());
+    insertAllocation.bindValue(5,ao.timestampEnd != 0 ? (long long) ao.timestampEnd : std::numeric_limits<long long>::max());
     insertAllocation.bindValue(6,ao.callpathId);
+    // Static objects and thread stacks are not sampled by the tracker
+    insertAllocation.bindValue(7,ao.type == ALLOCATION_EVENT_STATIC || ao.type == ALLOCATION_EVENT_STACK ? 1.0 : sampleWeight(ao.size));
+    insertAllocation.bindValue(8,(int) ao.type);
+    insertAllocation.bindValue(9,ao.name.isEmpty() ? QVariant(QVariant::String) : QVariant(ao.name));
     insertAllocation.exec();
 }
 
-void processAllocationInfo(const AllocationInfoRaw& ao, const QSqlDatabase& db)
+// Objects of the tracker are complete, they are inserted without looking at other allocations
+void insertObject(const AllocationInfoRaw& ao, AllocationInserter& inserter, const QSqlDatabase& db)
+{
+  if(ao.type == ALLOCATION_EVENT_STACK)
+  {
+    AllocationInfoRaw stack = ao;
+    stack.name = QString("stack of thread %1").arg(ao.tid);
+    insertAllocation(stack,getThreadId(inserter,ao.pid,ao.tid,db),inserter.insertAllocation);
+    return;
+  }
+  insertAllocation(ao,getThreadId(inserter,ao.pid,ao.tid,db),inserter.insertAllocation);
+}
+
+// Trackers before format version 4 logged allocations and releases as separate events
+void processAllocationEvent(const AllocationInfoRaw& ao, AllocationInserter& inserter, const QSqlDatabase& db)
 {
   if(isAllocation(ao))
   {
-    QSqlQuery getThreadId(db);
-    prepare(getThreadId, "SELECT id from threads where pid = ? AND tid = ?");
-    getThreadId.bindValue(0, (const int) ao.pid);
-    getThreadId.bindValue(1,(const int) ao.tid);
-    long long threadId = -1;
-    getThreadId.exec();
-    if(getThreadId.next())
+    auto previous = inserter.openAllocations.find(ao.address);
+    if(previous != inserter.openAllocations.end())
     {
-      threadId = getThreadId.value(0).toLongLong();
-      if(getThreadId.next())
-      {
-        //error
-        //returned two results
-      }
+      // resized in place by realloc
+      previous.value().timestampEnd = ao.timestamp;
+      insertObject(previous.value(),inserter,db);
+      inserter.openAllocations.erase(previous);
     }
-    else
+    inserter.openAllocations.insert(ao.address,ao);
+  }
+  else if(isDeallocation(ao))
+  {
+    auto allocation = inserter.openAllocations.find(ao.address);
+    if(allocation != inserter.openAllocations.end())
     {
-      QSqlQuery insertNewThread(db);
-      prepare(insertNewThread,"INSERT INTO threads \
-      ( machine_id, process_id, pid, tid) \
-      VALUES (1,1,?,?) ");
-      insertNewThread.bindValue(0,ao.pid);
-      insertNewThread.bindValue(1,ao.tid);
-      insertNewThread.exec();
-      threadId = getLastInsertedId(db);
-    }
-    insertAllocation(ao,threadId,db);
-  }
-  else if(isDeallocation(ao)) // must be deallocation
-  {
-    // update end time of entry
-    QSqlQuery getAllocation(db);
-    prepare(getAllocation,"select id from allocations where \
-    address_start = ? order by time_start desc limit 1");
-    getAllocation.bindValue(0,ao.address);
-    getAllocation.exec();
-    long long id;
-    if(getAllocation.next())
-    {
-      id = getAllocation.value(0).toLongLong();
-      QSqlQuery updateAllocation(db);
-      prepare(updateAllocation,"update allocations set time_end = ? where id = ?");
-      updateAllocation.bindValue(0,ao.timestamp);
-      updateAllocation.bindValue(1,id);
-      updateAllocation.exec();
+      allocation.value().timestampEnd = ao.timestamp;
+      insertObject(allocation.value(),inserter,db);
+      inserter.openAllocations.erase(allocation);
     }
     else
     {
@@ -256,6 +366,23 @@ void processAllocationInfo(const AllocationInfoRaw& ao, const QSqlDatabase& db)
   }
 }
 
+// Allocations of old trackers without a release live until the end of the program
+void finishAllocationEvents(AllocationInserter& inserter, const QSqlDatabase& db)
+{
+  for(const auto& ao : inserter.openAllocations)
+  {
+    insertObject(ao,inserter,db);
+  }
+  inserter.openAllocations.clear();
+}
+
+// The tag id is missing in files of trackers before format version 5
+bool readObjectInfo(const std::string& line, AllocationInfoRaw& tmp)
+{
+  return sscanf(line.c_str(),"%llu end %llu pid %d tid %d cpu %d size %llu addr %llx type %d stack %u tag %u",
+                &tmp.timestamp,&tmp.timestampEnd,&tmp.pid,&tmp.tid,&tmp.cpu,&tmp.size,&tmp.address,&tmp.type,&tmp.stackId,&tmp.tagId) >= 9;
+}
+
 bool readAllocationInfo(const std::string& line, AllocationInfoRaw& tmp)
 {
   std::stringstream ss(line);
@@ -295,21 +422,36 @@ bool readAllocationInfo(const std::string& line, AllocationInfoRaw& tmp)
   ss >> typeDelim;
   if (!ss.good())
     return false;
-  ss >> tmp.type;
+  ss >> std::dec >> tmp.type;
 
   if(ss.eof())
   {
     return true;
   }
-  else
-  {
+  // optional stack id of the interned stack
+  std::string stackDelim;
+  ss >> stackDelim;
+  if (!ss.good() || stackDelim != "stack")
     return false;
-  }
+  ss >> tmp.stackId;
+  return !ss.fail() && ss.eof();
+}
+
+// Image name of a tracker file: <image>.<suffix> or <image>.<tid>.allocationData
+QString getImage(const QString& file)
+{
+  return QFileInfo(file).fileName().section('.',0,0);
+}
+
+// Thread files of trackers before fork support are named <tid>.allocationData, their stacks belong to the pid of the records
+bool hasImageName(const QString& file)
+{
+  return QFileInfo(file).fileName().count('.') >= 2;
 }
 
 int getTid(const QString& file)
 {
-  static thread_local QRegExp rgx("(\\d+)(\\.allocationData)");
+  static thread_local QRegExp rgx("(\\d+)(\\.allocation\\w+)");
   rgx.indexIn(file);
   QStringList list = rgx.capturedTexts();
   if(list.length() == 3)
@@ -432,9 +574,10 @@ long long insertCallpathSymbolInfo(const CallpathSymbolInfoRaw& callpathSymbol,
     {
       // add new dso
       QSqlQuery addDso;
-      prepare(addDso,"INSERT INTO dsos (machine_id,short_name,long_name,build_id) VALUES (1,?,?,'')");
+      prepare(addDso,"INSERT INTO dsos (machine_id,short_name,long_name,build_id) VALUES (1,?,?,?)");
       addDso.bindValue(0,shortName);
       addDso.bindValue(1,callpathSymbol.dso);
+      addDso.bindValue(2,callpathSymbol.buildId);
       addDso.exec();
       dsoId = getLastInsertedId(db);
     }
@@ -443,7 +586,8 @@ long long insertCallpathSymbolInfo(const CallpathSymbolInfoRaw& callpathSymbol,
   Address2Line::LineInfo lineInfo;
   if(dsoName != "")
   {
-    lineInfo = Address2Line::getLineInfo(dsoName,QString::number(callpathSymbol.ip,16));
+    auto address = callpathSymbol.fileAddress >= 0 ? callpathSymbol.fileAddress : callpathSymbol.ip;
+    lineInfo = Address2Line::getLineInfo(dsoName,QString::number(address,16));
   }
 
   /* ip based call paths
@@ -501,7 +645,11 @@ long long insertCallpathSymbolInfo(const CallpathSymbolInfoRaw& callpathSymbol,
       insertNewAllocationSymbol.exec();
     }
     symbolId = getLastInsertedId(db);
-    cache.insert(QPair<QString,int>(lineInfo.file,lineInfo.line),symbolId);
+    if(lineInfo.line > 0)
+    {
+      // frames without line information must not share one symbol
+      cache.insert(QPair<QString,int>(lineInfo.file,lineInfo.line),symbolId);
+    }
   }
   return symbolId;
 }
@@ -559,61 +707,412 @@ long long insertCallpath(const std::vector<long long>& callpathIds, const QSqlDa
 
 
 
-void readAllocationFile(const std::string& file, QSqlDatabase& db)
+long long getStackCallpathId(const StackCallpathMap& stacks, const QString& image, const unsigned int stackId)
+{
+  if(stackId == 0)
+  {
+    return 0;
+  }
+  auto it = stacks.find(qMakePair(image,stackId));
+  if(it == stacks.end())
+  {
+    std::cout << "Warning: unknown stack id " << stackId << " of process " << image.toStdString() << "\n";
+    return 0;
+  }
+  return it.value();
+}
+
+QString getRegionTag(const RegionTagMap& tags, const QString& image, const unsigned int tagId)
+{
+  if(tagId == 0)
+  {
+    return QString();
+  }
+  return tags.value(qMakePair(image,tagId));
+}
+
+// Symbolizes a raw instruction pointer of the allocation tracker with the maps snapshot of its process
+// Every distinct code address is symbolized only once
+long long insertFrameSymbol(const ProcessMaps* maps, const unsigned long long ip, QSqlDatabase& db)
+{
+  static QHash<QPair<QString,unsigned long long>,long long> cache;
+  CallpathSymbolInfoRaw callpathInfo;
+  callpathInfo.ip = static_cast<long long>(ip);
+  callpathInfo.offset = 0;
+  const ProcessMaps::Mapping* mapping = maps != nullptr ? maps->find(ip) : nullptr;
+  if(mapping != nullptr)
+  {
+    callpathInfo.dso = mapping->path;
+    callpathInfo.buildId = mapping->buildId;
+    callpathInfo.offset = static_cast<long long>(ProcessMaps::fileAddress(*mapping,ip));
+    callpathInfo.fileAddress = callpathInfo.offset;
+  }
+  auto key = qMakePair(callpathInfo.dso,mapping != nullptr ? static_cast<unsigned long long>(callpathInfo.offset) : ip);
+  auto it = cache.find(key);
+  if(it != cache.end())
+  {
+    return it.value();
+  }
+  auto symbolId = insertCallpathSymbolInfo(callpathInfo,db);
+  cache.insert(key,symbolId);
+  return symbolId;
+}
+
+void readBinaryStackFile(const QString& file, const QHash<QString,ProcessMaps>& maps, StackCallpathMap& stacks, RegionTagMap& tags, QSqlDatabase& db)
+{
+  AllocationFileReader reader(file);
+  AllocationFileReader::Record record;
+  std::vector<long long> callpathSymbolIds;
+  const auto image = getImage(file);
+  auto processMaps = maps.find(image);
+  const ProcessMaps* pm = processMaps != maps.end() ? &processMaps.value() : nullptr;
+  while(reader.next(record))
+  {
+    if(record.kind == AllocationFileReader::Kind::Tag)
+    {
+      tags.insert(qMakePair(image,record.tagId),QString::fromStdString(record.name));
+      continue;
+    }
+    for(const auto ip : record.frames)
+    {
+      callpathSymbolIds.push_back(insertFrameSymbol(pm,ip,db));
+    }
+    stacks.insert(qMakePair(image,record.stackId),insertCallpath(callpathSymbolIds,db));
+    callpathSymbolIds.clear();
+  }
+}
+
+void readTextStackFile(const QString& file, const QHash<QString,ProcessMaps>& maps, StackCallpathMap& stacks, RegionTagMap& tags, QSqlDatabase& db)
+{
+  std::ifstream infile(file.toStdString());
+  std::string line;
+  const auto image = getImage(file);
+  auto processMaps = maps.find(image);
+  const ProcessMaps* pm = processMaps != maps.end() ? &processMaps.value() : nullptr;
+  unsigned int stackId = 0;
+  std::vector<long long> callpathSymbolIds;
+  auto finishStack = [&]()
+  {
+    if(stackId != 0)
+    {
+      stacks.insert(qMakePair(image,stackId),insertCallpath(callpathSymbolIds,db));
+    }
+    callpathSymbolIds.clear();
+  };
+  while (std::getline(infile,line))
+  {
+    if(line.compare(0,6,"stack ") == 0)
+    {
+      finishStack();
+      stackId = static_cast<unsigned int>(std::stoul(line.substr(6)));
+    }
+    else if(line.compare(0,4,"tag ") == 0)
+    {
+      // "tag <id> <name>", the name may contain spaces
+      finishStack();
+      stackId = 0;
+      auto idEnd = line.find(' ',4);
+      auto tagId = static_cast<unsigned int>(std::stoul(line.substr(4,idEnd - 4)));
+      tags.insert(qMakePair(image,tagId),idEnd != std::string::npos ? QString::fromStdString(line.substr(idEnd + 1)) : QString());
+    }
+    else
+    {
+      auto callpathInfo = readCallchainEntry(QString::fromStdString(line));
+      if(callpathInfo.dso.isEmpty())
+      {
+        // raw instruction pointer
+        callpathSymbolIds.push_back(insertFrameSymbol(pm,static_cast<unsigned long long>(callpathInfo.ip),db));
+      }
+      else
+      {
+        callpathSymbolIds.push_back(insertCallpathSymbolInfo(callpathInfo,db));
+      }
+    }
+  }
+  finishStack();
+}
+
+// Stacks and tags that allocationCollector decoded while the application ran (ALLOCATION_SESSION_DB)
+void readSessionStacks(const QHash<QString,ProcessMaps>& maps, StackCallpathMap& stacks, RegionTagMap& tags, QSqlDatabase& db)
+{
+  QSqlQuery query(db);
+  query.setForwardOnly(true);
+  query.exec("SELECT i.name, t.tag_id, t.name FROM session.allocation_tags t JOIN session.allocation_images i ON i.id = t.image_id");
+  while(query.next())
+  {
+    tags.insert(qMakePair(query.value(0).toString(),query.value(1).toUInt()),query.value(2).toString());
+  }
+  query.exec("SELECT i.name, s.stack_id, s.frames FROM session.allocation_stacks s JOIN session.allocation_images i ON i.id = s.image_id");
+  std::vector<long long> callpathSymbolIds;
+  while(query.next())
+  {
+    const auto image = query.value(0).toString();
+    auto processMaps = maps.find(image);
+    const ProcessMaps* pm = processMaps != maps.end() ? &processMaps.value() : nullptr;
+    const auto frames = query.value(2).toByteArray();
+    for(int i = 0; i + static_cast<int>(sizeof(uint64_t)) <= frames.size(); i += sizeof(uint64_t))
+    {
+      uint64_t ip;
+      memcpy(&ip,frames.constData() + i,sizeof(ip));
+      callpathSymbolIds.push_back(insertFrameSymbol(pm,ip,db));
+    }
+    stacks.insert(qMakePair(image,query.value(1).toUInt()),insertCallpath(callpathSymbolIds,db));
+    callpathSymbolIds.clear();
+  }
+}
+
+// Every stack of every process is inserted once, events only reference the stack id
+// The stack files also hold the names of the region tags
+StackCallpathMap readAllocationStackFiles(QString dir, bool session, RegionTagMap& tags, QSqlDatabase& db)
+{
+  StackCallpathMap stacks;
+  const auto maps = ProcessMaps::readAll(dir);
+  const QString suffix = "allocationStacks";
+  QDirIterator it(dir);
+  db.exec("BEGIN TRANSACTION");
+  while(it.hasNext())
+  {
+    it.next();
+    if(it.fileInfo().isFile() && it.fileInfo().suffix() == suffix)
+    {
+      auto path = it.fileInfo().filePath();
+      if(AllocationFileReader::isBinaryFile(path))
+      {
+        readBinaryStackFile(path,maps,stacks,tags,db);
+      }
+      else
+      {
+        readTextStackFile(path,maps,stacks,tags,db);
+      }
+    }
+  }
+  if(session)
+  {
+    readSessionStacks(maps,stacks,tags,db);
+  }
+  db.exec("END TRANSACTION");
+  return stacks;
+}
+
+// Attaches the database of allocationCollector as session, false if the directory has none
+bool attachSessionDatabase(const QString& dir, QSqlDatabase& db)
+{
+  const auto path = QDir(dir).filePath(ALLOCATION_SESSION_DB);
+  if(!QFileInfo::exists(path))
+  {
+    return false;
+  }
+  QSqlQuery attach(db);
+  prepare(attach,"ATTACH DATABASE ? AS session");
+  attach.bindValue(0,path);
+  if(!attach.exec())
+  {
+    std::cout << "Warning: can not read " << path.toStdString() << ": " << attach.lastError().text().toStdString() << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Objects that allocationCollector decoded while the application ran are appended with one query,
+// thread ids, call paths, tags and sample weights are looked up in temporary tables
+void readSessionObjects(const StackCallpathMap& stacks, const RegionTagMap& tags, AllocationInserter& inserter, QSqlDatabase& db)
+{
+  db.exec("BEGIN TRANSACTION");
+  db.exec("CREATE TEMP TABLE session_threads (pid integer, tid integer, thread_id integer, PRIMARY KEY(pid,tid))");
+  db.exec("CREATE TEMP TABLE session_call_paths (image_id integer, stack_id integer, call_path_id integer, PRIMARY KEY(image_id,stack_id))");
+  db.exec("CREATE TEMP TABLE session_tags (image_id integer, tag_id integer, name varchar(1024), PRIMARY KEY(image_id,tag_id))");
+  db.exec("CREATE TEMP TABLE session_weights (size integer PRIMARY KEY, weight real)");
+
+  QSqlQuery select(db);
+  select.setForwardOnly(true);
+  QSqlQuery insert(db);
+  select.exec("SELECT DISTINCT pid, tid FROM session.allocation_objects");
+  prepare(insert,"INSERT INTO session_threads VALUES (?,?,?)");
+  while(select.next())
+  {
+    const int pid = select.value(0).toInt();
+    const int tid = select.value(1).toInt();
+    insert.bindValue(0,pid);
+    insert.bindValue(1,tid);
+    insert.bindValue(2,getThreadId(inserter,pid,tid,db));
+    insert.exec();
+  }
+
+  QHash<QString,long long> images;
+  select.exec("SELECT id, name FROM session.allocation_images");
+  while(select.next())
+  {
+    images.insert(select.value(1).toString(),select.value(0).toLongLong());
+  }
+  prepare(insert,"INSERT INTO session_call_paths VALUES (?,?,?)");
+  for(auto it = stacks.constBegin(); it != stacks.constEnd(); ++it)
+  {
+    auto image = images.constFind(it.key().first);
+    if(image != images.constEnd())
+    {
+      insert.bindValue(0,image.value());
+      insert.bindValue(1,it.key().second);
+      insert.bindValue(2,it.value());
+      insert.exec();
+    }
+  }
+  prepare(insert,"INSERT INTO session_tags VALUES (?,?,?)");
+  for(auto it = tags.constBegin(); it != tags.constEnd(); ++it)
+  {
+    auto image = images.constFind(it.key().first);
+    if(image != images.constEnd())
+    {
+      insert.bindValue(0,image.value());
+      insert.bindValue(1,it.key().second);
+      insert.bindValue(2,it.value());
+      insert.exec();
+    }
+  }
+  select.exec("SELECT DISTINCT address_end - address_start FROM session.allocation_objects");
+  prepare(insert,"INSERT INTO session_weights VALUES (?,?)");
+  while(select.next())
+  {
+    const auto size = select.value(0).toLongLong();
+    insert.bindValue(0,size);
+    insert.bindValue(1,sampleWeight(static_cast<unsigned long long>(size)));
+    insert.exec();
+  }
+
+  select.exec("SELECT count(*) FROM session.allocation_objects o WHERE stack_id != 0 AND NOT EXISTS \
+  (SELECT 1 FROM session_call_paths c WHERE c.image_id = o.image_id AND c.stack_id = o.stack_id)");
+  if(select.next() && select.value(0).toLongLong() > 0)
+  {
+    std::cout << "Warning: " << select.value(0).toLongLong() << " objects of the collector have an unknown stack id\n";
+  }
+  select.finish();
+
+  // Static objects and thread stacks are not sampled by the tracker, see insertAllocation() and insertObject()
+  QSqlQuery append(db);
+  if(!append.exec(QString("INSERT INTO allocations \
+  (thread_id, cpu, address_start, address_end, time_start, time_end, call_path_id, sample_weight, type, name) \
+  SELECT t.thread_id, o.cpu, o.address_start, o.address_end, o.time_start, o.time_end, IFNULL(c.call_path_id,0), \
+  CASE WHEN o.type IN (%1,%2) THEN 1.0 ELSE w.weight END, o.type, \
+  CASE WHEN o.type = %2 THEN 'stack of thread ' || o.tid ELSE g.name END \
+  FROM session.allocation_objects o \
+  JOIN session_threads t ON t.pid = o.pid AND t.tid = o.tid \
+  LEFT JOIN session_call_paths c ON c.image_id = o.image_id AND c.stack_id = o.stack_id \
+  LEFT JOIN session_tags g ON g.image_id = o.image_id AND g.tag_id = o.tag_id \
+  LEFT JOIN session_weights w ON w.size = o.address_end - o.address_start").arg(ALLOCATION_EVENT_STATIC).arg(ALLOCATION_EVENT_STACK)))
+  {
+    std::cout << "Can not insert the objects of the collector: " << append.lastError().text().toStdString() << "\n";
+  }
+  std::cout << append.numRowsAffected() << " objects of the collector inserted\n";
+
+  db.exec("DROP TABLE session_threads");
+  db.exec("DROP TABLE session_call_paths");
+  db.exec("DROP TABLE session_tags");
+  db.exec("DROP TABLE session_weights");
+  db.exec("END TRANSACTION");
+}
+
+void readBinaryAllocationFile(const QString& file, const StackCallpathMap& stacks, const RegionTagMap& tags, AllocationInserter& inserter, QSqlDatabase& db)
+{
+  AllocationFileReader reader(file);
+  AllocationFileReader::Record record;
+  const auto image = hasImageName(file) ? getImage(file) : QString();
+  while(reader.next(record))
+  {
+    AllocationInfoRaw tmp;
+    tmp.timestamp = record.timestamp;
+    tmp.timestampEnd = record.timestampEnd;
+    tmp.address = record.address;
+    tmp.size = record.size;
+    tmp.type = record.type;
+    tmp.cpu = record.cpu;
+    tmp.pid = record.pid;
+    tmp.tid = record.tid;
+    tmp.stackId = record.stackId;
+    tmp.callpathId = getStackCallpathId(stacks,image.isEmpty() ? QString::number(tmp.pid) : image,tmp.stackId);
+    tmp.name = getRegionTag(tags,image.isEmpty() ? QString::number(tmp.pid) : image,record.tagId);
+    insertObject(tmp,inserter,db);
+  }
+}
+
+void readAllocationFile(const std::string& file, const StackCallpathMap& stacks, const RegionTagMap& tags, AllocationInserter& inserter, QSqlDatabase& db)
 {
-  db.exec("CREATE INDEX IF NOT EXISTS idx_ip on allocation_symbols(ip)");
-  db.exec("CREATE INDEX IF NOT EXISTS idx_address_start on allocations(address_start)");
-  //db.exec("CREATE INDEX IF NOT EXISTS idx_file_line on allocation_symbols(file,line)");
-  db.commit();
   db.exec("BEGIN TRANSACTION");
+  if(AllocationFileReader::isBinaryFile(QString::fromStdString(file)))
+  {
+    readBinaryAllocationFile(QString::fromStdString(file),stacks,tags,inserter,db);
+    db.exec("END TRANSACTION");
+    return;
+  }
+
   std::ifstream infile(file);
   std::string line;
   int tid = getTid(QString::fromStdString(file));
+  const auto image = hasImageName(QString::fromStdString(file)) ? getImage(QString::fromStdString(file)) : QString();
   std::vector<long long> callpathSymbolIds;
-
-  // insert of anon object
-  AllocationInfoRaw a0;
-  a0.cpu = 0;
-  a0.pid = 0;
-  a0.tid = 0;
-  a0.size = 0;
-  a0.type = 0;
-  a0.address = 0;
-  a0.timestamp = 0;
-  a0.callpathId = 0;
-  insertAllocation(a0,0,db);
-
   while (std::getline(infile,line))
   {
     if(isCallchainStart(QString::fromStdString(line)))
     {
         continue;
     }
-    else
+    AllocationInfoRaw tmp;
+    if(readObjectInfo(line, tmp))
     {
-      AllocationInfoRaw tmp;
-      tmp.tid = tid;
-      bool readOk = readAllocationInfo(line, tmp);
+      tmp.callpathId = getStackCallpathId(stacks,image.isEmpty() ? QString::number(tmp.pid) : image,tmp.stackId);
+      tmp.name = getRegionTag(tags,image.isEmpty() ? QString::number(tmp.pid) : image,tmp.tagId);
+      insertObject(tmp,inserter,db);
+      continue;
+    }
+    tmp = AllocationInfoRaw();
+    tmp.tid = tid;
+    bool readOk = readAllocationInfo(line, tmp);
 
-      if(readOk)   {
-        tmp.callpathId = insertCallpath(callpathSymbolIds,db);
-        processAllocationInfo(tmp,db);
-        callpathSymbolIds.clear();
+    if(readOk)   {
+      if(tmp.stackId != 0)
+      {
+        tmp.callpathId = getStackCallpathId(stacks,image.isEmpty() ? QString::number(tmp.pid) : image,tmp.stackId);
       }
-      else // must be a callchain entry
+      else
       {
-        auto callpathInfo = readCallchainEntry(QString::fromStdString(line));
-        auto symbolId = insertCallpathSymbolInfo(callpathInfo,db);
-        callpathSymbolIds.push_back(symbolId);
+        // files of older trackers contain the frames in front of every event
+        tmp.callpathId = insertCallpath(callpathSymbolIds,db);
       }
+      processAllocationEvent(tmp,inserter,db);
+      callpathSymbolIds.clear();
+    }
+    else // must be a callchain entry
+    {
+      auto callpathInfo = readCallchainEntry(QString::fromStdString(line));
+      auto symbolId = insertCallpathSymbolInfo(callpathInfo,db);
+      callpathSymbolIds.push_back(symbolId);
     }
   }
   db.exec("END TRANSACTION");
 }
 
+// Objects released by every thread (allocationData) and objects live at exit (allocationLive)
+// Objects and stacks the collector decoded while the application ran are read from its session database
 void readAllocationTrackerFiles(QString dir, QSqlDatabase& db)
 {
-  const QString suffix = "allocationData";
+  RegionTagMap tags;
+  const bool session = attachSessionDatabase(dir,db);
+  const auto stacks = readAllocationStackFiles(dir,session,tags,db);
+  db.exec("CREATE INDEX IF NOT EXISTS idx_ip on allocation_symbols(ip)");
+  db.commit();
+  AllocationInserter inserter;
+  prepareAllocationInserter(inserter);
+
+  // insert of anon object
+  AllocationInfoRaw a0;
+  a0.cpu = 0;
+  a0.pid = 0;
+  a0.tid = 0;
+  a0.size = 0;
+  a0.type = 0;
+  a0.address = 0;
+  a0.timestamp = 0;
+  a0.callpathId = 0;
+  insertAllocation(a0,0,inserter.insertAllocation);
+
   QDirIterator it(dir);
   //QThreadPool tp;
   //tp.setMaxThreadCount(2);
@@ -622,10 +1121,11 @@ void readAllocationTrackerFiles(QString dir, QSqlDatabase& db)
     it.next();
     if(it.fileInfo().isFile())
     {
-      if(it.fileInfo().suffix() == suffix)
+      auto suffix = it.fileInfo().suffix();
+      if(suffix == "allocationData" || suffix == "allocationLive")
       {
         auto path = it.fileInfo().filePath();
-        readAllocationFile(path.toStdString(),db);
+        readAllocationFile(path.toStdString(),stacks,tags,inserter,db);
         /*
               if(it.fileInfo().size() > sizeLimit)
                 {
@@ -640,6 +1140,121 @@ void readAllocationTrackerFiles(QString dir, QSqlDatabase& db)
     }
   }
   //tp.waitForDone();
+  db.exec("BEGIN TRANSACTION");
+  finishAllocationEvents(inserter,db);
+  db.exec("END TRANSACTION");
+  if(session)
+  {
+    readSessionObjects(stacks,tags,inserter,db);
+    db.exec("DETACH DATABASE session");
+  }
+}
+
+// Page residency and huge page backing samples of large objects and calls that set a memory policy
+// or huge page advice (<image>.allocationPages), node -1 counts pages that were not touched yet
+void readPageFiles(QString dir, QSqlDatabase& db)
+{
+  db.exec("CREATE INDEX IF NOT EXISTS idx_allocations_address on allocations(address_start)");
+  AllocationInserter inserter;
+  prepareAllocationInserter(inserter);
+  QSqlQuery findAllocation;
+  prepare(findAllocation,"select allocations.id from allocations join threads on threads.id = allocations.thread_id \
+  where address_start = ? and threads.pid = ? and time_start <= ? and time_end >= ?");
+  QSqlQuery insertResidency;
+  prepare(insertResidency,"INSERT INTO allocation_node_residency (allocation_id, time, node, pages) VALUES (?,?,?,?)");
+  QSqlQuery insertPolicy;
+  QSqlQuery insertBacking;
+  prepare(insertBacking,"INSERT INTO allocation_page_backing (allocation_id, time, rss_kb, anon_huge_kb) VALUES (?,?,?,?)");
+  prepare(insertPolicy,"INSERT INTO memory_policies (thread_id, time, call, address, length, mode, nodemask) VALUES (?,?,?,?,?,?,?)");
+  const QString suffix = "allocationPages";
+  QDirIterator it(dir);
+  db.exec("BEGIN TRANSACTION");
+  while(it.hasNext())
+  {
+    it.next();
+    if(!it.fileInfo().isFile() || it.fileInfo().suffix() != suffix)
+    {
+      continue;
+    }
+    const int pid = getImage(it.fileInfo().filePath()).section('-',0,0).toInt();
+    std::ifstream infile(it.fileInfo().filePath().toStdString());
+    std::string line;
+    while(std::getline(infile,line))
+    {
+      char call[32];
+      unsigned long long time, address, length, nodemask, pages, rss, anonHuge;
+      int tid, mode, node;
+      if(std::sscanf(line.c_str(),"residency %llu %llx %d %llu",&time,&address,&node,&pages) == 4)
+      {
+        findAllocation.bindValue(0,(long long) address);
+        findAllocation.bindValue(1,pid);
+        findAllocation.bindValue(2,(long long) time);
+        findAllocation.bindValue(3,(long long) time);
+        findAllocation.exec();
+        if(findAllocation.next())
+        {
+          insertResidency.bindValue(0,findAllocation.value(0).toLongLong());
+          insertResidency.bindValue(1,(long long) time);
+          insertResidency.bindValue(2,node);
+          insertResidency.bindValue(3,(long long) pages);
+          insertResidency.exec();
+        }
+        findAllocation.finish();
+      }
+      else if(std::sscanf(line.c_str(),"thp %llu %llx %llu %llu",&time,&address,&rss,&anonHuge) == 4)
+      {
+        findAllocation.bindValue(0,(long long) address);
+        findAllocation.bindValue(1,pid);
+        findAllocation.bindValue(2,(long long) time);
+        findAllocation.bindValue(3,(long long) time);
+        findAllocation.exec();
+        if(findAllocation.next())
+        {
+          insertBacking.bindValue(0,findAllocation.value(0).toLongLong());
+          insertBacking.bindValue(1,(long long) time);
+          insertBacking.bindValue(2,(long long) rss);
+          insertBacking.bindValue(3,(long long) anonHuge);
+          insertBacking.exec();
+        }
+        findAllocation.finish();
+      }
+      else if(std::sscanf(line.c_str(),"policy %llu %d %31s %llx %llu %d %llx",&time,&tid,call,&address,&length,&mode,&nodemask) == 7)
+      {
+        insertPolicy.bindValue(0,getThreadId(inserter,pid,tid,db));
+        insertPolicy.bindValue(1,(long long) time);
+        insertPolicy.bindValue(2,QString(call));
+        insertPolicy.bindValue(3,(long long) address);
+        insertPolicy.bindValue(4,(long long) length);
+        insertPolicy.bindValue(5,mode);
+        insertPolicy.bindValue(6,(long long) nodemask);
+        insertPolicy.exec();
+      }
+    }
+  }
+  db.exec("END TRANSACTION");
+}
+
+QHash<QString,unsigned long long> readAllocationTrackerMetadata(QString dir)
+{
+  // Every process writes "key value" lines, values of all processes are summed up
+  QHash<QString,unsigned long long> values;
+  const QString suffix = "allocationMeta";
+  QDirIterator it(dir);
+  while(it.hasNext())
+  {
+    it.next();
+    if(it.fileInfo().isFile() && it.fileInfo().suffix() == suffix)
+    {
+      std::ifstream infile(it.fileInfo().filePath().toStdString());
+      std::string key;
+      unsigned long long value;
+      while(infile >> key >> value)
+      {
+        values[QString::fromStdString(key)] += value;
+      }
+    }
+  }
+  return values;
 }
 
 void modifySamplesTable()
@@ -676,9 +1291,11 @@ void updateRelationshipKeys(QSqlDatabase& db)
 {
   db.exec("CREATE INDEX IF NOT EXISTS idx_allocations_id on allocations(id)");
   QSqlQuery getAllocationData;
-  prepare(getAllocationData,"select address_start, address_end, time_start, time_end from allocations where id = ?");
+  prepare(getAllocationData,"select address_start, address_end, time_start, time_end, \
+  (select pid from threads where id = allocations.thread_id) from allocations where id = ?");
   QSqlQuery getIds;
-  prepare(getIds,"select id from allocations");
+  // Later updates win: regions of pools are matched after the larger blocks that contain them
+  prepare(getIds,"select id from allocations order by address_end - address_start desc");
   QSqlQuery updateSample;
   QSqlQuery selectLoad;
   prepare(selectLoad,"select id from selected_events where name like 'cpu/mem-loads%'");
@@ -703,13 +1320,15 @@ void updateRelationshipKeys(QSqlDatabase& db)
   }
   prepare(updateSample,"update samples set allocation_id = ? where id = ?");
   QSqlQuery createTmpTable;
-  prepare(createTmpTable,"create table samplesMem as select id, time, to_ip from samples where evsel_id in (?,?)");
+  // Processes share virtual addresses, samples only match allocations of their own process
+  prepare(createTmpTable,"create table samplesMem as select id, time, to_ip, \
+  (select pid from threads where id = samples.thread_id) as pid from samples where evsel_id in (?,?)");
   createTmpTable.bindValue(0,loadId);
   createTmpTable.bindValue(1,storeId);
   createTmpTable.exec();
-  db.exec("create index idx_samplesMem_toIp on samplesMem(to_ip,time,id)"); // covering index, id must be last parameter
+  db.exec("create index idx_samplesMem_toIp on samplesMem(pid,to_ip,time,id)"); // covering index, id must be last parameter
   QSqlQuery findUpdates;
-  prepare(findUpdates,"select id from samplesMem where to_ip between ? and ? and time between ? and ?");
+  prepare(findUpdates,"select id from samplesMem where pid = ? and to_ip between ? and ? and time between ? and ?");
   getIds.exec();
   QVariantList allocIds;
   QVariantList sampleIds;
@@ -724,11 +1343,13 @@ void updateRelationshipKeys(QSqlDatabase& db)
       long long addressEnd = getAllocationData.value(1).toLongLong();
       long long timeStart = getAllocationData.value(2).toLongLong();
       long long timeEnd = getAllocationData.value(3).toLongLong();
+      long long pid = getAllocationData.value(4).toLongLong();
 
-      findUpdates.bindValue(0, addressStart);
-      findUpdates.bindValue(1, addressEnd);
-      findUpdates.bindValue(2, timeStart);
-      findUpdates.bindValue(3, timeEnd);
+      findUpdates.bindValue(0, pid);
+      findUpdates.bindValue(1, addressStart);
+      findUpdates.bindValue(2, addressEnd);
+      findUpdates.bindValue(3, timeStart);
+      findUpdates.bindValue(4, timeEnd);
       findUpdates.exec();
       while(findUpdates.next())
       {
@@ -756,6 +1377,115 @@ void updateRelationshipKeys(QSqlDatabase& db)
   updateSample.finish();
 }
 
+struct StaticObject
+{
+  unsigned long long start;
+  unsigned long long end;
+  QString name;
+  long long allocationId = -1;
+};
+
+// Global and static variables of all objects mapped by the processes, sorted by address per pid
+// Programs started with exec() keep the pid, their variables are merged into one table
+QHash<int,std::vector<StaticObject>> readStaticObjects(const QString& dir)
+{
+  QHash<int,std::vector<StaticObject>> objects;
+  QHash<QString,std::vector<StaticSymbols::Symbol>> symbolCache;
+  const auto maps = ProcessMaps::readAll(dir);
+  for(auto it = maps.begin(); it != maps.end(); ++it)
+  {
+    auto& processObjects = objects[it.key().section('-',0,0).toInt()];
+    QSet<QString> paths;
+    for(const auto& mapping : it.value().all())
+    {
+      if(paths.contains(mapping.path))
+      {
+        continue;
+      }
+      paths.insert(mapping.path);
+      auto cached = symbolCache.find(mapping.path);
+      if(cached == symbolCache.end())
+      {
+        cached = symbolCache.insert(mapping.path,StaticSymbols::read(mapping.path));
+      }
+      const auto bias = ProcessMaps::loadBias(mapping);
+      const auto dso = mapping.path.section('/',-1);
+      for(const auto& symbol : cached.value())
+      {
+        StaticObject o;
+        o.start = symbol.address + bias;
+        o.end = o.start + symbol.size;
+        o.name = symbol.name % QLatin1String(" (") % dso % QLatin1Char(')');
+        processObjects.push_back(o);
+      }
+    }
+    std::sort(processObjects.begin(),processObjects.end(),[](const StaticObject& a, const StaticObject& b){return a.start < b.start;});
+  }
+  return objects;
+}
+
+// Load and store samples that hit no tracked object are matched against the global and static variables
+// of their process. Only variables with samples are inserted into allocations, as ALLOCATION_EVENT_STATIC
+// objects that live during the whole run. The load bases come from the maps snapshots of the tracker.
+void updateStaticObjects(const QString& dir, QSqlDatabase& db)
+{
+  auto objects = readStaticObjects(dir);
+  if(objects.isEmpty())
+  {
+    return;
+  }
+  AllocationInserter inserter;
+  prepareAllocationInserter(inserter);
+  QSqlQuery selectSamples;
+  prepare(selectSamples,"select samples.id, threads.pid, samples.to_ip from samples join threads on threads.id = samples.thread_id \
+  where (samples.allocation_id is NULL or samples.allocation_id = 1) and samples.evsel_id in \
+  (select id from selected_events where name like 'cpu/mem-loads%' or name like 'cpu/mem-stores%')");
+  QSqlQuery updateSample;
+  prepare(updateSample,"update samples set allocation_id = ? where id = ?");
+  QVariantList allocIds;
+  QVariantList sampleIds;
+  db.exec("BEGIN TRANSACTION");
+  selectSamples.exec();
+  while(selectSamples.next())
+  {
+    const int pid = selectSamples.value(1).toInt();
+    auto processObjects = objects.find(pid);
+    if(processObjects == objects.end())
+    {
+      continue;
+    }
+    const auto address = static_cast<unsigned long long>(selectSamples.value(2).toLongLong());
+    auto& list = processObjects.value();
+    auto o = std::upper_bound(list.begin(),list.end(),address,[](unsigned long long value, const StaticObject& so){return value < so.start;});
+    if(o == list.begin() || address >= (--o)->end)
+    {
+      continue;
+    }
+    if(o->allocationId == -1)
+    {
+      AllocationInfoRaw ao;
+      ao.cpu = 0;
+      ao.pid = pid;
+      ao.tid = pid;
+      ao.size = o->end - o->start;
+      ao.type = ALLOCATION_EVENT_STATIC;
+      ao.address = o->start;
+      ao.timestamp = 0;
+      ao.callpathId = 0;
+      ao.name = o->name;
+      insertAllocation(ao,getThreadId(inserter,pid,pid,db),inserter.insertAllocation);
+      o->allocationId = getLastInsertedId(db);
+    }
+    allocIds << o->allocationId;
+    sampleIds << selectSamples.value(0);
+  }
+  selectSamples.finish();
+  updateSample.addBindValue(allocIds);
+  updateSample.addBindValue(sampleIds);
+  updateSample.execBatch();
+  db.exec("END TRANSACTION");
+}
+
 void createViews(QSqlDatabase& db)
 {
   const QString minSamplesStr = "1";
@@ -785,13 +1515,14 @@ void createViews(QSqlDatabase& db)
 
   db.exec(QString("CREATE VIEW IF NOT EXISTS `latency of allocation sites` AS \
   select allocations.call_path_id,  \
-  (select sum(address_end - address_start) / 1024 from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `size[kb]`, \
+  (select cast(sum((address_end - address_start) * sample_weight) / 1024 as integer) from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `size[kb]`, \
   (select tid from threads where id = allocations.thread_id) as tid,\
   count(*) as numSamples, \
   sum(weight) as sumWeight, \
   cast (printf('%.2f', sum(weight)/count(*)) as float) as averageWeight, \
   cast (printf('%.2f', sum(weight)  *100 / (select cast( sum(weight)  as float)  from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float)  as `Latency %`, \
-  cast (printf('%.2f', avg(weight) / (select cast(avg(weight) as float) from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float) as `latency contribution factor` \
+  cast (printf('%.2f', avg(weight) / (select cast(avg(weight) as float) from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float) as `latency contribution factor`, \
+  (select cast(sum(sample_weight) as integer) from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `allocations` \
   from samples left outer join allocations on samples.allocation_id = allocations.id \
   where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%') \
   group by allocations.call_path_id having numSamples >= " % minSamplesStr % " order by sumWeight desc"));
@@ -842,6 +1573,26 @@ void createViews(QSqlDatabase& db)
   'IPC of functions' a inner join 'function profile' b using (symbol_id) inner join 'latency of functions' c using (symbol_id) \
   order by 'execution time %' desc"));
 
+  // The dtlb columns hold perf's bits, the bits are taken from the lookup tables by name. madvise mode 14 = MADV_HUGEPAGE
+  // type 100 + mmap flags, 0x40000 = MAP_HUGETLB
+  db.exec(QString("CREATE VIEW `tlb of allocations` AS \
+  select allocation_id, (address_end - address_start) / 1024 as `size [kb]`, allocations.type, \
+  (allocations.type >= 100 and ((allocations.type - 100) & 262144) != 0) as hugetlb, \
+  (select max(anon_huge_kb) from allocation_page_backing where allocation_page_backing.allocation_id = allocations.id) as `anon huge [kb]`, \
+  (select count(*) from memory_policies join threads policy_thread on policy_thread.id = memory_policies.thread_id \
+   where call = 'madvise' and mode = 14 and policy_thread.pid = allocation_thread.pid and \
+   address < allocations.address_end and address + length > allocations.address_start) as `madvise hugepage`, \
+  count(*) as numSamples, \
+  sum((memory_dtlb_hit_miss & dtlb_miss.id) != 0) as `dtlb misses`, \
+  cast (printf('%.2f', sum((memory_dtlb_hit_miss & dtlb_miss.id) != 0) * 100.0 / count(*)) as float) as `dtlb miss %`, \
+  sum((memory_dtlb & dtlb_walker.id) != 0) as `page walks` \
+  from samples join allocations on samples.allocation_id = allocations.id \
+  join threads allocation_thread on allocation_thread.id = allocations.thread_id \
+  join memory_dtlb_hit_miss dtlb_miss on dtlb_miss.name = 'Miss' \
+  join memory_dtlb dtlb_walker on dtlb_walker.name = 'Hardware Walker' \
+  where allocations.address_end > allocations.address_start \
+  group by allocation_id having count(*) >= " % minSamplesStr % " order by `dtlb misses` desc"));
+
   db.exec((QString("create view 'samples load' as \
   select * from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%')")));
 
@@ -853,17 +1604,62 @@ void createMetadataTable(QSqlDatabase& db)
   db.exec(QString("Create table metadata ( \
   commandline varchar(1000), \
   samplerate int, \
-  min_allocation_size int)"));
+  min_allocation_size int, \
+  dropped_allocation_events bigint, \
+  allocation_sample_interval bigint, \
+  unwinder varchar(20), \
+  stack_depth int, \
+  unwind_ns_per_call real, \
+  tracking_windows text)"));
+}
+
+// Periods in which tracking and sampling were enabled by the control fifo of perfMemPlus,
+// "start-end" in ns separated by commas, empty if the whole run was recorded
+QString readTrackingWindows(QString dir)
+{
+  QStringList windows;
+  const QString suffix = "allocationWindows";
+  QDirIterator it(dir);
+  while(it.hasNext())
+  {
+    it.next();
+    if(it.fileInfo().isFile() && it.fileInfo().suffix() == suffix)
+    {
+      std::ifstream infile(it.fileInfo().filePath().toStdString());
+      unsigned long long start, end;
+      while(infile >> start >> end)
+      {
+        windows << QString::number(start) % "-" % QString::number(end);
+      }
+    }
+  }
+  return windows.join(",");
 }
 
-void fillMetadataTable(QSqlDatabase& db, const QString& cmdline, const int samplerate, const int minAllocationSize)
+void fillMetadataTable(QSqlDatabase& db, const QString& cmdline, const int samplerate, const int minAllocationSize, const QString& unwinder, const int stackDepth, const QHash<QString,unsigned long long>& trackerMetadata, const QString& trackingWindows)
 {
 
-  QSqlQuery q("insert into metadata (commandline, samplerate, min_allocation_size) values (?,?,?)",db);
+  QSqlQuery q("insert into metadata (commandline, samplerate, min_allocation_size, dropped_allocation_events, unwinder, stack_depth, unwind_ns_per_call, allocation_sample_interval, tracking_windows) values (?,?,?,?,?,?,?,?,?)",db);
   q.bindValue(0,cmdline);
   q.bindValue(1,samplerate);
   q.bindValue(2,minAllocationSize);
+  q.bindValue(3,trackerMetadata.value("dropped"));
+  q.bindValue(4,unwinder);
+  q.bindValue(5,stackDepth);
+  double unwindCost = 0;
+  if(trackerMetadata.value("unwind_samples") > 0)
+  {
+    unwindCost = trackerMetadata.value("unwind_ns") / static_cast<double>(trackerMetadata.value("unwind_samples"));
+    std::cout << "Average cost of collecting an allocation call stack: " << unwindCost << " ns\n";
+  }
+  q.bindValue(6,unwindCost);
+  q.bindValue(7,allocationSampleInterval);
+  q.bindValue(8,trackingWindows);
   q.exec();
+  if(trackerMetadata.value("dropped") > 0)
+  {
+    std::cout << "Warning: the allocation tracker dropped " << trackerMetadata.value("dropped") << " events\n";
+  }
 }
 
 QHash<unsigned int, QList<unsigned int>> readCpuNodeMapping()
@@ -941,6 +1737,12 @@ int main(int argc, char *argv[])
   parser.addOption(cmdlineOpt);
   QCommandLineOption allocationDataOpt("allocData","Directory where allocation data is stored","allocData","/tmp");
   parser.addOption(allocationDataOpt);
+  QCommandLineOption sampleIntervalOpt("allocationSampleInterval","Mean number of bytes between two sampled allocations, 0 if all allocations are tracked","bytes","0");
+  parser.addOption(sampleIntervalOpt);
+  QCommandLineOption unwinderOpt("unwinder","Unwinder used by the allocation tracker","unwinder","backtrace");
+  parser.addOption(unwinderOpt);
+  QCommandLineOption stackDepthOpt("stackDepth","Stack depth used by the allocation tracker","stackDepth","9");
+  parser.addOption(stackDepthOpt);
   QCommandLineOption dramBandwidthOpt("dramBandwidth","Process data for dram bandwidth");
   parser.addOption(dramBandwidthOpt);
   QCommandLineOption l1MissLatencyOpt("l1MissLatency","Process data for l1Miss latency");
@@ -961,6 +1763,9 @@ int main(int argc, char *argv[])
   auto cmdline = parser.value(cmdlineOpt);
   auto samplerate = parser.value(samplerateOpt).toInt();
   auto minAllocationSize = parser.value(minAllocationSizeOpt).toInt();
+  allocationSampleInterval = parser.value(sampleIntervalOpt).toULongLong();
+  auto unwinder = parser.value(unwinderOpt);
+  auto stackDepth = parser.value(stackDepthOpt).toInt();
   auto dramBandwidth = parser.isSet(dramBandwidthOpt);
   auto l1MissLatency = parser.isSet(l1MissLatencyOpt);
 
@@ -970,15 +1775,29 @@ int main(int argc, char *argv[])
   db.open();
   sqlitePerformanceSettings(db);
   createMetadataTable(db);
-  fillMetadataTable(db,cmdline,samplerate,minAllocationSize);
+  auto trackerMetadata = readAllocationTrackerMetadata(allocationDataDir);
+  fillMetadataTable(db,cmdline,samplerate,minAllocationSize,unwinder,stackDepth,trackerMetadata,readTrackingWindows(allocationDataDir));
   createAllocationsTable(db);
   createAllocationsSymbolsTable(db);
   createAllocationsCallpathTable(db);
   readAllocationTrackerFiles(allocationDataDir,db);
+  createPageTables(db);
+  readPageFiles(allocationDataDir,db);
   std::cout << getTime() << " Reading files complete. Updating samples table..." << std::endl;
   modifySamplesTable();
   updateRelationshipKeys(db);
+  updateStaticObjects(allocationDataDir,db);
   createViews(db);
+  try
+  {
+    SampleColumns::write(dbname + ".columns",db);
+  }
+  catch(const std::runtime_error& e)
+  {
+    // The columns only speed up scans, the database is complete without them
+    QFile::remove(dbname + ".columns");
+    std::cout << "Warning: sample columns not written: " << e.what() << "\n";
+  }
 
   std::cout << getTime() << " Update of samples table complete. Calculating counter metrics..." << std::endl;
   auto mapping = readCpuNodeMapping();
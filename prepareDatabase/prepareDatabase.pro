@@ -15,10 +15,21 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+INCLUDEPATH += ../allocationTracker
+
 SOURCES += main.cpp \
     address2Line.cpp \
-    counterattributes.cpp
+    allocationfilereader.cpp \
+    counterattributes.cpp \
+    processmaps.cpp \
+    samplecolumns.cpp \
+    staticsymbols.cpp
 
 HEADERS += \
     address2Line.h \
-    counterattributes.h
+    allocationfilereader.h \
+    ../allocationTracker/allocationformat.h \
+    counterattributes.h \
+    processmaps.h \
+    samplecolumns.h \
+    staticsymbols.h
@@ -0,0 +1,140 @@
+#include "processmaps.h"
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <algorithm>
+#include <elf.h>
+
+QHash<QString,ProcessMaps> ProcessMaps::readAll(const QString& dir)
+{
+  QHash<QString,ProcessMaps> maps;
+  const QString suffix = "allocationMaps";
+  QDirIterator it(dir);
+  while(it.hasNext())
+  {
+    it.next();
+    if(it.fileInfo().isFile() && it.fileInfo().suffix() == suffix)
+    {
+      maps[it.fileInfo().completeBaseName()].read(it.fileInfo().filePath());
+    }
+  }
+  return maps;
+}
+
+void ProcessMaps::read(const QString& file)
+{
+  QFile f(file);
+  if(!f.open(QIODevice::ReadOnly | QIODevice::Text))
+  {
+    return;
+  }
+  QTextStream in(&f);
+  while(!in.atEnd())
+  {
+    auto line = in.readLine();
+    auto parts = line.split(' ');
+    if(parts.size() < 5)
+    {
+      continue;
+    }
+    Mapping m;
+    m.start = parts.at(0).toULongLong(nullptr,16);
+    m.end = parts.at(1).toULongLong(nullptr,16);
+    m.offset = parts.at(2).toULongLong(nullptr,16);
+    m.buildId = parts.at(3) == QLatin1String("-") ? QString() : parts.at(3);
+    // the path is the rest of the line and may contain spaces
+    m.path = line.section(' ',4);
+    mappings.push_back(m);
+  }
+  std::sort(mappings.begin(),mappings.end(),[](const Mapping& a, const Mapping& b){return a.start < b.start;});
+}
+
+const ProcessMaps::Mapping* ProcessMaps::find(unsigned long long ip) const
+{
+  auto it = std::upper_bound(mappings.begin(),mappings.end(),ip,[](unsigned long long value, const Mapping& m){return value < m.start;});
+  if(it == mappings.begin())
+  {
+    return nullptr;
+  }
+  --it;
+  if(ip < it->end)
+  {
+    return &(*it);
+  }
+  return nullptr;
+}
+
+unsigned long long ProcessMaps::fileAddress(const Mapping& mapping, unsigned long long ip)
+{
+  return ip - loadBias(mapping);
+}
+
+unsigned long long ProcessMaps::loadBias(const Mapping& mapping)
+{
+  if(!isRelocatable(mapping.path))
+  {
+    return 0;
+  }
+  return mapping.start - mapping.offset - segmentDelta(mapping.path,mapping.offset);
+}
+
+long long ProcessMaps::segmentDelta(const QString& path, unsigned long long offset)
+{
+  static QHash<QPair<QString,unsigned long long>,long long> cache;
+  const auto key = qMakePair(path,offset);
+  auto it = cache.find(key);
+  if(it != cache.end())
+  {
+    return it.value();
+  }
+  // p_vaddr - p_offset of the loadable segment that contains the mapped file offset.
+  // Files that can not be read are not symbolized, they keep a delta of 0.
+  long long delta = 0;
+  QFile f(path);
+  Elf64_Ehdr header;
+  if(f.open(QIODevice::ReadOnly) && f.read(reinterpret_cast<char*>(&header),sizeof(header)) == sizeof(header) &&
+     header.e_phentsize == sizeof(Elf64_Phdr) && f.seek(header.e_phoff))
+  {
+    for(int i = 0; i < header.e_phnum; i++)
+    {
+      Elf64_Phdr ph;
+      if(f.read(reinterpret_cast<char*>(&ph),sizeof(ph)) != sizeof(ph))
+      {
+        break;
+      }
+      const unsigned long long segmentStart = ph.p_offset & ~4095ULL;
+      if(ph.p_type == PT_LOAD && offset >= segmentStart && offset < ph.p_offset + ph.p_filesz)
+      {
+        delta = static_cast<long long>(ph.p_vaddr - ph.p_offset);
+        break;
+      }
+    }
+  }
+  cache.insert(key,delta);
+  return delta;
+}
+
+const std::vector<ProcessMaps::Mapping>& ProcessMaps::all() const
+{
+  return mappings;
+}
+
+bool ProcessMaps::isRelocatable(const QString& path)
+{
+  static QHash<QString,bool> cache;
+  auto it = cache.find(path);
+  if(it != cache.end())
+  {
+    return it.value();
+  }
+  bool relocatable = true;
+  QFile f(path);
+  Elf64_Ehdr header;
+  if(f.open(QIODevice::ReadOnly) && f.read(reinterpret_cast<char*>(&header),sizeof(header)) == sizeof(header))
+  {
+    relocatable = header.e_type == ET_DYN;
+  }
+  cache.insert(path,relocatable);
+  return relocatable;
+}
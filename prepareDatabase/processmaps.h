@@ -0,0 +1,39 @@
+#ifndef PROCESSMAPS_H
+#define PROCESSMAPS_H
+
+#include <QString>
+#include <QHash>
+#include <QPair>
+#include <vector>
+
+// Snapshot of the executable mappings of a process written by the allocation tracker
+// Used to symbolize allocation call stacks offline
+class ProcessMaps
+{
+public:
+  struct Mapping
+  {
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long offset;
+    QString buildId;
+    QString path;
+  };
+
+  // Reads all <image>.allocationMaps files of a directory, key is the image name (pid or pid-<exec count>)
+  static QHash<QString,ProcessMaps> readAll(const QString& dir);
+  void read(const QString& file);
+  const Mapping* find(unsigned long long ip) const;
+  // Address of ip inside the object file of the mapping, as expected by addr2line
+  static unsigned long long fileAddress(const Mapping& mapping, unsigned long long ip);
+  // Difference between run time and link time addresses of the object file of the mapping
+  static unsigned long long loadBias(const Mapping& mapping);
+  const std::vector<Mapping>& all() const;
+
+private:
+  std::vector<Mapping> mappings; // sorted by start address
+  static bool isRelocatable(const QString& path);
+  static long long segmentDelta(const QString& path, unsigned long long offset);
+};
+
+#endif // PROCESSMAPS_H
@@ -0,0 +1,338 @@
+#include "samplecolumns.h"
+#include <QHash>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringList>
+#include <QVariant>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+struct ColumnSpec
+{
+  const char* name;
+  uint32_t width;
+  bool dictionary;
+};
+
+const ColumnSpec columnSpecs[] = {
+  {"id",8,false},
+  {"time",8,false},
+  {"ip",8,false},
+  {"to_ip",8,false},
+  {"weight",4,false},
+  {"evsel_id",1,true},
+  {"memory_level",1,true},
+  {"memory_snoop",1,true},
+  {"memory_opcode",1,true},
+  {"thread_id",4,false},
+  {"cpu",2,false},
+  {"symbol_id",4,false},
+  {"allocation_id",4,false},
+};
+
+const uint32_t columnCount = sizeof(columnSpecs) / sizeof(columnSpecs[0]);
+const uint64_t blockRows = 65536;
+const uint32_t maxDictionarySize = 256;
+
+uint64_t align(uint64_t offset)
+{
+  return (offset + 63) & ~63ULL;
+}
+
+uint64_t largestValue(uint32_t width)
+{
+  return width == 8 ? UINT64_MAX : (1ULL << (8 * width)) - 1;
+}
+
+// No branches in the loop, the compiler vectorizes it
+template<typename T>
+void filterValues(const T* values, uint64_t count, uint64_t min, uint64_t max, uint8_t* mask)
+{
+  for(uint64_t i = 0; i < count; i++)
+  {
+    mask[i] &= (values[i] >= min) & (values[i] <= max);
+  }
+}
+}
+
+void SampleColumns::write(const QString& path, QSqlDatabase& db)
+{
+  QSqlQuery count(db);
+  if(!count.exec("select count(*) from samples") || !count.next())
+  {
+    throw std::runtime_error("Can not count samples: " + count.lastError().text().toStdString());
+  }
+  const uint64_t rows = count.value(0).toULongLong();
+  const uint64_t blocks = (rows + blockRows - 1) / blockRows;
+
+  std::vector<ColumnInfo> infos(columnCount);
+  QStringList names;
+  uint64_t size = sizeof(Header) + columnCount * sizeof(ColumnInfo);
+  for(uint32_t c = 0; c < columnCount; c++)
+  {
+    ColumnInfo& info = infos[c];
+    memset(&info,0,sizeof(info));
+    strncpy(info.name,columnSpecs[c].name,sizeof(info.name) - 1);
+    info.width = columnSpecs[c].width;
+    info.data = align(size);
+    size = info.data + rows * info.width;
+    info.zones = align(size);
+    size = info.zones + blocks * 2 * sizeof(uint64_t);
+    if(columnSpecs[c].dictionary)
+    {
+      info.dictionary = align(size);
+      size = info.dictionary + maxDictionarySize * sizeof(int64_t);
+    }
+    names << columnSpecs[c].name;
+  }
+
+  QFile file(path);
+  if(!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !file.resize(size))
+  {
+    throw std::runtime_error("Can not create sample columns " + path.toStdString());
+  }
+  uint8_t* out = file.map(0,size);
+  if(out == nullptr)
+  {
+    throw std::runtime_error("Can not map sample columns " + path.toStdString());
+  }
+
+  QSqlQuery select(db);
+  select.setForwardOnly(true);
+  if(!select.exec("select " + names.join(',') + " from samples order by id"))
+  {
+    throw std::runtime_error("Can not read samples: " + select.lastError().text().toStdString());
+  }
+  std::vector<QHash<long long,uint64_t>> codes(columnCount);
+  std::vector<std::vector<int64_t>> dictionaries(columnCount);
+  uint64_t row = 0;
+  while(select.next() && row < rows)
+  {
+    const uint64_t block = row / blockRows;
+    for(uint32_t c = 0; c < columnCount; c++)
+    {
+      const ColumnInfo& info = infos[c];
+      const long long value = select.value(c).toLongLong(); // NULL is 0
+      uint64_t stored;
+      if(columnSpecs[c].dictionary)
+      {
+        auto code = codes[c].find(value);
+        if(code == codes[c].end())
+        {
+          if(dictionaries[c].size() == maxDictionarySize)
+          {
+            throw std::runtime_error(std::string("Too many distinct values in samples column ") + info.name);
+          }
+          code = codes[c].insert(value,dictionaries[c].size());
+          dictionaries[c].push_back(value);
+        }
+        stored = code.value();
+      }
+      else
+      {
+        stored = std::min(static_cast<uint64_t>(value),largestValue(info.width));
+      }
+      // Little endian, the low bytes hold the value
+      memcpy(out + info.data + row * info.width,&stored,info.width);
+      uint64_t zone[2];
+      memcpy(zone,out + info.zones + block * sizeof(zone),sizeof(zone));
+      if(row % blockRows == 0)
+      {
+        zone[0] = zone[1] = stored;
+      }
+      else
+      {
+        zone[0] = std::min(zone[0],stored);
+        zone[1] = std::max(zone[1],stored);
+      }
+      memcpy(out + info.zones + block * sizeof(zone),zone,sizeof(zone));
+    }
+    row++;
+  }
+  if(row != rows)
+  {
+    throw std::runtime_error("Samples table changed while writing " + path.toStdString());
+  }
+
+  for(uint32_t c = 0; c < columnCount; c++)
+  {
+    infos[c].dictionarySize = dictionaries[c].size();
+    if(!dictionaries[c].empty())
+    {
+      memcpy(out + infos[c].dictionary,dictionaries[c].data(),dictionaries[c].size() * sizeof(int64_t));
+    }
+  }
+  Header header;
+  memcpy(header.magic,"PMPCOLS1",sizeof(header.magic));
+  header.version = version;
+  header.columns = columnCount;
+  header.rows = rows;
+  header.blockRows = blockRows;
+  memcpy(out,&header,sizeof(header));
+  memcpy(out + sizeof(header),infos.data(),columnCount * sizeof(ColumnInfo));
+  file.unmap(out);
+}
+
+SampleColumns::SampleColumns(const QString& path) : file(path)
+{
+  if(!file.open(QIODevice::ReadOnly))
+  {
+    throw std::runtime_error("Can not open sample columns " + path.toStdString());
+  }
+  const uint64_t size = file.size();
+  if(size < sizeof(Header))
+  {
+    throw std::runtime_error("Sample columns file too short " + path.toStdString());
+  }
+  data = file.map(0,size);
+  if(data == nullptr)
+  {
+    throw std::runtime_error("Can not map sample columns " + path.toStdString());
+  }
+  memcpy(&header,data,sizeof(header));
+  if(memcmp(header.magic,"PMPCOLS1",sizeof(header.magic)) != 0)
+  {
+    throw std::runtime_error("Not a sample columns file " + path.toStdString());
+  }
+  if(header.version != version)
+  {
+    throw std::runtime_error("Unsupported sample columns version " + std::to_string(header.version));
+  }
+  if(header.blockRows == 0 || sizeof(Header) + header.columns * sizeof(ColumnInfo) > size)
+  {
+    throw std::runtime_error("Corrupt sample columns file " + path.toStdString());
+  }
+  columns.resize(header.columns);
+  memcpy(columns.data(),data + sizeof(Header),header.columns * sizeof(ColumnInfo));
+  const uint64_t blocks = (header.rows + header.blockRows - 1) / header.blockRows;
+  for(auto& c : columns)
+  {
+    c.name[sizeof(c.name) - 1] = '\0';
+    if((c.width != 1 && c.width != 2 && c.width != 4 && c.width != 8) || c.data % c.width != 0 ||
+       c.data + header.rows * c.width > size || c.zones % 8 != 0 || c.zones + blocks * 16 > size ||
+       c.dictionarySize > maxDictionarySize || c.dictionary + c.dictionarySize * sizeof(int64_t) > size)
+    {
+      throw std::runtime_error("Corrupt sample columns file " + path.toStdString());
+    }
+  }
+}
+
+unsigned long long SampleColumns::rows() const
+{
+  return header.rows;
+}
+
+const SampleColumns::ColumnInfo* SampleColumns::column(const char* name) const
+{
+  for(const auto& c : columns)
+  {
+    if(strcmp(c.name,name) == 0)
+    {
+      return &c;
+    }
+  }
+  return nullptr;
+}
+
+uint64_t SampleColumns::value(const ColumnInfo& column, unsigned long long row) const
+{
+  uint64_t value = 0;
+  memcpy(&value,data + column.data + row * column.width,column.width);
+  return value;
+}
+
+long long SampleColumns::decode(const ColumnInfo& column, unsigned long long row) const
+{
+  const uint64_t stored = value(column,row);
+  if(column.dictionarySize == 0)
+  {
+    return static_cast<long long>(stored);
+  }
+  return dictionaryValue(column,stored);
+}
+
+long long SampleColumns::dictionaryValue(const ColumnInfo& column, uint64_t code) const
+{
+  int64_t value = 0;
+  if(code < column.dictionarySize)
+  {
+    memcpy(&value,data + column.dictionary + code * sizeof(int64_t),sizeof(value));
+  }
+  return value;
+}
+
+long long SampleColumns::encode(const ColumnInfo& column, long long value) const
+{
+  if(column.dictionarySize == 0)
+  {
+    return value;
+  }
+  const int64_t* dictionary = reinterpret_cast<const int64_t*>(data + column.dictionary);
+  auto code = std::find(dictionary,dictionary + column.dictionarySize,value);
+  return code == dictionary + column.dictionarySize ? -1 : code - dictionary;
+}
+
+void SampleColumns::filter(const ColumnInfo& column, uint64_t min, uint64_t max, std::vector<uint8_t>& mask) const
+{
+  mask.resize(header.rows,1);
+  const uint64_t* zones = reinterpret_cast<const uint64_t*>(data + column.zones);
+  for(uint64_t begin = 0, block = 0; begin < header.rows; begin += header.blockRows, block++)
+  {
+    const uint64_t count = std::min<uint64_t>(header.blockRows,header.rows - begin);
+    const uint64_t zoneMin = zones[2 * block];
+    const uint64_t zoneMax = zones[2 * block + 1];
+    if(zoneMax < min || zoneMin > max)
+    {
+      memset(mask.data() + begin,0,count);
+      continue;
+    }
+    if(zoneMin >= min && zoneMax <= max)
+    {
+      continue;
+    }
+    const uint8_t* values = data + column.data + begin * column.width;
+    switch(column.width)
+    {
+    case 1:
+      filterValues(values,count,min,max,mask.data() + begin);
+      break;
+    case 2:
+      filterValues(reinterpret_cast<const uint16_t*>(values),count,min,max,mask.data() + begin);
+      break;
+    case 4:
+      filterValues(reinterpret_cast<const uint32_t*>(values),count,min,max,mask.data() + begin);
+      break;
+    default:
+      filterValues(reinterpret_cast<const uint64_t*>(values),count,min,max,mask.data() + begin);
+      break;
+    }
+  }
+}
+
+void SampleColumns::filterIn(const ColumnInfo& column, std::vector<uint64_t> values, std::vector<uint8_t>& mask) const
+{
+  mask.resize(header.rows,1);
+  std::sort(values.begin(),values.end());
+  const uint64_t* zones = reinterpret_cast<const uint64_t*>(data + column.zones);
+  for(uint64_t begin = 0, block = 0; begin < header.rows; begin += header.blockRows, block++)
+  {
+    const uint64_t count = std::min<uint64_t>(header.blockRows,header.rows - begin);
+    // Skip blocks without any of the values in their range
+    auto first = std::lower_bound(values.begin(),values.end(),zones[2 * block]);
+    if(first == values.end() || *first > zones[2 * block + 1])
+    {
+      memset(mask.data() + begin,0,count);
+      continue;
+    }
+    for(uint64_t row = begin; row < begin + count; row++)
+    {
+      if(mask[row] && !std::binary_search(values.begin(),values.end(),value(column,row)))
+      {
+        mask[row] = 0;
+      }
+    }
+  }
+}
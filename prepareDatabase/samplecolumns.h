@@ -0,0 +1,80 @@
+#ifndef SAMPLECOLUMNS_H
+#define SAMPLECOLUMNS_H
+
+#include <QFile>
+#include <QString>
+#include <QSqlDatabase>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Columnar copy of the samples table, written by prepareDatabase next to the
+ * database as <database>.columns. Scans over many samples can read the mapped
+ * columns instead of going through sqlite, the database stays the reference
+ * for everything else.
+ *
+ * The file starts with struct Header followed by one struct ColumnInfo per
+ * column. Every column holds one fixed width little endian value per sample,
+ * in the order of samples.id, and starts 64 byte aligned:
+ *    id, time, ip, to_ip: 8 bytes
+ *    weight, thread_id, symbol_id, allocation_id: 4 bytes (NULL is 0)
+ *    cpu: 2 bytes
+ *    evsel_id, memory_level, memory_snoop, memory_opcode: 1 byte dictionary code,
+ *    the dictionary of the column holds the database value of every code
+ * Values that do not fit the width are stored as the largest value of the width.
+ * For every block of blockRows samples the zone map of a column holds the
+ * minimum and maximum stored value, blocks that can not match are skipped.
+ */
+class SampleColumns
+{
+public:
+  static const uint32_t version = 1;
+
+  struct Header
+  {
+    char magic[8]; // "PMPCOLS1"
+    uint32_t version;
+    uint32_t columns;
+    uint64_t rows;
+    uint64_t blockRows;
+  };
+
+  struct ColumnInfo
+  {
+    char name[16]; // column of the samples table, 0 terminated
+    uint32_t width; // bytes per value
+    uint32_t dictionarySize; // 0 if the values are stored directly
+    uint64_t data; // file offset of the values
+    uint64_t dictionary; // file offset of dictionarySize int64_t database values
+    uint64_t zones; // file offset of (min, max) uint64_t pairs, one per block
+  };
+
+  // Writes the sidecar of the samples table of db to path, throws std::runtime_error on errors
+  static void write(const QString& path, QSqlDatabase& db);
+
+  explicit SampleColumns(const QString& path);
+  unsigned long long rows() const;
+  // nullptr if the file has no such column
+  const ColumnInfo* column(const char* name) const;
+  // Stored value (dictionary code for dictionary columns) of a row
+  uint64_t value(const ColumnInfo& column, unsigned long long row) const;
+  // Database value of a row
+  long long decode(const ColumnInfo& column, unsigned long long row) const;
+  // Database value of a dictionary code
+  long long dictionaryValue(const ColumnInfo& column, uint64_t code) const;
+  // Stored value of a database value, -1 if no sample has it
+  long long encode(const ColumnInfo& column, long long value) const;
+  // Clears mask[row] of all rows whose stored value is outside [min, max]
+  // An empty mask is filled with 1 for every row, filters on several columns are combined by passing the same mask
+  void filter(const ColumnInfo& column, uint64_t min, uint64_t max, std::vector<uint8_t>& mask) const;
+  // Clears mask[row] of all rows whose stored value is not one of values
+  void filterIn(const ColumnInfo& column, std::vector<uint64_t> values, std::vector<uint8_t>& mask) const;
+
+private:
+  QFile file;
+  const uint8_t* data = nullptr;
+  Header header;
+  std::vector<ColumnInfo> columns;
+};
+
+#endif // SAMPLECOLUMNS_H
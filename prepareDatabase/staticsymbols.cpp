@@ -0,0 +1,80 @@
+#include "staticsymbols.h"
+#include <QFile>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <elf.h>
+
+static QString demangle(const char* name)
+{
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(name,nullptr,nullptr,&status);
+  if(demangled == nullptr)
+  {
+    return QString::fromLatin1(name);
+  }
+  QString result = QString::fromLatin1(demangled);
+  free(demangled);
+  return result;
+}
+
+std::vector<StaticSymbols::Symbol> StaticSymbols::read(const QString& path)
+{
+  std::vector<Symbol> symbols;
+  QFile f(path);
+  if(!f.open(QIODevice::ReadOnly))
+  {
+    return symbols;
+  }
+  const auto size = static_cast<unsigned long long>(f.size());
+  const uint8_t* data = size >= sizeof(Elf64_Ehdr) ? f.map(0,f.size()) : nullptr;
+  if(data == nullptr)
+  {
+    return symbols;
+  }
+  Elf64_Ehdr header;
+  memcpy(&header,data,sizeof(header));
+  if(memcmp(header.e_ident,ELFMAG,SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64 ||
+     header.e_shentsize != sizeof(Elf64_Shdr) || header.e_shoff + header.e_shnum * sizeof(Elf64_Shdr) > size)
+  {
+    return symbols;
+  }
+  const auto* sections = reinterpret_cast<const Elf64_Shdr*>(data + header.e_shoff);
+  const Elf64_Shdr* symtab = nullptr;
+  for(int i = 0; i < header.e_shnum; i++)
+  {
+    if(sections[i].sh_type == SHT_SYMTAB || (sections[i].sh_type == SHT_DYNSYM && symtab == nullptr))
+    {
+      symtab = &sections[i];
+    }
+  }
+  if(symtab == nullptr || symtab->sh_link >= header.e_shnum || symtab->sh_entsize != sizeof(Elf64_Sym) ||
+     symtab->sh_offset + symtab->sh_size > size)
+  {
+    return symbols;
+  }
+  const Elf64_Shdr& strtab = sections[symtab->sh_link];
+  if(strtab.sh_offset + strtab.sh_size > size)
+  {
+    return symbols;
+  }
+  const char* names = reinterpret_cast<const char*>(data + strtab.sh_offset);
+  const auto* syms = reinterpret_cast<const Elf64_Sym*>(data + symtab->sh_offset);
+  const auto numSyms = symtab->sh_size / sizeof(Elf64_Sym);
+  for(unsigned long long i = 0; i < numSyms; i++)
+  {
+    const Elf64_Sym& sym = syms[i];
+    // thread local variables have no fixed address
+    if(ELF64_ST_TYPE(sym.st_info) != STT_OBJECT || sym.st_size == 0 ||
+       sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE || sym.st_name >= strtab.sh_size)
+    {
+      continue;
+    }
+    symbols.push_back({sym.st_value,sym.st_size,demangle(names + sym.st_name)});
+  }
+  // Aliases keep the name that comes first in the symbol table
+  std::stable_sort(symbols.begin(),symbols.end(),[](const Symbol& a, const Symbol& b){return a.address < b.address;});
+  symbols.erase(std::unique(symbols.begin(),symbols.end(),[](const Symbol& a, const Symbol& b){return a.address == b.address;}),symbols.end());
+  return symbols;
+}
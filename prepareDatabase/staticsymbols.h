@@ -0,0 +1,24 @@
+#ifndef STATICSYMBOLS_H
+#define STATICSYMBOLS_H
+
+#include <QString>
+#include <vector>
+
+// Global and static variables of an ELF object file
+// Used to attribute samples that hit no tracked allocation
+class StaticSymbols
+{
+public:
+  struct Symbol
+  {
+    unsigned long long address; // link time address, add the load bias of the object
+    unsigned long long size;
+    QString name;
+  };
+
+  // STT_OBJECT symbols of .symtab, of .dynsym if the file is stripped, sorted by address
+  // Aliases of the same variable are returned once
+  static std::vector<Symbol> read(const QString& path);
+};
+
+#endif // STATICSYMBOLS_H
@@ -8,6 +8,7 @@
 #include "pdfwriter.h"
 #include "timelinewindow.h"
 #include "memorycoherencywindow.h"
+#include "sqlutils.h"
 #include "graphwindow.h"
 #include "guiutils.h"
 #include "autoanalysis.h"
@@ -98,6 +99,7 @@ void AnalysisMain::loadDatabase(const QString& path, const bool headless)
   modelObjectsAllocationSites->setHeaderData(5, Qt::Horizontal, tr("Average Latency"));
   modelObjectsAllocationSites->setHeaderData(6, Qt::Horizontal, tr("Latency %"));
   modelObjectsAllocationSites->setHeaderData(7, Qt::Horizontal, tr("Latency Factor"));
+  modelObjectsAllocationSites->setHeaderData(8, Qt::Horizontal, tr("Allocations"));
 
   if (!modelObjectsAllocationSites->select())
   {
@@ -343,19 +345,24 @@ void AnalysisMain::on_showAccessTimelinePushButton_clicked()
 void AnalysisMain::createViews()
 {
   const QString minSamplesStr = "5";
+  // sampled allocations are upscaled by their weight
+  const bool sampled = SqlUtils::columnExists("allocations","sample_weight");
+  const QString sizeStr = sampled ?
+        "cast(sum((address_end - address_start) * sample_weight) / 1024 as integer)" : "sum(address_end - address_start) / 1024";
+  const QString countStr = sampled ? "cast(sum(sample_weight) as integer)" : "count(*)";
   QSqlQuery q(QString("CREATE VIEW IF NOT EXISTS `latency of allocation sites` AS \
          select allocations.call_path_id,  \
-         (select sum(address_end - address_start) / 1024 from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `size[kb]`, \
+         (select " + sizeStr + " from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `size[kb]`, \
          (select tid from threads where id = allocations.thread_id) as tid,\
          count(*) as numSamples, \
          sum(weight) as sumWeight, \
          cast (printf('%.2f', sum(weight)/count(*)) as float) as averageWeight, \
          cast (printf('%.2f', sum(weight)  *100 / (select cast( sum(weight)  as float)  from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float)  as `Latency %`, \
-         cast (printf('%.2f', avg(weight) / (select cast(avg(weight) as float) from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float) as `latency contribution factor` \
+         cast (printf('%.2f', avg(weight) / (select cast(avg(weight) as float) from samples where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%'))) as float) as `latency contribution factor`, \
+         (select " + countStr + " from allocations inq where inq.call_path_id = allocations.call_path_id group by inq.call_path_id) as `allocations` \
          from samples left outer join allocations on samples.allocation_id = allocations.id \
          where evsel_id = (select id from selected_events where name like 'cpu/mem-loads%') \
          group by allocations.call_path_id having numSamples >= " + minSamplesStr + " order by sumWeight desc"));
-  q.exec();
 }
 
 void AnalysisMain::changeModel(QTableView* view, QAbstractItemModel* model, QItemSelectionModel* selectionModel)
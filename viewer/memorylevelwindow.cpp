@@ -4,6 +4,10 @@
 #include "pdfwriter.h"
 #include "sqlutils.h"
 #include "guiutils.h"
+#include "samplecolumns.h"
+#include <QStandardItemModel>
+#include <memory>
+#include <stdexcept>
 
 MemoryLevelWindow::MemoryLevelWindow(QWidget *parent) :
 QDialog(parent),
@@ -40,12 +44,17 @@ ui(new Ui::MemoryLevelWindow)
   this->functionsObjects = fo;
   ui->selectedItemsListWidget->addItems(items);
   QSqlQueryModel* model = new QSqlQueryModel;
+  QAbstractItemModel* levels = model;
   if(fo == Functions)
   {
     this->functionItems = items;
     ui->label->setText("Selected\nfunctions");
     auto sqlItems = SqlUtils::makeSqlStringFunctions(items);
-    model->setQuery("select (select name from memory_levels where id = memory_level) as lvl, count (*) as \"count\", \
+    levels = levelsOfFunctionsFromColumns(dbPath,sqlItems);
+    if(levels == nullptr)
+    {
+      levels = model;
+      model->setQuery("select (select name from memory_levels where id = memory_level) as lvl, count (*) as \"count\", \
     avg(weight) as \"average latency\", \
     count(*) * 100.0 / (select count(*) from samples where evsel_id = (select id from selected_events where name like \"cpu/mem-loads%\") \
     and symbol_id in (select id from symbols where name = " + sqlItems + " ) )as \"hit rate %\" \
@@ -53,6 +62,11 @@ ui(new Ui::MemoryLevelWindow)
     where evsel_id = (select id from selected_events where name like \"cpu/mem-loads%\") \
     and symbol_id in (select id from symbols where name = " + sqlItems + " ) \
     group by lvl order by memory_level asc");
+    }
+    else
+    {
+      delete model;
+    }
     printRemoteMemoryAccessFunctions(items);
     printRemoteMemoryAccessFunctionsInclCache(items);
   }
@@ -72,15 +86,15 @@ ui(new Ui::MemoryLevelWindow)
     printRemoteMemoryAccessObjects(items);
     printRemoteMemoryAccessObjectsInclCache(items);
   }
-  if (model->lastError().isValid())
+  if (levels == model && model->lastError().isValid())
   {
     qDebug() << model->lastError();
   }
-  model->setHeaderData(0,Qt::Horizontal, "Memory Level");
-  model->setHeaderData(1,Qt::Horizontal, "Count");
-  model->setHeaderData(2,Qt::Horizontal, "Average Latency");
-  model->setHeaderData(3,Qt::Horizontal, "Hit Rate");
-  ui->memoryLevelTableView->setModel(model);
+  levels->setHeaderData(0,Qt::Horizontal, "Memory Level");
+  levels->setHeaderData(1,Qt::Horizontal, "Count");
+  levels->setHeaderData(2,Qt::Horizontal, "Average Latency");
+  levels->setHeaderData(3,Qt::Horizontal, "Hit Rate");
+  ui->memoryLevelTableView->setModel(levels);
   ui->memoryLevelTableView->setItemDelegateForColumn(3,new PercentDelegate(ui->memoryLevelTableView));
   GuiUtils::resizeColumnsToContents(ui->memoryLevelTableView);
 
@@ -136,6 +150,104 @@ ui(new Ui::MemoryLevelWindow)
   ui->memoryLevelTableView->show();
 }
 
+// Same rows as the query over samples, counted on the columns file that prepareDatabase writes next to
+// the database. Returns nullptr if there is no columns file or it does not belong to the database.
+QAbstractItemModel* MemoryLevelWindow::levelsOfFunctionsFromColumns(const QString& dbPath, const QString& sqlItems)
+{
+  const QString path = dbPath + ".columns";
+  if(!QFile::exists(path))
+  {
+    return nullptr;
+  }
+  std::unique_ptr<SampleColumns> columns;
+  try
+  {
+    columns.reset(new SampleColumns(path));
+  }
+  catch(const std::runtime_error& e)
+  {
+    qDebug() << e.what();
+    return nullptr;
+  }
+  const auto* id = columns->column("id");
+  const auto* evsel = columns->column("evsel_id");
+  const auto* symbol = columns->column("symbol_id");
+  const auto* level = columns->column("memory_level");
+  const auto* weight = columns->column("weight");
+  if(id == nullptr || evsel == nullptr || symbol == nullptr || level == nullptr || weight == nullptr)
+  {
+    return nullptr;
+  }
+  // The database was exported again after the columns were written
+  const auto lastId = executeSingleResultQuery("select max(id) from samples");
+  if(columns->rows() == 0 || lastId.toULongLong() != columns->value(*id,columns->rows() - 1))
+  {
+    return nullptr;
+  }
+
+  std::vector<uint8_t> mask;
+  const auto loads = columns->encode(*evsel,executeSingleResultQuery("select id from selected_events where name like \"cpu/mem-loads%\"").toLongLong());
+  if(loads < 0)
+  {
+    mask.assign(columns->rows(),0);
+  }
+  else
+  {
+    columns->filter(*evsel,loads,loads,mask);
+  }
+  std::vector<uint64_t> symbols;
+  QSqlQuery symbolIds("select id from symbols where name = " + sqlItems);
+  while(symbolIds.next())
+  {
+    symbols.push_back(symbolIds.value(0).toULongLong());
+  }
+  columns->filterIn(*symbol,symbols,mask);
+
+  // Indexed by the dictionary code of the memory level
+  std::vector<unsigned long long> count(level->dictionarySize), weightSum(level->dictionarySize);
+  unsigned long long total = 0;
+  for(unsigned long long row = 0; row < columns->rows(); row++)
+  {
+    if(mask[row])
+    {
+      const auto code = columns->value(*level,row);
+      count[code]++;
+      weightSum[code] += columns->value(*weight,row);
+      total++;
+    }
+  }
+
+  QHash<long long,QString> names;
+  QSqlQuery levelNames("select id, name from memory_levels");
+  while(levelNames.next())
+  {
+    names.insert(levelNames.value(0).toLongLong(),levelNames.value(1).toString());
+  }
+  QMap<long long,unsigned int> levelCodes; // ordered by memory_level like the query
+  for(unsigned int code = 0; code < level->dictionarySize; code++)
+  {
+    if(count[code] != 0)
+    {
+      levelCodes.insert(columns->dictionaryValue(*level,code),code);
+    }
+  }
+  auto* model = new QStandardItemModel(0,4,this);
+  for(auto it = levelCodes.begin(); it != levelCodes.end(); ++it)
+  {
+    const auto n = count[it.value()];
+    QList<QStandardItem*> row;
+    row << new QStandardItem(names.value(it.key()));
+    row << new QStandardItem();
+    row.back()->setData(n,Qt::DisplayRole);
+    row << new QStandardItem();
+    row.back()->setData(static_cast<double>(weightSum[it.value()]) / n,Qt::DisplayRole);
+    row << new QStandardItem();
+    row.back()->setData(n * 100.0 / total,Qt::DisplayRole);
+    model->appendRow(row);
+  }
+  return model;
+}
+
 MemoryLevelWindow::~MemoryLevelWindow()
 {
   delete ui;
@@ -42,6 +42,7 @@ private:
   void printRemoteMemoryAccessFunctionsObjects(const QStringList &functionItems, QStringList objectItems);
   void printRemoteMemoryAccessFunctionsObjectsInclCache(const QStringList &functionItems, QStringList objectItems);
   QVariant executeSingleResultQuery(const QString &query) const;
+  QAbstractItemModel* levelsOfFunctionsFromColumns(const QString& dbPath, const QString& sqlItems);
 };
 
 #endif // MEMORYLEVELWINDOW_H
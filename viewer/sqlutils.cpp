@@ -109,3 +109,17 @@ unsigned int SqlUtils::executeSingleUnsignedIntQuery(QSqlQuery& q)
     return r.toUInt();
   }
 }
+
+bool SqlUtils::columnExists(const QString& table, const QString& column)
+{
+  // the constructor already executes the query
+  QSqlQuery tableInfo("PRAGMA table_info(" + table + ")");
+  while(tableInfo.next())
+  {
+    if(tableInfo.value("name") == column)
+    {
+      return true;
+    }
+  }
+  return false;
+}
@@ -17,6 +17,7 @@ public:
   static float executeSingleFloatQuery(QSqlQuery &q);
   static QString executeSingleStringQuery(QSqlQuery &q);
   static QVariant executeSingleResultQuery(QSqlQuery &q);
+  static bool columnExists(const QString& table, const QString& column);
 };
 
 #endif // SQLUTILS_H
@@ -42,7 +42,8 @@ SOURCES += \
     abstracttimelinewidget.cpp \
     autoanalysis.cpp \
     treeitem.cpp \
-    treemodel.cpp
+    treemodel.cpp \
+    ../prepareDatabase/samplecolumns.cpp
 
 HEADERS += \
         analysismain.h \
@@ -62,7 +63,10 @@ HEADERS += \
     abstracttimelinewidget.h \
     autoanalysis.h \
     treeitem.h \
-    treemodel.h
+    treemodel.h \
+    ../prepareDatabase/samplecolumns.h
+
+INCLUDEPATH += ../prepareDatabase
 
 FORMS += \
         analysismain.ui \